@@ -14,6 +14,14 @@
 #include <cstdarg>
 #include <cstdio>
 #include <algorithm>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 #ifdef _WIN32
 #include <windows.h>
 #endif
@@ -22,10 +30,46 @@ using namespace std;
 #define M_PI 3.14159265358979323846
 #endif
 #define MAX_STEPS_PER_FRAME 10000
+#define DEFAULT_TICK_RATE 30
+#define STAGE_WIDTH 480
+#define STAGE_HEIGHT 360
+#define MAX_PEN_QUALITY 4
+#define MAX_STAGE_QUALITY 4
 #define SPRITE_EDIT_WIDTH 180
 #define SPRITE_EDIT_HEIGHT 120
+#define CODE_SCRIPT_WIDTH 180
+#define CODE_SCRIPT_SPACING 10
+#define CODE_BLOCK_HEIGHT 40
+#define CODE_BLOCK_GAP 2
+#define CODE_MARGIN 10
+#define TEXT_CACHE_MAX_BYTES (16 * 1024 * 1024)
+#define BLOCK_TILE_ATLAS_SIZE 1024
+#define GLYPH_ATLAS_SIZE 512
+#define COSTUME_ATLAS_SIZE 2048
+#define MIP_MIN_SIZE 8
+#define PEN_MAX_DIRTY_RECTS 8
+#define BUBBLE_MAX_TEXT_WIDTH 170
+#define EFFECT_CACHE_MAX_BYTES (32 * 1024 * 1024)
+#define EFFECT_QUANT_STEP 2
+#define SIM_QUEUE_SIZE 64
+#define MASK_ALPHA_THRESHOLD 64
+#define MASK_MAX_SIZES 8
+// مثل Scratch فقط ۵ بیت بالای قرمز و سبز و ۴ بیت بالای آبی مقایسه می‌شود
+#define COLOR_MATCH_MASK 0x00F8F8F0u
+#define SPRITE_GRID_CELL 60
 SDL_Window* gWindow = NULL;
 struct Application* gApp = nullptr;
+SDL_mutex* gErrorLock = NULL;
+SDL_threadID gMainThread = 0;
+struct TextCache* gTextCache = nullptr;
+struct BlockTileAtlas* gBlockTiles = nullptr;
+vector<struct GlyphAtlas*> gGlyphAtlases;
+struct CostumeAtlas* gCostumeAtlas = nullptr;
+struct MipBuilder* gMipBuilder = nullptr;
+struct EffectCache* gEffectCache = nullptr;
+SDL_mutex* gMaskLock = NULL;
+vector<struct CollisionMask*> gRetiredMasks;
+SDL_mutex* gStageColorLock = NULL;
 //Value System
 struct Value {
     enum Type { VAL_NUMBER, VAL_STRING } type;
@@ -77,6 +121,8 @@ struct ExecutionContext;
 struct Block;
 struct Script;
 struct Costume;
+struct SpriteTickGroup;
+struct WorkerPool;
 
 struct LoopInfo {
     int start;
@@ -206,7 +252,9 @@ enum BlockType {
     BLOCK_IF_ON_EDGE_BOUNCE,
     BLOCK_ELSE,
     BLOCK_ENDIF,
-    BLOCK_ENDLOOP
+    BLOCK_ENDLOOP,
+    BLOCK_CHANGE_GHOST,
+    BLOCK_SET_GHOST
 };
 struct Block {
     BlockType type;
@@ -217,21 +265,67 @@ struct Block {
     vector<Block*> children;
     int bodyEnd;
     int elseStart;
+    // خانه‌ی تصویر آماده‌ی بلوک در اطلس ناحیه‌ی کد؛ با تغییر پارامترها باید tileDirty شود
+    int tileSlot = -1;
+    bool tileDirty = true;
 };
 
 struct Script {
     vector<Block*> blocks;
 };
 
+// سطح‌های نیم‌اندازه‌ی یک تصویر؛ در رشته‌ی جدا ساخته و اولین بار که لازم شوند آپلود می‌شوند
+struct MipLevel {
+    SDL_Texture* page;
+    SDL_Rect rect;
+    int texW, texH;
+    bool owned;
+};
+
+struct MipChain {
+    SDL_Surface* base;
+    vector<SDL_Surface*> surfaces;
+    vector<MipLevel> levels;
+    SDL_atomic_t ready;
+    bool uploaded;
+};
+
+// یک رشته برای ساختن همه‌ی زنجیره‌ها به ترتیب ورود
+struct MipBuilder {
+    SDL_Thread* thread;
+    SDL_mutex* lock;
+    SDL_cond* wake;
+    SDL_cond* done;
+    list<MipChain*> queue;
+    MipChain* building;
+    bool quit;
+};
+
+// یک بیت برای هر پیکسل (آلفا ≥ آستانه)؛ هر ردیف یک کلمه‌ی صفر اضافه دارد تا خواندن با جابه‌جایی بیت از ردیف بیرون نزند
+struct CollisionMask {
+    int w, h;
+    int stride;
+    vector<Uint64> bits;
+};
+
 struct Costume {
     string name;
     SDL_Texture* texture;
+    SDL_Surface* surface;
+    SDL_Texture* atlasPage;
+    SDL_Rect atlasRect;
+    MipChain* mips;
+    // ماسک با اندازه‌ی اصلی تصویر و نسخه‌های مقیاس‌شده برای اندازه‌هایی که روی صحنه دیده شده‌اند
+    CollisionMask* mask;
+    vector<CollisionMask*> scaledMasks;
 };
 
 struct Sprite {
     string name;
     float x;
     float y;
+    float prevX;
+    float prevY;
     float direction;
     float size;
     int visible;
@@ -245,7 +339,6 @@ struct Sprite {
     float penSaturation;
     float penBrightness;
     int penSize;
-    SDL_Texture* penCanvas;
     string sayText;
     string thinkText;
     Uint32 sayUntil;
@@ -253,11 +346,22 @@ struct Sprite {
     float colorEffect;
     float brightnessEffect;
     float saturationEffect;
+    float ghostEffect;
+    // حباب گفت‌وگو در بافت کش می‌شود؛ فقط رشته‌ی اصلی به این‌ها دست می‌زند
+    SDL_Texture* bubble = nullptr;
+    int bubbleW = 0, bubbleH = 0;
+    string bubbleText;
+    bool bubbleThink = false;
+    // در صف به‌روزرسانی شبکه‌ی صحنه است
+    bool gridQueued = false;
 };
 
 struct Backdrop {
     string name;
     SDL_Texture* texture;
+    MipChain* mips;
+    // نسخه‌ی ARGB برای خواندن رنگ روی CPU (لمس رنگ)
+    SDL_Surface* surface;
 };
 
 struct Sound {
@@ -272,14 +376,63 @@ struct Variable {
     Value value;
 };
 
+struct ShapeBatch {
+    vector<SDL_Vertex> vertices;
+    vector<int> indices;
+    SDL_Texture* texture = nullptr;
+};
+
+// لایه‌ی قلم در حافظه‌ی سیستم (ARGB8888)، فقط ناحیه‌های کثیف آپلود می‌شوند
+struct PenRaster {
+    int w, h;
+    vector<Uint32> pixels;
+    vector<SDL_Rect> dirty;
+};
+
+// شبکه‌ی یکنواخت روی صحنه تا پرسش‌های مکانی فقط اسپرایت‌های نزدیک را ببینند
+struct SpriteGrid {
+    vector<vector<int>> cells;
+    // خانه‌هایی که هر اسپرایت الان در آن‌هاست؛ w صفر یعنی در هیچ خانه‌ای نیست
+    vector<SDL_Rect> spans;
+    vector<int> dirty;
+    unordered_map<string, int> byName;
+    // بعد از افزودن/حذف/تغییر نام، اندیس‌ها دیگر معتبر نیستند و همه از نو چیده می‌شوند
+    bool stale;
+};
+
+// ورودی ماوس و صفحه‌کلید؛ رشته‌ی اصلی با simLock پر می‌کند تا شبیه‌سازی خودش SDL را صدا نزند
+struct InputState {
+    float mouseX, mouseY;
+    bool mouseDown;
+    Uint8 keys[SDL_NUM_SCANCODES];
+};
+
 struct Project {
     vector<Sprite*> sprites;
+    // ترتیب رسم از عقب به جلو؛ layer هر اسپرایت همان اندیسش در این لیست است
+    vector<Sprite*> drawOrder;
     vector<Backdrop*> backdrops;
     vector<Sound*> sounds;
     vector<Variable*> globalVariables;
     int currentBackdrop;
     string answer;
     Uint32 timerStart;
+    SDL_Texture* penLayer;
+    int penScale;
+    ShapeBatch penStrokes;
+    PenRaster* penRaster;
+    // پس‌زمینه و قلم با اندازه‌ی صحنه برای لمس رنگ؛ هر تیک یک بار و فقط در صورت نیاز ساخته می‌شود
+    vector<Uint32> stageColors;
+    SDL_atomic_t stageColorsValid;
+    // کپی لایه‌ی قلم GPU با اندازه‌ی صحنه؛ رشته‌ی اصلی بعد از رسم قلم و فقط وقتی لمس رنگ لازمش دارد بازخوانی می‌کند
+    SDL_Texture* penReadTarget;
+    vector<Uint32> penMirror;
+    bool penMirrorDirty;
+    SDL_atomic_t penMirrorWanted;
+    SpriteGrid grid;
+    InputState input;
+    // ویرایشگر ساختار پروژه را عوض کرده؛ handleEvents آن را به editSerial تبدیل می‌کند
+    bool edited;
 };
 
 struct ExecutionContext {
@@ -297,12 +450,193 @@ struct ExecutionContext {
     ExecutionContext* parent;
     int childrenLeft;
     bool waitingForChildren;
+    SpriteTickGroup* group;
+    bool finished;
+};
+
+enum ContextStepResult {
+    CONTEXT_IDLE,
+    CONTEXT_STEPPED,
+    CONTEXT_FINISHED,
+    CONTEXT_STOP_ALL
+};
+
+// تغییرات روی وضعیت مشترک در حالت موازی تا پایان تیک نگه داشته می‌شوند
+enum DeferredOpType {
+    DEFER_SET_VARIABLE,
+    DEFER_CHANGE_VARIABLE,
+    DEFER_SET_BACKDROP,
+    DEFER_NEXT_BACKDROP,
+    DEFER_BROADCAST,
+    DEFER_BROADCAST_AND_WAIT,
+    DEFER_PLAY_SOUND,
+    DEFER_PLAY_SOUND_UNTIL_DONE,
+    DEFER_STOP_ALL_SOUNDS,
+    DEFER_CHANGE_VOLUME,
+    DEFER_SET_VOLUME,
+    DEFER_RESET_TIMER,
+    DEFER_ASK,
+    DEFER_PEN_LINE,
+    DEFER_PEN_STAMP,
+    DEFER_PEN_ERASE,
+    DEFER_GO_TO_LAYER,
+    DEFER_CHANGE_LAYER
+};
+
+struct DeferredOp {
+    DeferredOpType type;
+    ExecutionContext* ctx;
+    Sprite* sprite;
+    SDL_Texture* texture;
+    SDL_Surface* surface;
+    string name;
+    Value value;
+    float num;
+    int x1, y1, x2, y2;
+    SDL_Color color;
+    int size;
+
+    DeferredOp() : type(DEFER_SET_VARIABLE), ctx(NULL), sprite(NULL), texture(NULL), surface(NULL), num(0),
+                   x1(0), y1(0), x2(0), y2(0), size(1) { color.r = color.g = color.b = color.a = 0; }
+};
+
+struct SpritePose {
+    float x;
+    float y;
+    float size;
+    int visible;
+    // برای نمونه‌برداری رنگ/ماسک اسپرایت‌های دیگر در تیک موازی
+    int costume;
+    float ghost;
+    float brightness;
+};
+
+struct SpriteTickGroup {
+    int spriteId;
+    vector<ExecutionContext*> contexts;
+    vector<DeferredOp> ops;
+    vector<Variable> localVariables;
+    const vector<SpritePose>* poses;
+    // مولد تصادفی جدا برای هر اسپرایت تا نتیجه به زمان‌بندی رشته‌ها بستگی نداشته باشد
+    Uint32 rng;
+    int steps;
+    bool stopAll;
 };
 
 struct ExecutionEngine {
     Project* project;
     vector<ExecutionContext*> contexts;
     bool stepMode;
+    bool parallel;
+    WorkerPool* pool;
+    vector<SpriteTickGroup*> groups;
+    vector<SpriteTickGroup*> activeGroups;
+    vector<SpritePose> poses;
+    // کارهایی که به رندرر یا ورودی متن نیاز دارند و باید در رشته‌ی اصلی اجرا شوند
+    vector<DeferredOp> mainOps;
+};
+
+struct WorkerQueue {
+    SDL_atomic_t next;
+    int end;
+};
+
+struct WorkerThread {
+    WorkerPool* pool;
+    int index;
+    SDL_Thread* thread;
+};
+
+struct WorkerPool {
+    vector<WorkerThread*> threads;
+    vector<WorkerQueue> queues;
+    SDL_mutex* lock;
+    SDL_cond* wake;
+    SDL_cond* done;
+    int generation;
+    int pending;
+    bool quit;
+    ExecutionEngine* engine;
+    Uint32 currentTime;
+};
+
+// وضعیت رسم یک اسپرایت در پایان یک تیک
+struct SpriteSnapshot {
+    Sprite* sprite;
+    float x, y;
+    float prevX, prevY;
+    float size;
+    int costume;
+    // لباس و زمینه موقع انتشار حل می‌شوند تا رسم به فهرست‌های زنده‌ی پروژه دست نزند
+    Costume* shown;
+    float colorEffect;
+    float brightnessEffect;
+    float saturationEffect;
+    float ghostEffect;
+    string bubbleText;
+    bool think;
+    Uint32 bubbleUntil;
+};
+
+// عکس تغییرناپذیر صحنه که رشته‌ی شبیه‌سازی بعد از هر دور منتشر می‌کند
+struct StageSnapshot {
+    Project* project;
+    vector<SpriteSnapshot> sprites;
+    int currentBackdrop;
+    Backdrop* backdrop;
+    bool running;
+    bool active;
+    int tickRate;
+    double accumulator;
+    Uint64 publishedAt;
+    Uint32 editSerial;
+};
+
+// یک خانه برای نوشتن، یک خانه برای خواندن و یکی برای آخرین عکس؛ latest با جابه‌جایی اتمی عوض می‌شود
+#define SNAPSHOT_FRESH 4
+struct SnapshotBuffer {
+    StageSnapshot slots[3];
+    int writeSlot;
+    int readSlot;
+    SDL_atomic_t latest;
+};
+
+enum SimCommandType {
+    SIM_START,
+    SIM_STOP,
+    SIM_STEP,
+    SIM_TOGGLE_PAUSE,
+    SIM_TOGGLE_PARALLEL,
+    SIM_KEY,
+    SIM_CLICK,
+    SIM_ANSWER
+};
+
+struct SimCommand {
+    SimCommandType type;
+    int value;
+    char text[256];
+};
+
+// صف حلقوی بدون قفل: فقط رشته‌ی اصلی tail و فقط رشته‌ی شبیه‌سازی head را جلو می‌برد
+struct SimCommandQueue {
+    SimCommand items[SIM_QUEUE_SIZE];
+    SDL_atomic_t head;
+    SDL_atomic_t tail;
+};
+
+enum PanelId {
+    PANEL_MENU = 1 << 0,
+    PANEL_VARIABLES = 1 << 1,
+    PANEL_PALETTE = 1 << 2,
+    PANEL_CODE = 1 << 3,
+    PANEL_STAGE = 1 << 4,
+    PANEL_SPRITES = 1 << 5,
+    PANEL_BACKDROPS = 1 << 6,
+    PANEL_SOUNDS = 1 << 7,
+    PANEL_PEN = 1 << 8,
+    PANEL_ALL = (1 << 9) - 1,
+    PANEL_LIVE = PANEL_VARIABLES | PANEL_CODE | PANEL_SPRITES | PANEL_BACKDROPS | PANEL_SOUNDS | PANEL_PEN
 };
 
 struct Application {
@@ -337,6 +671,40 @@ struct Application {
     char textInputBuffer[256];
     char lastError[256];
     Uint32 errorTime;
+    int tickRate;
+    Uint64 lastCounter;
+    double tickAccumulator;
+    double simTime;
+    float renderAlpha;
+    bool vsync;
+    bool cpuPen;
+    int penQuality;
+    int stageQuality;
+    SDL_Texture* stageTarget;
+    int stageTargetQuality;
+    double frameInterval;
+    SDL_Texture* uiLayer;
+    int uiLayerW, uiLayerH;
+    Uint32 dirtyPanels;
+    bool errorVisible;
+    int visibleBubbles;
+    // موتور در رشته‌ی خودش اجرا می‌شود؛ simLock دور هر دور شبیه‌سازی و هر ویرایش رابط گرفته می‌شود
+    SDL_Thread* simThread;
+    SDL_mutex* simLock;
+    SDL_sem* simWake;
+    SDL_atomic_t simRunning;
+    SDL_atomic_t wakePending;
+    Uint32 snapshotEvent;
+    Uint32 editSerial;
+    SimCommandQueue commands;
+    SnapshotBuffer snapshots;
+    const StageSnapshot* snapshot;
+    // حالت نمایش (F11): فقط صحنه در کل پنجره؛ رشته‌ی شبیه‌سازی هم مستطیل صحنه را از این می‌خواند
+    SDL_atomic_t presenting;
+    bool showFps;
+    int fpsFrames;
+    Uint32 fpsStart;
+    int fps;
 };
 
 struct SpriteManagerUI {
@@ -430,6 +798,76 @@ struct CodeAreaUI {
     string editBuffer;
     TTF_Font* font;
 };
+// کش متن‌های رندر شده
+struct CachedText {
+    string key;
+    SDL_Texture* texture;
+    int w, h;
+    size_t bytes;
+};
+
+struct TextCache {
+    SDL_Renderer* renderer;
+    list<CachedText*> lru;
+    unordered_map<string, list<CachedText*>::iterator> index;
+    size_t bytes;
+    size_t maxBytes;
+};
+// اطلس گلیف برای متن‌هایی که هر فریم عوض می‌شوند
+struct Glyph {
+    SDL_Rect src;
+    int advance;
+};
+
+struct GlyphAtlas {
+    SDL_Renderer* renderer;
+    TTF_Font* font;
+    SDL_Texture* texture;
+    int penX, penY, rowH;
+    unordered_map<Uint32, Glyph> glyphs;
+    vector<SDL_Vertex> vertices;
+    vector<int> indices;
+    vector<Uint32> shaped;
+};
+
+// صفحه‌های مشترک لباس‌ها تا همه‌ی اسپرایت‌ها با چند فراخوانی رسم شوند
+struct CostumeAtlasPage {
+    SDL_Texture* texture;
+    int penX, penY, rowH;
+    // تعداد تصویرهایی که هنوز روی این صفحه‌اند؛ با صفر شدن صفحه آزاد می‌شود
+    int users;
+};
+
+struct CostumeAtlas {
+    SDL_Renderer* renderer;
+    vector<CostumeAtlasPage*> pages;
+};
+
+// نسخه‌ی رنگ‌شده‌ی یک لباس برای مقدارهای کوانتیزه‌شده‌ی جلوه‌ها
+struct EffectVariant {
+    string key;
+    Costume* costume;
+    SDL_Texture* texture;
+    size_t bytes;
+};
+
+// تصویر بلوک‌ها در خانه‌های هم‌اندازه‌ی یک بافت؛ کم‌استفاده‌ترین خانه به بلوک تازه داده می‌شود
+struct BlockTileAtlas {
+    SDL_Renderer* renderer;
+    SDL_Texture* page;
+    int tileW, tileH, columns;
+    vector<Block*> owners;
+    list<int> lru;
+    vector<list<int>::iterator> where;
+};
+
+struct EffectCache {
+    SDL_Renderer* renderer;
+    list<EffectVariant*> lru;
+    unordered_map<string, list<EffectVariant*>::iterator> index;
+    size_t bytes;
+    size_t maxBytes;
+};
 // Function declarations
 void free_block(Block* b);
 bool Application_init(Application* app);
@@ -438,6 +876,36 @@ void Application_handleEvents(Application* app);
 void Application_update(Application* app);
 void Application_render(Application* app);
 void Application_shutdown(Application* app);
+void Application_snapSpritePositions(Application* app);
+int Application_idleTimeout(Application* app);
+void Application_layout(Application* app, int winW, int winH);
+bool Application_beginPanel(Application* app, Uint32 panel, SDL_Rect rect);
+void Application_markDirty(Application* app, Uint32 panels);
+void Application_markDirtyAt(Application* app, int x, int y);
+void Application_markDirtyForEvent(Application* app, SDL_Event* e);
+void Application_checkTimers(Application* app);
+void Application_renderMenu(Application* app);
+void Application_renderVariables(Application* app);
+void Application_renderStage(Application* app);
+void Application_paceFrame(Application* app, Uint64 frameStart);
+void Application_startSimulation(Application* app);
+void Application_stopSimulation(Application* app);
+int Application_simThreadMain(void* data);
+int Application_simulate(Application* app);
+int Application_simTimeout(Application* app);
+void Application_wakeSimulation(Application* app);
+void Application_sampleInput(Application* app);
+void Application_sendCommand(Application* app, SimCommandType type, int value, const char* text);
+void Application_applyCommand(Application* app, const SimCommand& cmd);
+void Application_publishSnapshot(Application* app);
+void Application_acquireSnapshot(Application* app);
+bool Application_snapshotCurrent(Application* app);
+void Application_updateRenderAlpha(Application* app);
+void Application_renderPresentation(Application* app, int winW, int winH);
+void Application_renderFps(Application* app);
+bool SimCommandQueue_push(SimCommandQueue* queue, const SimCommand& cmd);
+bool SimCommandQueue_pop(SimCommandQueue* queue, SimCommand* cmd);
+int ExecutionEngine_nextWake(ExecutionEngine* eng, Uint32 now);
 Project* Project_create();
 void Project_destroy(Project* proj);
 bool Project_save(Project* proj, const char* filename);
@@ -451,13 +919,37 @@ void Sprite_addCostumeFromFile(Sprite* sprite, SDL_Renderer* renderer, const cha
 ExecutionEngine* ExecutionEngine_create(Project* proj);
 void ExecutionEngine_destroy(ExecutionEngine* eng);
 void ExecutionEngine_step(ExecutionEngine* eng, Uint32 currentTime);
+int ExecutionEngine_stepContext(ExecutionEngine* eng, ExecutionContext* ctx, Uint32 currentTime);
+void ExecutionEngine_stepParallel(ExecutionEngine* eng, Uint32 currentTime);
+void ExecutionEngine_setParallel(ExecutionEngine* eng, bool enabled);
+void ExecutionEngine_submit(ExecutionEngine* eng, ExecutionContext* ctx, DeferredOp& op);
+void ExecutionEngine_applyOp(ExecutionEngine* eng, DeferredOp* op, bool deferred);
+void ExecutionEngine_penLine(ExecutionEngine* eng, ExecutionContext* ctx, Sprite* sprite, float fromX, float fromY, float toX, float toY);
+void ExecutionEngine_runGroup(ExecutionEngine* eng, SpriteTickGroup* group, Uint32 currentTime);
+void ExecutionContext_unwindLoops(ExecutionContext* ctx);
+Value ExecutionContext_getVariable(ExecutionContext* ctx, Project* proj, const string& name);
+void ExecutionContext_setVariable(ExecutionEngine* eng, ExecutionContext* ctx, const string& name, const Value& val);
+void ExecutionContext_changeVariable(ExecutionEngine* eng, ExecutionContext* ctx, const string& name, float delta);
+void ExecutionContext_setLocal(ExecutionContext* ctx, const string& name, const Value& val);
+SpritePose Sprite_pose(Sprite* sprite);
+SpritePose ExecutionContext_spritePose(ExecutionContext* ctx, Project* proj, int spriteIndex);
+float ExecutionContext_random(ExecutionContext* ctx);
+WorkerPool* WorkerPool_create(int threadCount);
+int WorkerPool_threadMain(void* data);
+void WorkerPool_runQueues(WorkerPool* pool, int self);
+void WorkerPool_destroy(WorkerPool* pool);
+void WorkerPool_run(WorkerPool* pool, ExecutionEngine* eng, Uint32 currentTime);
 void ExecutionEngine_run(ExecutionEngine* eng);
 void ExecutionEngine_stop(ExecutionEngine* eng);
 void ExecutionEngine_addContext(ExecutionEngine* eng, int spriteId, int scriptId);
 void ExecutionEngine_addChildContext(ExecutionEngine* eng, int spriteId, int scriptId, ExecutionContext* parent);
 void ExecutionEngine_removeContext(ExecutionEngine* eng, int index);
 void ExecutionEngine_startKeyScripts(ExecutionEngine* eng, SDL_Keycode key);
-int ExecutionEngine_startSpriteClickScripts(ExecutionEngine* eng, int mouseX, int mouseY, SDL_Rect stageRect);
+int Project_spriteAt(Project* proj, float stageX, float stageY);
+void ExecutionEngine_startSpriteClickScripts(ExecutionEngine* eng, int spriteIndex);
+bool ExecutionEngine_deferToMain(ExecutionEngine* eng, DeferredOp* op);
+void ExecutionEngine_applyMainOps(ExecutionEngine* eng);
+void ExecutionEngine_forgetSprite(ExecutionEngine* eng, Sprite* sprite);
 SpriteManagerUI* SpriteManagerUI_create(SDL_Renderer* ren, Project* proj);
 void SpriteManagerUI_destroy(SpriteManagerUI* ui);
 void SpriteManagerUI_render(SpriteManagerUI* ui);
@@ -480,16 +972,19 @@ void PenToolUI_handleEvent(PenToolUI* ui, SDL_Event* e, Application* app);
 BlockPaletteUI* BlockPaletteUI_create(SDL_Renderer* ren, Project* proj, CodeAreaUI* codeArea);
 void BlockPaletteUI_destroy(BlockPaletteUI* ui);
 void BlockPaletteUI_render(BlockPaletteUI* ui);
+void BlockPaletteUI_renderDragPreview(BlockPaletteUI* ui);
 void BlockPaletteUI_handleEvent(BlockPaletteUI* ui, SDL_Event* e);
 CodeAreaUI* CodeAreaUI_create(SDL_Renderer* ren, Project* proj, ExecutionEngine* engine);
 void CodeAreaUI_destroy(CodeAreaUI* ui);
 void CodeAreaUI_render(CodeAreaUI* ui);
 void CodeAreaUI_handleEvent(CodeAreaUI* ui, SDL_Event* e);
 void CodeAreaUI_addBlockAt(CodeAreaUI* ui, int blockType, int screenX, int screenY);
-void Application_createPenCanvasForSprite(Application* app, Sprite* sprite);
+void Application_createPenLayer(Application* app);
+SDL_Rect stageRectForSize(int winW, int winH);
+SDL_Rect stageRectForWindow(SDL_Window* window);
+SDL_Rect stageViewRect(SDL_Rect sceneRect);
+void screenToStage(SDL_Rect sceneRect, int x, int y, float* outX, float* outY);
 SDL_Color hslToRgb(float h, float s, float l);
-void drawLineOnCanvas(SDL_Renderer* renderer, SDL_Texture* canvas, int x1, int y1, int x2, int y2, SDL_Color color, int size);
-int compareSpritesByLayer(const void* a, const void* b);
 void preprocess_script(Script* script);
 SDL_Texture* loadTexture(SDL_Renderer* renderer, const char* path);
 int findSoundByName(Project* proj, const char* name);
@@ -499,19 +994,430 @@ Value getVariable(Project* proj, const string& name);
 Value evaluateBlock(Block* b, ExecutionContext* ctx, Project* proj);
 SDL_Scancode keyNameToScancode(const char* name);
 bool findBlockAt(CodeAreaUI* ui, int mouseX, int mouseY, int* outScriptIndex, int* outBlockIndex);
+SDL_Texture* CodeAreaUI_blockTile(CodeAreaUI* ui, Block* block, SDL_Rect* src);
+BlockTileAtlas* BlockTileAtlas_create(SDL_Renderer* renderer, int tileW, int tileH);
+void BlockTileAtlas_destroy(BlockTileAtlas* atlas);
+void BlockTileAtlas_release(BlockTileAtlas* atlas, Block* block);
+void BlockTileAtlas_invalidate(BlockTileAtlas* atlas);
+TextCache* TextCache_create(SDL_Renderer* renderer, size_t maxBytes);
+void TextCache_destroy(TextCache* cache);
+CachedText* TextCache_get(TextCache* cache, TTF_Font* font, const char* text, SDL_Color color);
+void shapeText(const char* utf8, vector<Uint32>& out);
+GlyphAtlas* GlyphAtlas_forFont(SDL_Renderer* renderer, TTF_Font* font);
+void GlyphAtlas_destroy(GlyphAtlas* atlas);
+const Glyph* GlyphAtlas_glyph(GlyphAtlas* atlas, Uint32 codepoint);
+int GlyphAtlas_addText(GlyphAtlas* atlas, const char* text, int x, int y, SDL_Color color);
+int GlyphAtlas_measure(GlyphAtlas* atlas, const char* text);
+void GlyphAtlas_flush(GlyphAtlas* atlas);
+int drawGlyphText(SDL_Renderer* renderer, TTF_Font* font, const char* text, int x, int y, SDL_Color color);
+void ShapeBatch_addRoundedRect(ShapeBatch* batch, SDL_Rect rect, int radius, SDL_Color color);
+void ShapeBatch_flush(SDL_Renderer* renderer, ShapeBatch* batch);
+void ShapeBatch_addCircle(ShapeBatch* batch, float cx, float cy, float radius, SDL_Color color);
+void ShapeBatch_addLine(ShapeBatch* batch, float x1, float y1, float x2, float y2, float width, SDL_Color color);
+void Project_queuePenLine(Project* proj, int x1, int y1, int x2, int y2, SDL_Color color, int size);
+void Project_flushPen(Project* proj, SDL_Renderer* renderer);
+void Project_readBackPen(Project* proj, SDL_Renderer* renderer);
+void Project_stageToPen(Project* proj, float x, float y, int* outX, int* outY);
+void Project_addSprite(Project* proj, Sprite* sprite);
+void wrapText(GlyphAtlas* atlas, const string& text, int maxWidth, vector<string>& lines);
+SDL_Texture* Sprite_bubble(Sprite* sprite, const string& text, bool think, SDL_Renderer* renderer, TTF_Font* font);
+void Project_removeSprite(Project* proj, Sprite* sprite);
+void Project_setLayer(Project* proj, Sprite* sprite, int rank);
+void Project_sortDrawOrder(Project* proj);
+PenRaster* PenRaster_create(int w, int h);
+void PenRaster_markDirty(PenRaster* r, SDL_Rect rect);
+void PenRaster_blendSpan(Uint32* dst, Uint32 color, int n);
+void PenRaster_blendRow(Uint32* dst, const Uint32* src, int n);
+void PenRaster_clear(PenRaster* r);
+void PenRaster_line(PenRaster* r, float x1, float y1, float x2, float y2, float width, SDL_Color color);
+void PenRaster_stamp(PenRaster* r, SDL_Surface* surface, SDL_Rect dst);
+void PenRaster_upload(PenRaster* r, SDL_Texture* texture);
+void ShapeBatch_addQuad(ShapeBatch* batch, SDL_Rect dst, SDL_Rect src, int texW, int texH, SDL_Color color);
+CostumeAtlas* CostumeAtlas_create(SDL_Renderer* renderer);
+void CostumeAtlas_destroy(CostumeAtlas* atlas);
+bool CostumeAtlas_add(CostumeAtlas* atlas, SDL_Surface* surface, Costume* costume);
+bool CostumeAtlas_place(CostumeAtlas* atlas, SDL_Surface* argb, SDL_Texture** outPage, SDL_Rect* outRect);
+void CostumeAtlas_release(CostumeAtlas* atlas, SDL_Texture* page);
+SDL_Surface* halveSurface(SDL_Surface* src);
+void MipChain_build(MipChain* chain);
+MipChain* MipChain_create(SDL_Surface* surface);
+MipBuilder* MipBuilder_create();
+void MipBuilder_destroy(MipBuilder* builder);
+void MipChain_destroy(MipChain* chain);
+const MipLevel* MipChain_level(MipChain* chain, SDL_Renderer* renderer, int w, int h);
+void buildEffectMatrix(float color, float brightness, float saturation, float m[9]);
+void applyColorMatrixRow(Uint32* dst, const Uint32* src, int n, const float m[9]);
+EffectCache* EffectCache_create(SDL_Renderer* renderer, size_t maxBytes);
+void EffectCache_destroy(EffectCache* cache);
+CollisionMask* CollisionMask_fromSurface(SDL_Surface* argb);
+CollisionMask* CollisionMask_scaled(const CollisionMask* src, int side);
+bool CollisionMask_test(const CollisionMask* m, int x, int y);
+bool CollisionMask_overlap(const CollisionMask* a, SDL_Rect ra, const CollisionMask* b, SDL_Rect rb);
+void CollisionMask_collectRetired();
+const CollisionMask* Costume_maskAtSize(Costume* costume, int side);
+void Costume_freeMasks(Costume* costume);
+SDL_Rect spriteFootprint(float x, float y, float size);
+const CollisionMask* Sprite_mask(Sprite* sprite, int costume, int side);
+void SpriteGrid_place(Project* proj, int spriteIndex);
+void SpriteGrid_sync(Project* proj);
+void SpriteGrid_query(Project* proj, SDL_Rect area, vector<int>& out);
+void Project_spriteMoved(Project* proj, ExecutionContext* ctx, int spriteIndex);
+int Project_findSprite(Project* proj, const string& name);
+const Uint32* Project_stageColors(Project* proj);
+bool ExecutionContext_touchingColor(ExecutionContext* ctx, Project* proj, Uint32 color, bool withOwn, Uint32 ownColor);
+void EffectCache_forget(EffectCache* cache, Costume* costume);
+SDL_Texture* EffectCache_get(EffectCache* cache, Costume* costume, float color, float brightness, float saturation);
 
 void setError(Application* app, const char* format, ...) {
+    if (gErrorLock) SDL_LockMutex(gErrorLock);
     va_list args;
     va_start(args, format);
     vsnprintf(app->lastError, sizeof(app->lastError), format, args);
     va_end(args);
     app->errorTime = SDL_GetTicks();
     printf("Error: %s\n", app->lastError);
+    if (gErrorLock) SDL_UnlockMutex(gErrorLock);
+}
+
+TextCache* TextCache_create(SDL_Renderer* renderer, size_t maxBytes) {
+    TextCache* cache = new TextCache;
+    cache->renderer = renderer;
+    cache->bytes = 0;
+    cache->maxBytes = maxBytes;
+    return cache;
+}
+
+void TextCache_destroy(TextCache* cache) {
+    if (!cache) return;
+    for (CachedText* entry : cache->lru) {
+        if (entry->texture) SDL_DestroyTexture(entry->texture);
+        delete entry;
+    }
+    delete cache;
+}
+
+CachedText* TextCache_get(TextCache* cache, TTF_Font* font, const char* text, SDL_Color color) {
+    if (!cache || !font || !text || !text[0]) return nullptr;
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "%p:%02x%02x%02x%02x:", (void*)font, color.r, color.g, color.b, color.a);
+    string key = string(prefix) + text;
+    auto it = cache->index.find(key);
+    if (it != cache->index.end()) {
+        cache->lru.splice(cache->lru.begin(), cache->lru, it->second);
+        return *it->second;
+    }
+    SDL_Surface* surf = TTF_RenderText_Blended(font, text, color);
+    if (!surf) return nullptr;
+    SDL_Texture* tex = SDL_CreateTextureFromSurface(cache->renderer, surf);
+    if (!tex) { SDL_FreeSurface(surf); return nullptr; }
+    CachedText* entry = new CachedText;
+    entry->key = key;
+    entry->texture = tex;
+    entry->w = surf->w;
+    entry->h = surf->h;
+    entry->bytes = (size_t)surf->w * surf->h * 4;
+    SDL_FreeSurface(surf);
+    cache->lru.push_front(entry);
+    cache->index[key] = cache->lru.begin();
+    cache->bytes += entry->bytes;
+    // حذف قدیمی‌ترین‌ها وقتی از سقف رد شدیم (ورودی تازه حذف نمی‌شود)
+    while (cache->bytes > cache->maxBytes && cache->lru.size() > 1) {
+        CachedText* old = cache->lru.back();
+        cache->lru.pop_back();
+        cache->index.erase(old->key);
+        cache->bytes -= old->bytes;
+        if (old->texture) SDL_DestroyTexture(old->texture);
+        delete old;
+    }
+    return entry;
+}
+
+// فرم‌های نمایشی حروف فارسی/عربی: تنها، پایانی، آغازی، میانی (صفر یعنی به بعدی نمی‌چسبد)
+struct ArabicForms {
+    Uint32 base;
+    Uint32 isolated, final, initial, medial;
+};
+
+const ArabicForms ARABIC_FORMS[] = {
+    {0x0621, 0xFE80, 0, 0, 0},
+    {0x0622, 0xFE81, 0xFE82, 0, 0},
+    {0x0623, 0xFE83, 0xFE84, 0, 0},
+    {0x0624, 0xFE85, 0xFE86, 0, 0},
+    {0x0625, 0xFE87, 0xFE88, 0, 0},
+    {0x0626, 0xFE89, 0xFE8A, 0xFE8B, 0xFE8C},
+    {0x0627, 0xFE8D, 0xFE8E, 0, 0},
+    {0x0628, 0xFE8F, 0xFE90, 0xFE91, 0xFE92},
+    {0x0629, 0xFE93, 0xFE94, 0, 0},
+    {0x062A, 0xFE95, 0xFE96, 0xFE97, 0xFE98},
+    {0x062B, 0xFE99, 0xFE9A, 0xFE9B, 0xFE9C},
+    {0x062C, 0xFE9D, 0xFE9E, 0xFE9F, 0xFEA0},
+    {0x062D, 0xFEA1, 0xFEA2, 0xFEA3, 0xFEA4},
+    {0x062E, 0xFEA5, 0xFEA6, 0xFEA7, 0xFEA8},
+    {0x062F, 0xFEA9, 0xFEAA, 0, 0},
+    {0x0630, 0xFEAB, 0xFEAC, 0, 0},
+    {0x0631, 0xFEAD, 0xFEAE, 0, 0},
+    {0x0632, 0xFEAF, 0xFEB0, 0, 0},
+    {0x0633, 0xFEB1, 0xFEB2, 0xFEB3, 0xFEB4},
+    {0x0634, 0xFEB5, 0xFEB6, 0xFEB7, 0xFEB8},
+    {0x0635, 0xFEB9, 0xFEBA, 0xFEBB, 0xFEBC},
+    {0x0636, 0xFEBD, 0xFEBE, 0xFEBF, 0xFEC0},
+    {0x0637, 0xFEC1, 0xFEC2, 0xFEC3, 0xFEC4},
+    {0x0638, 0xFEC5, 0xFEC6, 0xFEC7, 0xFEC8},
+    {0x0639, 0xFEC9, 0xFECA, 0xFECB, 0xFECC},
+    {0x063A, 0xFECD, 0xFECE, 0xFECF, 0xFED0},
+    {0x0640, 0x0640, 0x0640, 0x0640, 0x0640},
+    {0x0641, 0xFED1, 0xFED2, 0xFED3, 0xFED4},
+    {0x0642, 0xFED5, 0xFED6, 0xFED7, 0xFED8},
+    {0x0643, 0xFED9, 0xFEDA, 0xFEDB, 0xFEDC},
+    {0x0644, 0xFEDD, 0xFEDE, 0xFEDF, 0xFEE0},
+    {0x0645, 0xFEE1, 0xFEE2, 0xFEE3, 0xFEE4},
+    {0x0646, 0xFEE5, 0xFEE6, 0xFEE7, 0xFEE8},
+    {0x0647, 0xFEE9, 0xFEEA, 0xFEEB, 0xFEEC},
+    {0x0648, 0xFEED, 0xFEEE, 0, 0},
+    {0x0649, 0xFEEF, 0xFEF0, 0, 0},
+    {0x064A, 0xFEF1, 0xFEF2, 0xFEF3, 0xFEF4},
+    {0x067E, 0xFB56, 0xFB57, 0xFB58, 0xFB59},
+    {0x0686, 0xFB7A, 0xFB7B, 0xFB7C, 0xFB7D},
+    {0x0698, 0xFB8A, 0xFB8B, 0, 0},
+    {0x06A9, 0xFB8E, 0xFB8F, 0xFB90, 0xFB91},
+    {0x06AF, 0xFB92, 0xFB93, 0xFB94, 0xFB95},
+    {0x06CC, 0xFBFC, 0xFBFD, 0xFBFE, 0xFBFF},
+};
+
+const ArabicForms* findArabicForms(Uint32 c) {
+    for (const ArabicForms& f : ARABIC_FORMS) {
+        if (f.base == c) return &f;
+    }
+    return nullptr;
+}
+
+bool isArabicMark(Uint32 c) {
+    return (c >= 0x064B && c <= 0x065F) || c == 0x0670;
+}
+
+bool isRtlChar(Uint32 c) {
+    if ((c >= 0x0660 && c <= 0x0669) || (c >= 0x06F0 && c <= 0x06F9)) return false;
+    return (c >= 0x0590 && c <= 0x08FF) || (c >= 0xFB1D && c <= 0xFDFF) || (c >= 0xFE70 && c <= 0xFEFF);
+}
+
+bool isStrongLtrChar(Uint32 c) {
+    if (c < 0x80) return isalnum((int)c) != 0;
+    if ((c >= 0x0660 && c <= 0x0669) || (c >= 0x06F0 && c <= 0x06F9)) return true;
+    return !isRtlChar(c) && c >= 0x00C0 && c < 0x2000;
+}
+
+// UTF-8 -> نقاط کد به ترتیب نمایش، با اتصال حروف فارسی و برگرداندن بخش‌های راست‌به‌چپ
+void shapeText(const char* utf8, vector<Uint32>& out) {
+    out.clear();
+    vector<Uint32> cps;
+    const unsigned char* p = (const unsigned char*)utf8;
+    while (*p) {
+        Uint32 c = *p;
+        int extra = 0;
+        if (c >= 0xF0) { c &= 0x07; extra = 3; }
+        else if (c >= 0xE0) { c &= 0x0F; extra = 2; }
+        else if (c >= 0xC0) { c &= 0x1F; extra = 1; }
+        else if (c >= 0x80) { p++; continue; }
+        p++;
+        for (int i = 0; i < extra && (*p & 0xC0) == 0x80; i++, p++) {
+            c = (c << 6) | (*p & 0x3F);
+        }
+        // انتخاب‌گرهای حالت و اتصال‌دهنده‌های نامرئی رسم نمی‌شوند
+        if (c == 0xFE0F || c == 0xFE0E || c == 0x200D) continue;
+        cps.push_back(c);
+    }
+
+    size_t n = cps.size();
+    out.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        Uint32 c = cps[i];
+        const ArabicForms* forms = findArabicForms(c);
+        if (!forms) { out.push_back(c); continue; }
+        size_t prev = i, next = i + 1;
+        while (prev > 0 && isArabicMark(cps[prev - 1])) prev--;
+        while (next < n && isArabicMark(cps[next])) next++;
+        const ArabicForms* before = prev > 0 ? findArabicForms(cps[prev - 1]) : nullptr;
+        const ArabicForms* after = next < n ? findArabicForms(cps[next]) : nullptr;
+        bool joinBefore = before && before->initial != 0 && forms->final != 0;
+        bool joinAfter = after && after->final != 0 && forms->initial != 0;
+        // لام‌الف
+        if (c == 0x0644 && after && (cps[next] == 0x0627 || cps[next] == 0x0622 || cps[next] == 0x0623 || cps[next] == 0x0625)) {
+            Uint32 base = cps[next] == 0x0627 ? 0xFEFB : cps[next] == 0x0622 ? 0xFEF5 : cps[next] == 0x0623 ? 0xFEF7 : 0xFEF9;
+            out.push_back(joinBefore ? base + 1 : base);
+            for (size_t k = i + 1; k < next; k++) out.push_back(cps[k]);
+            i = next;
+            continue;
+        }
+        if (joinBefore && joinAfter) out.push_back(forms->medial);
+        else if (joinBefore) out.push_back(forms->final ? forms->final : forms->isolated);
+        else if (joinAfter) out.push_back(forms->initial);
+        else out.push_back(forms->isolated);
+    }
+
+    // جهت پاراگراف از اولین حرف قوی
+    bool rtlBase = false;
+    for (Uint32 c : out) {
+        if (isRtlChar(c)) { rtlBase = true; break; }
+        if (isStrongLtrChar(c)) break;
+    }
+    n = out.size();
+    vector<char> rtl(n);
+    for (size_t i = 0; i < n; i++) {
+        if (isRtlChar(out[i])) rtl[i] = 1;
+        else if (isStrongLtrChar(out[i])) rtl[i] = 0;
+        else rtl[i] = -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (rtl[i] != -1) continue;
+        size_t j = i;
+        while (j < n && rtl[j] == -1) j++;
+        char left = i > 0 ? rtl[i - 1] : (char)rtlBase;
+        char right = j < n ? rtl[j] : (char)rtlBase;
+        char dir = left == right ? left : (char)rtlBase;
+        for (size_t k = i; k < j; k++) rtl[k] = dir;
+        i = j - 1;
+    }
+    char flip = rtlBase ? 0 : 1;
+    if (rtlBase) {
+        reverse(out.begin(), out.end());
+        reverse(rtl.begin(), rtl.end());
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (rtl[i] != flip) continue;
+        size_t j = i;
+        while (j < n && rtl[j] == flip) j++;
+        reverse(out.begin() + i, out.begin() + j);
+        i = j - 1;
+    }
+}
+
+GlyphAtlas* GlyphAtlas_forFont(SDL_Renderer* renderer, TTF_Font* font) {
+    if (!renderer || !font) return nullptr;
+    for (GlyphAtlas* atlas : gGlyphAtlases) {
+        if (atlas->font == font && atlas->renderer == renderer) return atlas;
+    }
+    SDL_Texture* tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC,
+                                         GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE);
+    if (!tex) {
+        printf("Failed to create glyph atlas: %s\n", SDL_GetError());
+        return nullptr;
+    }
+    vector<Uint32> blank(GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE, 0);
+    SDL_UpdateTexture(tex, NULL, blank.data(), GLYPH_ATLAS_SIZE * 4);
+    SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
+    GlyphAtlas* atlas = new GlyphAtlas;
+    atlas->renderer = renderer;
+    atlas->font = font;
+    atlas->texture = tex;
+    atlas->penX = 1;
+    atlas->penY = 1;
+    atlas->rowH = 0;
+    gGlyphAtlases.push_back(atlas);
+    return atlas;
+}
+
+void GlyphAtlas_destroy(GlyphAtlas* atlas) {
+    if (!atlas) return;
+    if (atlas->texture) SDL_DestroyTexture(atlas->texture);
+    delete atlas;
+}
+
+const Glyph* GlyphAtlas_glyph(GlyphAtlas* atlas, Uint32 codepoint) {
+    auto it = atlas->glyphs.find(codepoint);
+    if (it != atlas->glyphs.end()) return &it->second;
+
+    Glyph glyph = {{0, 0, 0, 0}, 0};
+    int minx, maxx, miny, maxy;
+    if (!TTF_GlyphIsProvided32(atlas->font, codepoint) ||
+        TTF_GlyphMetrics32(atlas->font, codepoint, &minx, &maxx, &miny, &maxy, &glyph.advance) != 0) {
+        return &(atlas->glyphs[codepoint] = glyph);
+    }
+    SDL_Surface* surf = TTF_RenderGlyph32_Blended(atlas->font, codepoint, {255,255,255,255});
+    if (!surf) return &(atlas->glyphs[codepoint] = glyph);
+    SDL_Surface* argb = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_ARGB8888, 0);
+    SDL_FreeSurface(surf);
+    if (!argb) return &(atlas->glyphs[codepoint] = glyph);
+
+    if (argb->w + 2 > GLYPH_ATLAS_SIZE || argb->h + 2 > GLYPH_ATLAS_SIZE) {
+        SDL_FreeSurface(argb);
+        return &(atlas->glyphs[codepoint] = glyph);
+    }
+    if (atlas->penX + argb->w + 1 > GLYPH_ATLAS_SIZE) {
+        atlas->penX = 1;
+        atlas->penY += atlas->rowH + 1;
+        atlas->rowH = 0;
+    }
+    if (atlas->penY + argb->h + 1 > GLYPH_ATLAS_SIZE) {
+        // اطلس پر شد: رئوس قبلی را رسم کن و از نو شروع کن
+        GlyphAtlas_flush(atlas);
+        vector<Uint32> blank(GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE, 0);
+        SDL_UpdateTexture(atlas->texture, NULL, blank.data(), GLYPH_ATLAS_SIZE * 4);
+        atlas->glyphs.clear();
+        atlas->penX = 1;
+        atlas->penY = 1;
+        atlas->rowH = 0;
+    }
+    glyph.src = {atlas->penX, atlas->penY, argb->w, argb->h};
+    SDL_UpdateTexture(atlas->texture, &glyph.src, argb->pixels, argb->pitch);
+    SDL_FreeSurface(argb);
+    atlas->penX += glyph.src.w + 1;
+    atlas->rowH = max(atlas->rowH, glyph.src.h);
+    return &(atlas->glyphs[codepoint] = glyph);
+}
+
+int GlyphAtlas_addText(GlyphAtlas* atlas, const char* text, int x, int y, SDL_Color color) {
+    if (!atlas || !text) return 0;
+    shapeText(text, atlas->shaped);
+    float inv = 1.0f / GLYPH_ATLAS_SIZE;
+    int penX = x;
+    for (Uint32 c : atlas->shaped) {
+        const Glyph* g = GlyphAtlas_glyph(atlas, c);
+        if (g->src.w > 0) {
+            int base = (int)atlas->vertices.size();
+            float x0 = (float)penX, y0 = (float)y;
+            float x1 = x0 + g->src.w, y1 = y0 + g->src.h;
+            float u0 = g->src.x * inv, v0 = g->src.y * inv;
+            float u1 = (g->src.x + g->src.w) * inv, v1 = (g->src.y + g->src.h) * inv;
+            atlas->vertices.push_back({{x0, y0}, color, {u0, v0}});
+            atlas->vertices.push_back({{x1, y0}, color, {u1, v0}});
+            atlas->vertices.push_back({{x1, y1}, color, {u1, v1}});
+            atlas->vertices.push_back({{x0, y1}, color, {u0, v1}});
+            int quad[6] = {base, base + 1, base + 2, base, base + 2, base + 3};
+            atlas->indices.insert(atlas->indices.end(), quad, quad + 6);
+        }
+        penX += g->advance;
+    }
+    return penX - x;
+}
+
+int GlyphAtlas_measure(GlyphAtlas* atlas, const char* text) {
+    if (!atlas || !text) return 0;
+    shapeText(text, atlas->shaped);
+    int w = 0;
+    for (Uint32 c : atlas->shaped) w += GlyphAtlas_glyph(atlas, c)->advance;
+    return w;
+}
+
+void GlyphAtlas_flush(GlyphAtlas* atlas) {
+    if (!atlas || atlas->indices.empty()) return;
+    SDL_RenderGeometry(atlas->renderer, atlas->texture, atlas->vertices.data(), (int)atlas->vertices.size(),
+                       atlas->indices.data(), (int)atlas->indices.size());
+    atlas->vertices.clear();
+    atlas->indices.clear();
+}
+
+int drawGlyphText(SDL_Renderer* renderer, TTF_Font* font, const char* text, int x, int y, SDL_Color color) {
+    GlyphAtlas* atlas = GlyphAtlas_forFont(renderer, font);
+    int w = GlyphAtlas_addText(atlas, text, x, y, color);
+    GlyphAtlas_flush(atlas);
+    return w;
 }
 
 void clearError(Application* app) {
+    if (gErrorLock) SDL_LockMutex(gErrorLock);
     app->lastError[0] = '\0';
     app->errorTime = 0;
+    if (gErrorLock) SDL_UnlockMutex(gErrorLock);
 }
 char* findFontFile(const char* filename) {
     char* basePath = SDL_GetBasePath();
@@ -573,7 +1479,8 @@ const char* block_type_names[] = {
         "distance to", "ask and wait", "answer", "mouse down?",
         "set drag mode", "timer", "reset timer",
         "go to random position", "go to mouse-pointer", "if on edge, bounce",
-        "else", "endif", "endloop"
+        "else", "endif", "endloop",
+        "change ghost effect", "set ghost effect"
 };
 
 SDL_Color get_block_color(BlockType type) {
@@ -591,6 +1498,7 @@ SDL_Color get_block_color(BlockType type) {
     if (type >= BLOCK_PEN_DOWN && type <= BLOCK_STAMP) return {100, 255, 100, 255};
     if (type == BLOCK_CHANGE_BRIGHTNESS || type == BLOCK_SET_BRIGHTNESS ||
         type == BLOCK_CHANGE_SATURATION || type == BLOCK_SET_SATURATION ||
+        type == BLOCK_CHANGE_GHOST || type == BLOCK_SET_GHOST ||
         type == BLOCK_COSTUME_NUMBER || type == BLOCK_COSTUME_NAME ||
         type == BLOCK_BACKDROP_NUMBER || type == BLOCK_BACKDROP_NAME ||
         type == BLOCK_SIZE) {
@@ -607,127 +1515,1292 @@ SDL_Color get_block_color(BlockType type) {
     return {160, 160, 160, 255};
 }
 
-void DrawRoundedRect(SDL_Renderer* renderer, SDL_Rect rect, int radius, SDL_Color color) {
-    SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
-    SDL_Rect inner = {rect.x + radius, rect.y, rect.w - 2*radius, rect.h};
-    SDL_RenderFillRect(renderer, &inner);
-    inner = {rect.x, rect.y + radius, rect.w, rect.h - 2*radius};
-    SDL_RenderFillRect(renderer, &inner);
-    for (int dx = -radius; dx <= radius; dx++) {
-        for (int dy = -radius; dy <= radius; dy++) {
-            if (dx*dx + dy*dy <= radius*radius) {
-                SDL_RenderDrawPoint(renderer, rect.x + radius + dx, rect.y + radius + dy);
-                SDL_RenderDrawPoint(renderer, rect.x + rect.w - radius + dx, rect.y + radius + dy);
-                SDL_RenderDrawPoint(renderer, rect.x + radius + dx, rect.y + rect.h - radius + dy);
-                SDL_RenderDrawPoint(renderer, rect.x + rect.w - radius + dx, rect.y + rect.h - radius + dy);
-            }
+// یک چهارم دایره‌ی واحد، یک بار محاسبه می‌شود
+const int CORNER_SEGMENTS = 6;
+struct CornerTable {
+    float cosv[CORNER_SEGMENTS + 1];
+    float sinv[CORNER_SEGMENTS + 1];
+    CornerTable() {
+        for (int i = 0; i <= CORNER_SEGMENTS; i++) {
+            float a = (float)(M_PI / 2) * i / CORNER_SEGMENTS;
+            cosv[i] = cosf(a);
+            sinv[i] = sinf(a);
         }
     }
+};
+const CornerTable gCornerTable;
+
+void ShapeBatch_addRoundedRect(ShapeBatch* batch, SDL_Rect rect, int radius, SDL_Color color) {
+    radius = min(radius, min(rect.w, rect.h) / 2);
+    int center = (int)batch->vertices.size();
+    batch->vertices.push_back({{rect.x + rect.w * 0.5f, rect.y + rect.h * 0.5f}, color, {0, 0}});
+    // مرکز گوشه‌ها به ترتیب ساعتگرد از بالا-راست، و جهت شروع هر کمان
+    float cx[4] = {(float)(rect.x + rect.w - radius), (float)(rect.x + rect.w - radius), (float)(rect.x + radius), (float)(rect.x + radius)};
+    float cy[4] = {(float)(rect.y + radius), (float)(rect.y + rect.h - radius), (float)(rect.y + rect.h - radius), (float)(rect.y + radius)};
+    float sx[4] = {0, 1, 0, -1}, sy[4] = {-1, 0, 1, 0};
+    for (int c = 0; c < 4; c++) {
+        for (int i = 0; i <= CORNER_SEGMENTS; i++) {
+            // چرخش بردار شروع به اندازه‌ی زاویه‌ی i
+            float dx = sx[c] * gCornerTable.cosv[i] - sy[c] * gCornerTable.sinv[i];
+            float dy = sy[c] * gCornerTable.cosv[i] + sx[c] * gCornerTable.sinv[i];
+            batch->vertices.push_back({{cx[c] + dx * radius, cy[c] + dy * radius}, color, {0, 0}});
+        }
+    }
+    int ring = 4 * (CORNER_SEGMENTS + 1);
+    for (int i = 0; i < ring; i++) {
+        batch->indices.push_back(center);
+        batch->indices.push_back(center + 1 + i);
+        batch->indices.push_back(center + 1 + (i + 1) % ring);
+    }
 }
 
-SDL_Texture* loadTexture(SDL_Renderer* renderer, const char* path) {
-    SDL_Texture* newTexture = NULL;
-    SDL_Surface* loadedSurface = IMG_Load(path);
-    if (loadedSurface == NULL) {
-        printf("Unable to load image %s! SDL_image Error: %s\n", path, IMG_GetError());
-    } else {
-        newTexture = SDL_CreateTextureFromSurface(renderer, loadedSurface);
-        SDL_FreeSurface(loadedSurface);
-        if (newTexture == NULL) {
-            printf("Unable to create texture from %s! SDL Error: %s\n", path, SDL_GetError());
+void ShapeBatch_addQuad(ShapeBatch* batch, SDL_Rect dst, SDL_Rect src, int texW, int texH, SDL_Color color) {
+    int base = (int)batch->vertices.size();
+    float x0 = (float)dst.x, y0 = (float)dst.y, x1 = (float)(dst.x + dst.w), y1 = (float)(dst.y + dst.h);
+    float u0 = (float)src.x / texW, v0 = (float)src.y / texH;
+    float u1 = (float)(src.x + src.w) / texW, v1 = (float)(src.y + src.h) / texH;
+    batch->vertices.push_back({{x0, y0}, color, {u0, v0}});
+    batch->vertices.push_back({{x1, y0}, color, {u1, v0}});
+    batch->vertices.push_back({{x1, y1}, color, {u1, v1}});
+    batch->vertices.push_back({{x0, y1}, color, {u0, v1}});
+    int quad[6] = {base, base + 1, base + 2, base, base + 2, base + 3};
+    batch->indices.insert(batch->indices.end(), quad, quad + 6);
+}
+
+void ShapeBatch_flush(SDL_Renderer* renderer, ShapeBatch* batch) {
+    if (batch->indices.empty()) return;
+    SDL_RenderGeometry(renderer, batch->texture, batch->vertices.data(), (int)batch->vertices.size(),
+                       batch->indices.data(), (int)batch->indices.size());
+    batch->vertices.clear();
+    batch->indices.clear();
+}
+
+void ShapeBatch_addCircle(ShapeBatch* batch, float cx, float cy, float radius, SDL_Color color) {
+    int center = (int)batch->vertices.size();
+    batch->vertices.push_back({{cx, cy}, color, {0, 0}});
+    float sx[4] = {1, 0, -1, 0}, sy[4] = {0, 1, 0, -1};
+    for (int c = 0; c < 4; c++) {
+        for (int i = 0; i < CORNER_SEGMENTS; i++) {
+            float dx = sx[c] * gCornerTable.cosv[i] - sy[c] * gCornerTable.sinv[i];
+            float dy = sy[c] * gCornerTable.cosv[i] + sx[c] * gCornerTable.sinv[i];
+            batch->vertices.push_back({{cx + dx * radius, cy + dy * radius}, color, {0, 0}});
         }
     }
-    return newTexture;
+    int ring = 4 * CORNER_SEGMENTS;
+    for (int i = 0; i < ring; i++) {
+        batch->indices.push_back(center);
+        batch->indices.push_back(center + 1 + i);
+        batch->indices.push_back(center + 1 + (i + 1) % ring);
+    }
 }
 
-int findSoundByName(Project* proj, const char* name) {
-    for (size_t i = 0; i < proj->sounds.size(); i++) {
-        if (proj->sounds[i]->name == name) return i;
+// خط ضخیم به صورت یک چهارضلعی با سرهای گرد
+void ShapeBatch_addLine(ShapeBatch* batch, float x1, float y1, float x2, float y2, float width, SDL_Color color) {
+    if (width < 1) width = 1;
+    float half = width * 0.5f;
+    float dx = x2 - x1, dy = y2 - y1;
+    float len = sqrtf(dx*dx + dy*dy);
+    if (len > 0.0001f) {
+        float nx = -dy / len * half, ny = dx / len * half;
+        int base = (int)batch->vertices.size();
+        batch->vertices.push_back({{x1 + nx, y1 + ny}, color, {0, 0}});
+        batch->vertices.push_back({{x2 + nx, y2 + ny}, color, {0, 0}});
+        batch->vertices.push_back({{x2 - nx, y2 - ny}, color, {0, 0}});
+        batch->vertices.push_back({{x1 - nx, y1 - ny}, color, {0, 0}});
+        int quad[6] = {base, base + 1, base + 2, base, base + 2, base + 3};
+        batch->indices.insert(batch->indices.end(), quad, quad + 6);
+    }
+    if (width > 2) {
+        ShapeBatch_addCircle(batch, x1, y1, half, color);
+        ShapeBatch_addCircle(batch, x2, y2, half, color);
+    } else if (len <= 0.0001f) {
+        SDL_Rect dot = {(int)(x1 - half), (int)(y1 - half), (int)width, (int)width};
+        ShapeBatch_addQuad(batch, dot, dot, 1, 1, color);
     }
-    return -1;
 }
 
-Variable* findVariable(Project* proj, const string& name) {
-    for (size_t i = 0; i < proj->globalVariables.size(); i++) {
-        if (proj->globalVariables[i]->name == name)
-            return proj->globalVariables[i];
-    }
-    return nullptr;
+void DrawRoundedRect(SDL_Renderer* renderer, SDL_Rect rect, int radius, SDL_Color color) {
+    ShapeBatch batch;
+    ShapeBatch_addRoundedRect(&batch, rect, radius, color);
+    ShapeBatch_flush(renderer, &batch);
 }
 
-void setVariable(Project* proj, const string& name, const Value& val) {
-    Variable* var = findVariable(proj, name);
-    if (var) {
-        var->value = val;
-    } else {
-        Variable* newVar = new Variable;
-        newVar->name = name;
-        newVar->value = val;
-        proj->globalVariables.push_back(newVar);
+CostumeAtlas* CostumeAtlas_create(SDL_Renderer* renderer) {
+    CostumeAtlas* atlas = new CostumeAtlas;
+    atlas->renderer = renderer;
+    return atlas;
+}
+
+void CostumeAtlas_destroy(CostumeAtlas* atlas) {
+    if (!atlas) return;
+    for (CostumeAtlasPage* page : atlas->pages) {
+        if (page->texture) SDL_DestroyTexture(page->texture);
+        delete page;
     }
+    delete atlas;
 }
 
-Value getVariable(Project* proj, const string& name) {
-    Variable* var = findVariable(proj, name);
-    if (var) return var->value;
-    return make_number(0);
+bool CostumeAtlas_add(CostumeAtlas* atlas, SDL_Surface* surface, Costume* costume) {
+    costume->atlasPage = NULL;
+    if (!atlas || !surface) return false;
+    SDL_Surface* argb = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+    if (!argb) return false;
+    bool placed = CostumeAtlas_place(atlas, argb, &costume->atlasPage, &costume->atlasRect);
+    SDL_FreeSurface(argb);
+    return placed;
 }
 
-SDL_Scancode keyNameToScancode(const char* name) {
-    if (!name) return SDL_SCANCODE_UNKNOWN;
-    string n = name;
-    if (n == "space") return SDL_SCANCODE_SPACE;
-    if (n == "up arrow") return SDL_SCANCODE_UP;
-    if (n == "down arrow") return SDL_SCANCODE_DOWN;
-    if (n == "left arrow") return SDL_SCANCODE_LEFT;
-    if (n == "right arrow") return SDL_SCANCODE_RIGHT;
-    if (n == "a") return SDL_SCANCODE_A;
-    if (n == "b") return SDL_SCANCODE_B;
-    if (n == "c") return SDL_SCANCODE_C;
-    if (n == "d") return SDL_SCANCODE_D;
-    if (n == "e") return SDL_SCANCODE_E;
-    if (n == "f") return SDL_SCANCODE_F;
-    if (n == "g") return SDL_SCANCODE_G;
-    if (n == "h") return SDL_SCANCODE_H;
-    if (n == "i") return SDL_SCANCODE_I;
-    if (n == "j") return SDL_SCANCODE_J;
-    if (n == "k") return SDL_SCANCODE_K;
-    if (n == "l") return SDL_SCANCODE_L;
-    if (n == "m") return SDL_SCANCODE_M;
-    if (n == "n") return SDL_SCANCODE_N;
-    if (n == "o") return SDL_SCANCODE_O;
-    if (n == "p") return SDL_SCANCODE_P;
-    if (n == "q") return SDL_SCANCODE_Q;
-    if (n == "r") return SDL_SCANCODE_R;
-    if (n == "s") return SDL_SCANCODE_S;
-    if (n == "t") return SDL_SCANCODE_T;
-    if (n == "u") return SDL_SCANCODE_U;
-    if (n == "v") return SDL_SCANCODE_V;
-    if (n == "w") return SDL_SCANCODE_W;
-    if (n == "x") return SDL_SCANCODE_X;
-    if (n == "y") return SDL_SCANCODE_Y;
-    if (n == "z") return SDL_SCANCODE_Z;
-    if (n == "0") return SDL_SCANCODE_0;
-    if (n == "1") return SDL_SCANCODE_1;
-    if (n == "2") return SDL_SCANCODE_2;
-    if (n == "3") return SDL_SCANCODE_3;
-    if (n == "4") return SDL_SCANCODE_4;
-    if (n == "5") return SDL_SCANCODE_5;
-    if (n == "6") return SDL_SCANCODE_6;
-    if (n == "7") return SDL_SCANCODE_7;
-    if (n == "8") return SDL_SCANCODE_8;
-    if (n == "9") return SDL_SCANCODE_9;
-    return SDL_SCANCODE_UNKNOWN;
+// یک تصویر ARGB8888 را در اولین صفحه‌ای که جا دارد می‌گذارد
+bool CostumeAtlas_place(CostumeAtlas* atlas, SDL_Surface* argb, SDL_Texture** outPage, SDL_Rect* outRect) {
+    if (!atlas || !argb) return false;
+    int w = argb->w, h = argb->h;
+    if (w + 2 > COSTUME_ATLAS_SIZE || h + 2 > COSTUME_ATLAS_SIZE) return false;
+
+    CostumeAtlasPage* target = NULL;
+    for (CostumeAtlasPage* page : atlas->pages) {
+        int x = page->penX, y = page->penY, rowH = page->rowH;
+        if (x + w + 1 > COSTUME_ATLAS_SIZE) { x = 1; y += rowH + 1; }
+        if (y + h + 1 <= COSTUME_ATLAS_SIZE) { target = page; break; }
+    }
+    if (!target) {
+        SDL_Texture* tex = SDL_CreateTexture(atlas->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC,
+                                             COSTUME_ATLAS_SIZE, COSTUME_ATLAS_SIZE);
+        if (!tex) {
+            printf("Failed to create costume atlas page: %s\n", SDL_GetError());
+            return false;
+        }
+        vector<Uint32> blank(COSTUME_ATLAS_SIZE * COSTUME_ATLAS_SIZE, 0);
+        SDL_UpdateTexture(tex, NULL, blank.data(), COSTUME_ATLAS_SIZE * 4);
+        SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
+        target = new CostumeAtlasPage;
+        target->texture = tex;
+        target->penX = 1;
+        target->penY = 1;
+        target->rowH = 0;
+        target->users = 0;
+        atlas->pages.push_back(target);
+    }
+    if (target->penX + w + 1 > COSTUME_ATLAS_SIZE) {
+        target->penX = 1;
+        target->penY += target->rowH + 1;
+        target->rowH = 0;
+    }
+    *outRect = {target->penX, target->penY, w, h};
+    *outPage = target->texture;
+    SDL_UpdateTexture(target->texture, outRect, argb->pixels, argb->pitch);
+    target->penX += w + 1;
+    target->rowH = max(target->rowH, h);
+    target->users++;
+    return true;
 }
-// evaluateBlock function
-Value evaluateBlock(Block* b, ExecutionContext* ctx, Project* proj) {
-    switch (b->type) {
-        case BLOCK_NUMBER:
+
+// جای خالی وسط صفحه دوباره استفاده نمی‌شود؛ صفحه وقتی آخرین تصویرش برود کامل آزاد می‌شود
+void CostumeAtlas_release(CostumeAtlas* atlas, SDL_Texture* page) {
+    if (!atlas || !page) return;
+    for (size_t i = 0; i < atlas->pages.size(); i++) {
+        CostumeAtlasPage* p = atlas->pages[i];
+        if (p->texture != page) continue;
+        if (--p->users > 0) return;
+        SDL_DestroyTexture(p->texture);
+        delete p;
+        atlas->pages.erase(atlas->pages.begin() + i);
+        return;
+    }
+}
+
+// جلوه‌های رنگ، روشنایی و اشباع با هم یک ماتریس ۳×۳ می‌شوند (چرخش رنگ مثل hueRotate در SVG)
+void buildEffectMatrix(float color, float brightness, float saturation, float m[9]) {
+    float angle = color / 200.0f * 2.0f * (float)M_PI;
+    float c = cosf(angle), s = sinf(angle);
+    float hue[9] = {
+        0.213f + c * 0.787f - s * 0.213f, 0.715f - c * 0.715f - s * 0.715f, 0.072f - c * 0.072f + s * 0.928f,
+        0.213f - c * 0.213f + s * 0.143f, 0.715f + c * 0.285f + s * 0.140f, 0.072f - c * 0.072f - s * 0.283f,
+        0.213f - c * 0.213f - s * 0.787f, 0.715f - c * 0.715f + s * 0.715f, 0.072f + c * 0.928f + s * 0.072f
+    };
+    float k = saturation / 100.0f;
+    float sat[9] = {
+        0.213f + 0.787f * k, 0.715f - 0.715f * k, 0.072f - 0.072f * k,
+        0.213f - 0.213f * k, 0.715f + 0.285f * k, 0.072f - 0.072f * k,
+        0.213f - 0.213f * k, 0.715f - 0.715f * k, 0.072f + 0.928f * k
+    };
+    float b = brightness / 100.0f;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            float v = 0;
+            for (int i = 0; i < 3; i++) v += sat[row * 3 + i] * hue[i * 3 + col];
+            m[row * 3 + col] = v * b;
+        }
+    }
+}
+
+// ماتریس روی n پیکسل ARGB8888؛ آلفا دست نمی‌خورد
+void applyColorMatrixRow(Uint32* dst, const Uint32* src, int n, const float m[9]) {
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i mask = _mm256_set1_epi32(0xFF);
+    __m256i alphaMask = _mm256_set1_epi32((int)0xFF000000u);
+    __m256 zero = _mm256_setzero_ps(), full = _mm256_set1_ps(255.0f);
+    __m256 m0 = _mm256_set1_ps(m[0]), m1 = _mm256_set1_ps(m[1]), m2 = _mm256_set1_ps(m[2]);
+    __m256 m3 = _mm256_set1_ps(m[3]), m4 = _mm256_set1_ps(m[4]), m5 = _mm256_set1_ps(m[5]);
+    __m256 m6 = _mm256_set1_ps(m[6]), m7 = _mm256_set1_ps(m[7]), m8 = _mm256_set1_ps(m[8]);
+    for (; i + 8 <= n; i += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256 b = _mm256_cvtepi32_ps(_mm256_and_si256(p, mask));
+        __m256 g = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 8), mask));
+        __m256 r = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 16), mask));
+        __m256 ro = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m0, r), _mm256_mul_ps(m1, g)), _mm256_mul_ps(m2, b));
+        __m256 go = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m3, r), _mm256_mul_ps(m4, g)), _mm256_mul_ps(m5, b));
+        __m256 bo = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m6, r), _mm256_mul_ps(m7, g)), _mm256_mul_ps(m8, b));
+        __m256i ri = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(ro, zero), full));
+        __m256i gi = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(go, zero), full));
+        __m256i bi = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(bo, zero), full));
+        __m256i out = _mm256_or_si256(_mm256_and_si256(p, alphaMask),
+                                      _mm256_or_si256(_mm256_slli_epi32(ri, 16), _mm256_or_si256(_mm256_slli_epi32(gi, 8), bi)));
+        _mm256_storeu_si256((__m256i*)(dst + i), out);
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128i mask = _mm_set1_epi32(0xFF);
+    __m128i alphaMask = _mm_set1_epi32((int)0xFF000000u);
+    __m128 zero = _mm_setzero_ps(), full = _mm_set1_ps(255.0f);
+    __m128 m0 = _mm_set1_ps(m[0]), m1 = _mm_set1_ps(m[1]), m2 = _mm_set1_ps(m[2]);
+    __m128 m3 = _mm_set1_ps(m[3]), m4 = _mm_set1_ps(m[4]), m5 = _mm_set1_ps(m[5]);
+    __m128 m6 = _mm_set1_ps(m[6]), m7 = _mm_set1_ps(m[7]), m8 = _mm_set1_ps(m[8]);
+    for (; i + 4 <= n; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128 b = _mm_cvtepi32_ps(_mm_and_si128(p, mask));
+        __m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 8), mask));
+        __m128 r = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 16), mask));
+        __m128 ro = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, r), _mm_mul_ps(m1, g)), _mm_mul_ps(m2, b));
+        __m128 go = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m3, r), _mm_mul_ps(m4, g)), _mm_mul_ps(m5, b));
+        __m128 bo = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m6, r), _mm_mul_ps(m7, g)), _mm_mul_ps(m8, b));
+        __m128i ri = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(ro, zero), full));
+        __m128i gi = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(go, zero), full));
+        __m128i bi = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(bo, zero), full));
+        __m128i out = _mm_or_si128(_mm_and_si128(p, alphaMask),
+                                   _mm_or_si128(_mm_slli_epi32(ri, 16), _mm_or_si128(_mm_slli_epi32(gi, 8), bi)));
+        _mm_storeu_si128((__m128i*)(dst + i), out);
+    }
+#endif
+    for (; i < n; i++) {
+        Uint32 p = src[i];
+        float r = (float)((p >> 16) & 0xFF), g = (float)((p >> 8) & 0xFF), b = (float)(p & 0xFF);
+        float ro = m[0] * r + m[1] * g + m[2] * b;
+        float go = m[3] * r + m[4] * g + m[5] * b;
+        float bo = m[6] * r + m[7] * g + m[8] * b;
+        Uint32 ri = (Uint32)lrintf(min(max(ro, 0.0f), 255.0f));
+        Uint32 gi = (Uint32)lrintf(min(max(go, 0.0f), 255.0f));
+        Uint32 bi = (Uint32)lrintf(min(max(bo, 0.0f), 255.0f));
+        dst[i] = (p & 0xFF000000u) | (ri << 16) | (gi << 8) | bi;
+    }
+}
+
+EffectCache* EffectCache_create(SDL_Renderer* renderer, size_t maxBytes) {
+    EffectCache* cache = new EffectCache;
+    cache->renderer = renderer;
+    cache->bytes = 0;
+    cache->maxBytes = maxBytes;
+    return cache;
+}
+
+void EffectCache_destroy(EffectCache* cache) {
+    if (!cache) return;
+    for (EffectVariant* entry : cache->lru) {
+        if (entry->texture) SDL_DestroyTexture(entry->texture);
+        delete entry;
+    }
+    delete cache;
+}
+
+// پیش از حذف لباس صدا زده شود تا نشانی آزادشده دوباره به نسخه‌ی کهنه نخورد
+void EffectCache_forget(EffectCache* cache, Costume* costume) {
+    if (!cache) return;
+    for (auto it = cache->lru.begin(); it != cache->lru.end();) {
+        EffectVariant* entry = *it;
+        if (entry->costume != costume) { ++it; continue; }
+        cache->index.erase(entry->key);
+        cache->bytes -= entry->bytes;
+        if (entry->texture) SDL_DestroyTexture(entry->texture);
+        delete entry;
+        it = cache->lru.erase(it);
+    }
+}
+
+// NULL یعنی لباس بدون جلوه (یا بدون نسخه‌ی CPU) رسم شود
+SDL_Texture* EffectCache_get(EffectCache* cache, Costume* costume, float color, float brightness, float saturation) {
+    if (!cache || !costume || !costume->surface) return NULL;
+    int qc = (int)lroundf(color / EFFECT_QUANT_STEP) % (200 / EFFECT_QUANT_STEP);
+    int qb = (int)lroundf(brightness / EFFECT_QUANT_STEP);
+    int qs = (int)lroundf(saturation / EFFECT_QUANT_STEP);
+    if (qc == 0 && qb * EFFECT_QUANT_STEP == 100 && qs * EFFECT_QUANT_STEP == 100) return NULL;
+
+    char key[64];
+    snprintf(key, sizeof(key), "%p:%d:%d:%d", (void*)costume, qc, qb, qs);
+    auto it = cache->index.find(key);
+    if (it != cache->index.end()) {
+        cache->lru.splice(cache->lru.begin(), cache->lru, it->second);
+        return (*it->second)->texture;
+    }
+
+    SDL_Surface* surf = costume->surface;
+    float m[9];
+    buildEffectMatrix((float)(qc * EFFECT_QUANT_STEP), (float)(qb * EFFECT_QUANT_STEP), (float)(qs * EFFECT_QUANT_STEP), m);
+    vector<Uint32> pixels((size_t)surf->w * surf->h);
+    for (int y = 0; y < surf->h; y++) {
+        const Uint32* row = (const Uint32*)((const Uint8*)surf->pixels + (size_t)y * surf->pitch);
+        applyColorMatrixRow(&pixels[(size_t)y * surf->w], row, surf->w, m);
+    }
+    SDL_Texture* tex = SDL_CreateTexture(cache->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, surf->w, surf->h);
+    if (!tex) return NULL;
+    SDL_UpdateTexture(tex, NULL, pixels.data(), surf->w * 4);
+    SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
+
+    EffectVariant* entry = new EffectVariant;
+    entry->key = key;
+    entry->costume = costume;
+    entry->texture = tex;
+    entry->bytes = pixels.size() * 4;
+    cache->lru.push_front(entry);
+    cache->index[entry->key] = cache->lru.begin();
+    cache->bytes += entry->bytes;
+    while (cache->bytes > cache->maxBytes && cache->lru.size() > 1) {
+        EffectVariant* old = cache->lru.back();
+        cache->lru.pop_back();
+        cache->index.erase(old->key);
+        cache->bytes -= old->bytes;
+        if (old->texture) SDL_DestroyTexture(old->texture);
+        delete old;
+    }
+    return tex;
+}
+
+// نیم‌اندازه با میانگین وزنی آلفا تا لبه‌های شفاف تیره نشوند
+SDL_Surface* halveSurface(SDL_Surface* src) {
+    int w = max(1, src->w / 2), h = max(1, src->h / 2);
+    SDL_Surface* dst = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!dst) return NULL;
+    for (int y = 0; y < h; y++) {
+        int sy0 = min(y * 2, src->h - 1), sy1 = min(y * 2 + 1, src->h - 1);
+        const Uint32* row0 = (const Uint32*)((const Uint8*)src->pixels + (size_t)sy0 * src->pitch);
+        const Uint32* row1 = (const Uint32*)((const Uint8*)src->pixels + (size_t)sy1 * src->pitch);
+        Uint32* out = (Uint32*)((Uint8*)dst->pixels + (size_t)y * dst->pitch);
+        for (int x = 0; x < w; x++) {
+            int sx0 = min(x * 2, src->w - 1), sx1 = min(x * 2 + 1, src->w - 1);
+            Uint32 p[4] = {row0[sx0], row0[sx1], row1[sx0], row1[sx1]};
+            Uint32 a = 0, r = 0, g = 0, b = 0;
+            for (int k = 0; k < 4; k++) {
+                Uint32 pa = p[k] >> 24;
+                a += pa;
+                r += ((p[k] >> 16) & 0xFF) * pa;
+                g += ((p[k] >> 8) & 0xFF) * pa;
+                b += (p[k] & 0xFF) * pa;
+            }
+            if (a == 0) {
+                out[x] = 0;
+                continue;
+            }
+            out[x] = (((a + 2) / 4) << 24) | (((r + a/2) / a) << 16) | (((g + a/2) / a) << 8) | ((b + a/2) / a);
+        }
+    }
+    return dst;
+}
+
+void MipChain_build(MipChain* chain) {
+    SDL_Surface* prev = chain->base;
+    while (prev->w > MIP_MIN_SIZE || prev->h > MIP_MIN_SIZE) {
+        SDL_Surface* next = halveSurface(prev);
+        if (!next) break;
+        chain->surfaces.push_back(next);
+        prev = next;
+    }
+    SDL_FreeSurface(chain->base);
+    chain->base = NULL;
+    SDL_AtomicSet(&chain->ready, 1);
+}
+
+int MipBuilder_threadMain(void* data) {
+    MipBuilder* builder = (MipBuilder*)data;
+    SDL_LockMutex(builder->lock);
+    while (true) {
+        while (!builder->quit && builder->queue.empty()) SDL_CondWait(builder->wake, builder->lock);
+        if (builder->quit) break;
+        MipChain* chain = builder->queue.front();
+        builder->queue.pop_front();
+        builder->building = chain;
+        SDL_UnlockMutex(builder->lock);
+
+        MipChain_build(chain);
+
+        SDL_LockMutex(builder->lock);
+        builder->building = NULL;
+        SDL_CondBroadcast(builder->done);
+    }
+    SDL_UnlockMutex(builder->lock);
+    return 0;
+}
+
+MipBuilder* MipBuilder_create() {
+    MipBuilder* builder = new MipBuilder;
+    builder->lock = SDL_CreateMutex();
+    builder->wake = SDL_CreateCond();
+    builder->done = SDL_CreateCond();
+    builder->building = NULL;
+    builder->quit = false;
+    builder->thread = SDL_CreateThread(MipBuilder_threadMain, "mip-builder", builder);
+    if (!builder->thread) printf("Failed to create mip builder thread: %s\n", SDL_GetError());
+    return builder;
+}
+
+void MipBuilder_destroy(MipBuilder* builder) {
+    if (!builder) return;
+    SDL_LockMutex(builder->lock);
+    builder->quit = true;
+    SDL_CondBroadcast(builder->wake);
+    SDL_UnlockMutex(builder->lock);
+    if (builder->thread) SDL_WaitThread(builder->thread, NULL);
+    SDL_DestroyCond(builder->done);
+    SDL_DestroyCond(builder->wake);
+    SDL_DestroyMutex(builder->lock);
+    delete builder;
+}
+
+MipChain* MipChain_create(SDL_Surface* surface) {
+    if (!surface) return NULL;
+    SDL_Surface* base = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+    if (!base) return NULL;
+    MipChain* chain = new MipChain;
+    chain->base = base;
+    chain->uploaded = false;
+    SDL_AtomicSet(&chain->ready, 0);
+    MipBuilder* builder = gMipBuilder;
+    if (builder && builder->thread) {
+        SDL_LockMutex(builder->lock);
+        builder->queue.push_back(chain);
+        SDL_CondSignal(builder->wake);
+        SDL_UnlockMutex(builder->lock);
+    } else {
+        MipChain_build(chain);
+    }
+    return chain;
+}
+
+void MipChain_destroy(MipChain* chain) {
+    if (!chain) return;
+    MipBuilder* builder = gMipBuilder;
+    if (builder && builder->thread) {
+        // زنجیره‌ای که هنوز در صف است برداشته می‌شود؛ اگر در حال ساخت است صبر می‌کنیم
+        SDL_LockMutex(builder->lock);
+        builder->queue.remove(chain);
+        while (builder->building == chain) SDL_CondWait(builder->done, builder->lock);
+        SDL_UnlockMutex(builder->lock);
+    }
+    if (chain->base) SDL_FreeSurface(chain->base);
+    for (SDL_Surface* surf : chain->surfaces) SDL_FreeSurface(surf);
+    for (MipLevel& level : chain->levels) {
+        if (level.owned) {
+            if (level.page) SDL_DestroyTexture(level.page);
+        } else {
+            CostumeAtlas_release(gCostumeAtlas, level.page);
+        }
+    }
+    delete chain;
+}
+
+// کوچک‌ترین سطحی که هنوز از اندازه‌ی روی صفحه کوچک‌تر نیست؛ NULL یعنی همان تصویر اصلی
+const MipLevel* MipChain_level(MipChain* chain, SDL_Renderer* renderer, int w, int h) {
+    if (!chain || !SDL_AtomicGet(&chain->ready)) return NULL;
+    if (!chain->uploaded) {
+        for (SDL_Surface* surf : chain->surfaces) {
+            MipLevel level;
+            level.owned = false;
+            if (CostumeAtlas_place(gCostumeAtlas, surf, &level.page, &level.rect)) {
+                level.texW = COSTUME_ATLAS_SIZE;
+                level.texH = COSTUME_ATLAS_SIZE;
+            } else {
+                level.page = SDL_CreateTextureFromSurface(renderer, surf);
+                if (!level.page) break;
+                SDL_SetTextureBlendMode(level.page, SDL_BLENDMODE_BLEND);
+                level.rect = {0, 0, surf->w, surf->h};
+                level.texW = surf->w;
+                level.texH = surf->h;
+                level.owned = true;
+            }
+            chain->levels.push_back(level);
+        }
+        for (SDL_Surface* surf : chain->surfaces) SDL_FreeSurface(surf);
+        chain->surfaces.clear();
+        chain->uploaded = true;
+    }
+    const MipLevel* best = NULL;
+    for (const MipLevel& level : chain->levels) {
+        if (level.rect.w < w || level.rect.h < h) break;
+        best = &level;
+    }
+    return best;
+}
+
+CollisionMask* CollisionMask_fromSurface(SDL_Surface* argb) {
+    if (!argb) return NULL;
+    CollisionMask* m = new CollisionMask;
+    m->w = argb->w;
+    m->h = argb->h;
+    m->stride = (argb->w + 63) / 64 + 1;
+    m->bits.assign((size_t)m->stride * m->h, 0);
+    for (int y = 0; y < m->h; y++) {
+        const Uint32* row = (const Uint32*)((const Uint8*)argb->pixels + (size_t)y * argb->pitch);
+        Uint64* out = &m->bits[(size_t)y * m->stride];
+        for (int x = 0; x < m->w; x++) {
+            if ((row[x] >> 24) >= MASK_ALPHA_THRESHOLD) out[x >> 6] |= (Uint64)1 << (x & 63);
+        }
+    }
+    return m;
+}
+
+// لباس روی صحنه در مربع side×side کشیده می‌شود؛ ماسک هم با نزدیک‌ترین نمونه به همان مربع می‌رود
+CollisionMask* CollisionMask_scaled(const CollisionMask* src, int side) {
+    CollisionMask* m = new CollisionMask;
+    m->w = side;
+    m->h = side;
+    m->stride = (side + 63) / 64 + 1;
+    m->bits.assign((size_t)m->stride * side, 0);
+    vector<int> columns(side);
+    for (int x = 0; x < side; x++) columns[x] = (int)((Sint64)x * src->w / side);
+    for (int y = 0; y < side; y++) {
+        const Uint64* row = &src->bits[(size_t)((Sint64)y * src->h / side) * src->stride];
+        Uint64* out = &m->bits[(size_t)y * m->stride];
+        for (int x = 0; x < side; x++) {
+            int sx = columns[x];
+            if ((row[sx >> 6] >> (sx & 63)) & 1) out[x >> 6] |= (Uint64)1 << (x & 63);
+        }
+    }
+    return m;
+}
+
+bool CollisionMask_test(const CollisionMask* m, int x, int y) {
+    if (x < 0 || y < 0 || x >= m->w || y >= m->h) return false;
+    return (m->bits[(size_t)y * m->stride + (x >> 6)] >> (x & 63)) & 1;
+}
+
+// ۶۴ بیت از بیت off به بعد؛ کلمه‌ی اضافه‌ی آخر ردیف خواندن k+1 را امن می‌کند
+static inline Uint64 maskWord(const Uint64* row, int off) {
+    int k = off >> 6, shift = off & 63;
+    if (shift == 0) return row[k];
+    return (row[k] >> shift) | (row[k + 1] << (64 - shift));
+}
+
+// آیا n بیت از دو ردیف (هر کدام از بیت خودش) در جایی هر دو یک هستند
+static bool maskRowsOverlap(const Uint64* rowA, int offA, const Uint64* rowB, int offB, int n) {
+    int i = 0;
+#if defined(__AVX2__)
+    __m128i shiftA = _mm_cvtsi32_si128(offA & 63), backA = _mm_cvtsi32_si128(64 - (offA & 63));
+    __m128i shiftB = _mm_cvtsi32_si128(offB & 63), backB = _mm_cvtsi32_si128(64 - (offB & 63));
+    // جابه‌جایی ۶۴ بیتی در AVX2 صفر می‌دهد، پس shift صفر حالت جدا نمی‌خواهد
+    for (; i + 256 <= n; i += 256) {
+        const Uint64* a = rowA + ((offA + i) >> 6);
+        const Uint64* b = rowB + ((offB + i) >> 6);
+        __m256i wa = _mm256_or_si256(_mm256_srl_epi64(_mm256_loadu_si256((const __m256i*)a), shiftA),
+                                     _mm256_sll_epi64(_mm256_loadu_si256((const __m256i*)(a + 1)), backA));
+        __m256i wb = _mm256_or_si256(_mm256_srl_epi64(_mm256_loadu_si256((const __m256i*)b), shiftB),
+                                     _mm256_sll_epi64(_mm256_loadu_si256((const __m256i*)(b + 1)), backB));
+        if (!_mm256_testz_si256(wa, wb)) return true;
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128i shiftA = _mm_cvtsi32_si128(offA & 63), backA = _mm_cvtsi32_si128(64 - (offA & 63));
+    __m128i shiftB = _mm_cvtsi32_si128(offB & 63), backB = _mm_cvtsi32_si128(64 - (offB & 63));
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 128 <= n; i += 128) {
+        const Uint64* a = rowA + ((offA + i) >> 6);
+        const Uint64* b = rowB + ((offB + i) >> 6);
+        __m128i wa = _mm_or_si128(_mm_srl_epi64(_mm_loadu_si128((const __m128i*)a), shiftA),
+                                  _mm_sll_epi64(_mm_loadu_si128((const __m128i*)(a + 1)), backA));
+        __m128i wb = _mm_or_si128(_mm_srl_epi64(_mm_loadu_si128((const __m128i*)b), shiftB),
+                                  _mm_sll_epi64(_mm_loadu_si128((const __m128i*)(b + 1)), backB));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(wa, wb), zero)) != 0xFFFF) return true;
+    }
+#endif
+    for (; i < n; i += 64) {
+        Uint64 keep = (n - i >= 64) ? ~(Uint64)0 : (((Uint64)1 << (n - i)) - 1);
+        if (maskWord(rowA, offA + i) & maskWord(rowB, offB + i) & keep) return true;
+    }
+    return false;
+}
+
+static bool maskRowAny(const Uint64* row, int off, int n) {
+    for (int i = 0; i < n; i += 64) {
+        Uint64 keep = (n - i >= 64) ? ~(Uint64)0 : (((Uint64)1 << (n - i)) - 1);
+        if (maskWord(row, off + i) & keep) return true;
+    }
+    return false;
+}
+
+// ra و rb جای دو ماسک روی صحنه‌اند؛ ماسک NULL یعنی مربع پر (لباس بدون تصویر)
+bool CollisionMask_overlap(const CollisionMask* a, SDL_Rect ra, const CollisionMask* b, SDL_Rect rb) {
+    SDL_Rect area;
+    if (!SDL_IntersectRect(&ra, &rb, &area)) return false;
+    if (!a && !b) return true;
+    if (!a) {
+        swap(a, b);
+        swap(ra, rb);
+    }
+    int offA = area.x - ra.x, offB = area.x - rb.x;
+    for (int y = area.y; y < area.y + area.h; y++) {
+        const Uint64* rowA = &a->bits[(size_t)(y - ra.y) * a->stride];
+        if (!b) {
+            if (maskRowAny(rowA, offA, area.w)) return true;
+            continue;
+        }
+        const Uint64* rowB = &b->bits[(size_t)(y - rb.y) * b->stride];
+        if (maskRowsOverlap(rowA, offA, rowB, offB, area.w)) return true;
+    }
+    return false;
+}
+
+// نسخه‌های کنارگذاشته را اول هر تیک (وقتی هیچ کارگری ماسکی در دست ندارد) آزاد می‌کند
+void CollisionMask_collectRetired() {
+    if (!gMaskLock) return;
+    SDL_LockMutex(gMaskLock);
+    for (CollisionMask* m : gRetiredMasks) delete m;
+    gRetiredMasks.clear();
+    SDL_UnlockMutex(gMaskLock);
+}
+
+const CollisionMask* Costume_maskAtSize(Costume* costume, int side) {
+    if (!costume->mask || side <= 0) return NULL;
+    if (costume->mask->w == side && costume->mask->h == side) return costume->mask;
+    if (gMaskLock) SDL_LockMutex(gMaskLock);
+    CollisionMask* found = NULL;
+    for (CollisionMask* m : costume->scaledMasks) {
+        if (m->w == side) {
+            found = m;
+            break;
+        }
+    }
+    if (!found) {
+        // کارگرهای دیگر ممکن است هنوز ماسک قدیمی را بخوانند، پس حذف تا تیک بعد عقب می‌افتد
+        if (costume->scaledMasks.size() >= MASK_MAX_SIZES) {
+            gRetiredMasks.insert(gRetiredMasks.end(), costume->scaledMasks.begin(), costume->scaledMasks.end());
+            costume->scaledMasks.clear();
+        }
+        found = CollisionMask_scaled(costume->mask, side);
+        costume->scaledMasks.push_back(found);
+    }
+    if (gMaskLock) SDL_UnlockMutex(gMaskLock);
+    return found;
+}
+
+void Costume_freeMasks(Costume* costume) {
+    delete costume->mask;
+    costume->mask = NULL;
+    for (CollisionMask* m : costume->scaledMasks) delete m;
+    costume->scaledMasks.clear();
+}
+
+// مربعی که اسپرایت روی صحنه می‌پوشاند، با همان گردکردن رسم (پیکسل صحنه، y رو به پایین)
+SDL_Rect spriteFootprint(float x, float y, float size) {
+    int side = (int)(50 * size / 100.0f);
+    return {(int)(STAGE_WIDTH/2 + x) - side/2, (int)(STAGE_HEIGHT/2 - y) - side/2, side, side};
+}
+
+const CollisionMask* Sprite_mask(Sprite* sprite, int costume, int side) {
+    if (costume < 0 || costume >= (int)sprite->costumes.size()) return NULL;
+    return Costume_maskAtSize(sprite->costumes[costume], side);
+}
+
+#define SPRITE_GRID_COLS ((STAGE_WIDTH + SPRITE_GRID_CELL - 1) / SPRITE_GRID_CELL)
+#define SPRITE_GRID_ROWS ((STAGE_HEIGHT + SPRITE_GRID_CELL - 1) / SPRITE_GRID_CELL)
+
+// خانه‌هایی که مستطیل r (پیکسل صحنه) رویشان می‌افتد؛ بیرون صحنه به خانه‌های لبه چسبانده می‌شود
+static SDL_Rect gridCells(SDL_Rect r) {
+    auto cellOf = [](int v, int n) { return v < 0 ? 0 : min(v / SPRITE_GRID_CELL, n - 1); };
+    int x0 = cellOf(r.x, SPRITE_GRID_COLS), x1 = cellOf(r.x + r.w - 1, SPRITE_GRID_COLS);
+    int y0 = cellOf(r.y, SPRITE_GRID_ROWS), y1 = cellOf(r.y + r.h - 1, SPRITE_GRID_ROWS);
+    return {x0, y0, x1 - x0 + 1, y1 - y0 + 1};
+}
+
+void SpriteGrid_place(Project* proj, int spriteIndex) {
+    SpriteGrid& g = proj->grid;
+    Sprite* s = proj->sprites[spriteIndex];
+    SDL_Rect r = spriteFootprint(s->x, s->y, s->size);
+    SDL_Rect span = {0, 0, 0, 0};
+    if (r.w > 0) {
+        // یک پیکسل حاشیه تا آزمون اعشاری کلیک در لبه‌ی خانه از قلم نیفتد
+        span = gridCells({r.x - 1, r.y - 1, r.w + 2, r.h + 2});
+    }
+    SDL_Rect& old = g.spans[spriteIndex];
+    if (old.x == span.x && old.y == span.y && old.w == span.w && old.h == span.h) return;
+    for (int cy = old.y; cy < old.y + old.h; cy++) {
+        for (int cx = old.x; cx < old.x + old.w; cx++) {
+            vector<int>& cell = g.cells[cy * SPRITE_GRID_COLS + cx];
+            cell.erase(remove(cell.begin(), cell.end(), spriteIndex), cell.end());
+        }
+    }
+    for (int cy = span.y; cy < span.y + span.h; cy++) {
+        for (int cx = span.x; cx < span.x + span.w; cx++) {
+            g.cells[cy * SPRITE_GRID_COLS + cx].push_back(spriteIndex);
+        }
+    }
+    old = span;
+}
+
+// فقط اسپرایت‌های جابه‌جاشده دوباره چیده می‌شوند؛ در تیک موازی صف خالی است و فقط خوانده می‌شود
+void SpriteGrid_sync(Project* proj) {
+    SpriteGrid& g = proj->grid;
+    int count = (int)proj->sprites.size();
+    if (g.stale) {
+        g.cells.assign(SPRITE_GRID_COLS * SPRITE_GRID_ROWS, vector<int>());
+        g.spans.assign(count, {0, 0, 0, 0});
+        g.byName.clear();
+        for (int i = 0; i < count; i++) {
+            proj->sprites[i]->gridQueued = false;
+            SpriteGrid_place(proj, i);
+            g.byName.emplace(proj->sprites[i]->name, i);
+        }
+        g.dirty.clear();
+        g.stale = false;
+        return;
+    }
+    if (g.dirty.empty()) return;
+    for (int i : g.dirty) {
+        if (i >= count) continue;
+        proj->sprites[i]->gridQueued = false;
+        SpriteGrid_place(proj, i);
+    }
+    g.dirty.clear();
+}
+
+// اندیس اسپرایت‌هایی که ممکن است با area (پیکسل صحنه) هم‌پوشانی داشته باشند، مرتب و بدون تکرار
+void SpriteGrid_query(Project* proj, SDL_Rect area, vector<int>& out) {
+    out.clear();
+    SpriteGrid_sync(proj);
+    if (area.w <= 0 || area.h <= 0) return;
+    SDL_Rect span = gridCells(area);
+    for (int cy = span.y; cy < span.y + span.h; cy++) {
+        for (int cx = span.x; cx < span.x + span.w; cx++) {
+            const vector<int>& cell = proj->grid.cells[cy * SPRITE_GRID_COLS + cx];
+            out.insert(out.end(), cell.begin(), cell.end());
+        }
+    }
+    if (span.w > 1 || span.h > 1) {
+        sort(out.begin(), out.end());
+        out.erase(unique(out.begin(), out.end()), out.end());
+    }
+}
+
+// کارگرهای موازی به شبکه دست نمی‌زنند؛ جابه‌جایی‌شان بعد از ادغام تیک صف می‌شود
+void Project_spriteMoved(Project* proj, ExecutionContext* ctx, int spriteIndex) {
+    if (ctx && ctx->group) return;
+    Sprite* s = proj->sprites[spriteIndex];
+    if (s->gridQueued) return;
+    s->gridQueued = true;
+    proj->grid.dirty.push_back(spriteIndex);
+}
+
+int Project_findSprite(Project* proj, const string& name) {
+    SpriteGrid_sync(proj);
+    auto it = proj->grid.byName.find(name);
+    return it == proj->grid.byName.end() ? -1 : it->second;
+}
+
+static inline Uint32 blendOver(Uint32 dst, Uint32 src, int a) {
+    int inv = 255 - a;
+    Uint32 r = ((((src >> 16) & 0xFF) * a + ((dst >> 16) & 0xFF) * inv) + 127) / 255;
+    Uint32 g = ((((src >> 8) & 0xFF) * a + ((dst >> 8) & 0xFF) * inv) + 127) / 255;
+    Uint32 b = (((src & 0xFF) * a + (dst & 0xFF) * inv) + 127) / 255;
+    return 0xFF000000u | (r << 16) | (g << 8) | b;
+}
+
+// پس‌زمینه و لایه‌ی قلم (CPU یا کپی بازخوانده‌ی GPU) با همان ترتیب رسم؛ اسپرایت‌ها جدا روی ناحیه‌ی هر پرسش کشیده می‌شوند
+const Uint32* Project_stageColors(Project* proj) {
+    if (SDL_AtomicGet(&proj->stageColorsValid)) return proj->stageColors.data();
+    if (gStageColorLock) SDL_LockMutex(gStageColorLock);
+    if (!SDL_AtomicGet(&proj->stageColorsValid)) {
+        SDL_AtomicSet(&proj->penMirrorWanted, 1);
+        proj->stageColors.resize((size_t)STAGE_WIDTH * STAGE_HEIGHT);
+        Uint32* dst = proj->stageColors.data();
+        Backdrop* b = NULL;
+        if (proj->currentBackdrop >= 0 && proj->currentBackdrop < (int)proj->backdrops.size()) {
+            b = proj->backdrops[proj->currentBackdrop];
+        }
+        if (b && b->surface) {
+            SDL_Surface* surf = b->surface;
+            for (int y = 0; y < STAGE_HEIGHT; y++) {
+                const Uint32* src = (const Uint32*)((const Uint8*)surf->pixels + (size_t)(y * surf->h / STAGE_HEIGHT) * surf->pitch);
+                Uint32* out = dst + (size_t)y * STAGE_WIDTH;
+                for (int x = 0; x < STAGE_WIDTH; x++) out[x] = src[x * surf->w / STAGE_WIDTH] | 0xFF000000u;
+            }
+        } else {
+            Uint32 fill = b ? 0xFFC8C8FFu : 0xFFC8C8C8u;
+            std::fill(dst, dst + (size_t)STAGE_WIDTH * STAGE_HEIGHT, fill);
+        }
+        PenRaster* pen = proj->penRaster;
+        if (pen && pen->w >= STAGE_WIDTH && pen->h >= STAGE_HEIGHT) {
+            // از هر بلوک penScale×penScale پیکسل وسط خوانده می‌شود
+            int ps = pen->w / STAGE_WIDTH;
+            for (int y = 0; y < STAGE_HEIGHT; y++) {
+                const Uint32* src = &pen->pixels[(size_t)(y * ps + ps / 2) * pen->w + ps / 2];
+                Uint32* out = dst + (size_t)y * STAGE_WIDTH;
+                for (int x = 0; x < STAGE_WIDTH; x++) {
+                    Uint32 px = src[x * ps];
+                    int a = px >> 24;
+                    if (a) out[x] = blendOver(out[x], px, a);
+                }
+            }
+        } else if (!pen && proj->penMirror.size() == (size_t)STAGE_WIDTH * STAGE_HEIGHT) {
+            const Uint32* src = proj->penMirror.data();
+            for (size_t i = 0; i < proj->penMirror.size(); i++) {
+                int a = src[i] >> 24;
+                if (a) dst[i] = blendOver(dst[i], src[i], a);
+            }
+        }
+        SDL_AtomicSet(&proj->stageColorsValid, 1);
+    }
+    if (gStageColorLock) SDL_UnlockMutex(gStageColorLock);
+    return proj->stageColors.data();
+}
+
+// یک ردیف از اسپرایت (r جای آن روی صحنه) روی row که از x0 شروع می‌شود؛ copy یعنی رنگ خام بدون ترکیب
+static void Sprite_composeRow(Sprite* sprite, const SpritePose& pose, SDL_Rect r, int y, Uint32* row, int x0, int n, int alpha, bool copy) {
+    int from = max(x0, r.x), to = min(x0 + n, r.x + r.w);
+    if (from >= to || y < r.y || y >= r.y + r.h) return;
+    Costume* costume = NULL;
+    if (pose.costume >= 0 && pose.costume < (int)sprite->costumes.size()) {
+        costume = sprite->costumes[pose.costume];
+    }
+    if (costume && costume->surface) {
+        SDL_Surface* surf = costume->surface;
+        const Uint32* src = (const Uint32*)((const Uint8*)surf->pixels + (size_t)((y - r.y) * surf->h / r.h) * surf->pitch);
+        for (int x = from; x < to; x++) {
+            Uint32 px = src[(x - r.x) * surf->w / r.w];
+            if (copy) {
+                row[x - x0] = px;
+                continue;
+            }
+            int a = (int)(px >> 24) * alpha / 255;
+            if (a) row[x - x0] = blendOver(row[x - x0], px, a);
+        }
+        return;
+    }
+    // لباس بدون تصویر: مستطیل رنگی با قاب سیاه، مثل رسم صحنه
+    int c = pose.costume;
+    float bright = pose.brightness / 100.0f;
+    Uint32 fill = ((Uint32)(Uint8)(((c * 50) % 256) * bright) << 16) |
+                  ((Uint32)(Uint8)(((c * 80) % 256) * bright) << 8) |
+                  (Uint32)(Uint8)(((c * 110) % 256) * bright);
+    bool edgeRow = (y == r.y || y == r.y + r.h - 1);
+    for (int x = from; x < to; x++) {
+        Uint32 px = (edgeRow || x == r.x || x == r.x + r.w - 1) ? 0 : fill;
+        row[x - x0] = copy ? px : blendOver(row[x - x0], px, alpha);
+    }
+}
+
+// بیت i یعنی رنگ پیکسل i با color (با تلورانس COLOR_MATCH_MASK) یکی است
+static void colorMatchRow(const Uint32* row, Uint32 color, Uint64* bits, int n) {
+    Uint32 key = color & COLOR_MATCH_MASK;
+    for (int w = 0; w < (n + 63) >> 6; w++) bits[w] = 0;
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i m = _mm256_set1_epi32((int)COLOR_MATCH_MASK), k = _mm256_set1_epi32((int)key);
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(row + i)), m);
+        Uint64 hit = (Uint64)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, k)));
+        bits[i >> 6] |= hit << (i & 63);
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128i m = _mm_set1_epi32((int)COLOR_MATCH_MASK), k = _mm_set1_epi32((int)key);
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(row + i)), m);
+        Uint64 hit = (Uint64)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, k)));
+        bits[i >> 6] |= hit << (i & 63);
+    }
+#endif
+    for (; i < n; i++) {
+        if ((row[i] & COLOR_MATCH_MASK) == key) bits[i >> 6] |= (Uint64)1 << (i & 63);
+    }
+}
+
+// فقط داخل مربع اسپرایت و زیر ماسکش نگاه می‌کند؛ اسپرایت‌های دیگر فقط وقتی روی آن ناحیه‌اند کشیده می‌شوند
+bool ExecutionContext_touchingColor(ExecutionContext* ctx, Project* proj, Uint32 color, bool withOwn, Uint32 ownColor) {
+    Sprite* s = proj->sprites[ctx->spriteId];
+    SDL_Rect r = spriteFootprint(s->x, s->y, s->size);
+    SDL_Rect stage = {0, 0, STAGE_WIDTH, STAGE_HEIGHT};
+    SDL_Rect area;
+    if (r.w <= 0 || !SDL_IntersectRect(&r, &stage, &area)) return false;
+    SpritePose self = Sprite_pose(s);
+    const CollisionMask* mask = Sprite_mask(s, self.costume, r.w);
+    const Uint32* base = Project_stageColors(proj);
+
+    struct Cover { int layer; Sprite* sprite; SpritePose pose; SDL_Rect rect; int alpha; };
+    vector<Cover> covers;
+    vector<int> near;
+    SpriteGrid_query(proj, area, near);
+    for (int i : near) {
+        if (i == ctx->spriteId) continue;
+        SpritePose pose = ExecutionContext_spritePose(ctx, proj, i);
+        if (!pose.visible) continue;
+        SDL_Rect ro = spriteFootprint(pose.x, pose.y, pose.size);
+        if (ro.w <= 0 || !SDL_HasIntersection(&ro, &area)) continue;
+        Sprite* o = proj->sprites[i];
+        int alpha = (int)(255 * (1.0f - pose.ghost / 100.0f));
+        if (alpha <= 0) continue;
+        covers.push_back({o->layer, o, pose, ro, min(alpha, 255)});
+    }
+    sort(covers.begin(), covers.end(), [](const Cover& a, const Cover& b) { return a.layer < b.layer; });
+
+    int words = (area.w + 63) >> 6;
+    vector<Uint32> row(area.w), ownRow;
+    vector<Uint64> hits(words), ownHits;
+    if (withOwn) {
+        ownRow.resize(area.w);
+        ownHits.resize(words);
+    }
+    int offX = area.x - r.x;
+    for (int y = area.y; y < area.y + area.h; y++) {
+        const Uint64* maskRow = mask ? &mask->bits[(size_t)(y - r.y) * mask->stride] : NULL;
+        if (maskRow && !maskRowAny(maskRow, offX, area.w)) continue;
+        if (withOwn) {
+            Sprite_composeRow(s, self, r, y, ownRow.data(), area.x, area.w, 255, true);
+            colorMatchRow(ownRow.data(), ownColor, ownHits.data(), area.w);
+            bool any = false;
+            for (int w = 0; w < words && !any; w++) any = ownHits[w] != 0;
+            if (!any) continue;
+        }
+        memcpy(row.data(), base + (size_t)y * STAGE_WIDTH + area.x, area.w * sizeof(Uint32));
+        for (const Cover& c : covers) Sprite_composeRow(c.sprite, c.pose, c.rect, y, row.data(), area.x, area.w, c.alpha, false);
+        colorMatchRow(row.data(), color, hits.data(), area.w);
+        for (int w = 0; w < words; w++) {
+            Uint64 v = hits[w];
+            if (maskRow) v &= maskWord(maskRow, offX + w * 64);
+            if (withOwn) v &= ownHits[w];
+            if (v) return true;
+        }
+    }
+    return false;
+}
+
+PenRaster* PenRaster_create(int w, int h) {
+    PenRaster* r = new PenRaster;
+    r->w = w;
+    r->h = h;
+    r->pixels.assign((size_t)w * h, 0);
+    return r;
+}
+
+void PenRaster_markDirty(PenRaster* r, SDL_Rect rect) {
+    SDL_Rect bounds = {0, 0, r->w, r->h};
+    SDL_Rect clipped;
+    if (!SDL_IntersectRect(&rect, &bounds, &clipped)) return;
+    for (SDL_Rect& d : r->dirty) {
+        if (SDL_HasIntersection(&d, &clipped)) {
+            SDL_UnionRect(&d, &clipped, &d);
+            return;
+        }
+    }
+    if ((int)r->dirty.size() < PEN_MAX_DIRTY_RECTS) {
+        r->dirty.push_back(clipped);
+    } else {
+        SDL_UnionRect(&r->dirty.back(), &clipped, &r->dirty.back());
+    }
+}
+
+// رنگ ثابت روی n پیکسل: out = src*a + dst*(255-a)، آلفا هم با همین فرمول
+void PenRaster_blendSpan(Uint32* dst, Uint32 color, int n) {
+    Uint32 a = color >> 24;
+    if (a == 0) return;
+    if (a == 255) {
+        int i = 0;
+#if defined(__AVX2__)
+        __m256i c8 = _mm256_set1_epi32((int)color);
+        for (; i + 8 <= n; i += 8) _mm256_storeu_si256((__m256i*)(dst + i), c8);
+#elif defined(__SSE2__) || defined(_M_X64)
+        __m128i c4 = _mm_set1_epi32((int)color);
+        for (; i + 4 <= n; i += 4) _mm_storeu_si128((__m128i*)(dst + i), c4);
+#endif
+        for (; i < n; i++) dst[i] = color;
+        return;
+    }
+    Uint32 src = color | 0xFF000000u;
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i zero = _mm256_setzero_si256();
+    __m256i srcW = _mm256_mullo_epi16(_mm256_unpacklo_epi8(_mm256_set1_epi32((int)src), zero), _mm256_set1_epi16((short)a));
+    __m256i inv = _mm256_set1_epi16((short)(255 - a));
+    __m256i bias = _mm256_set1_epi16(128);
+    for (; i + 8 <= n; i += 8) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i lo = _mm256_add_epi16(_mm256_add_epi16(srcW, _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inv)), bias);
+        __m256i hi = _mm256_add_epi16(_mm256_add_epi16(srcW, _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inv)), bias);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128i zero = _mm_setzero_si128();
+    __m128i srcW = _mm_mullo_epi16(_mm_unpacklo_epi8(_mm_set1_epi32((int)src), zero), _mm_set1_epi16((short)a));
+    __m128i inv = _mm_set1_epi16((short)(255 - a));
+    __m128i bias = _mm_set1_epi16(128);
+    for (; i + 4 <= n; i += 4) {
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(srcW, _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inv)), bias);
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(srcW, _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inv)), bias);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < n; i++) {
+        Uint32 d = dst[i], out = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            Uint32 v = ((src >> shift) & 0xFF) * a + ((d >> shift) & 0xFF) * (255 - a) + 128;
+            out |= (((v + (v >> 8)) >> 8) & 0xFF) << shift;
+        }
+        dst[i] = out;
+    }
+}
+
+// مثل بالا ولی آلفای هر پیکسل از منبع گرفته می‌شود
+void PenRaster_blendRow(Uint32* dst, const Uint32* src, int n) {
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i zero = _mm256_setzero_si256();
+    __m256i opaque = _mm256_set1_epi32((int)0xFF000000u);
+    __m256i ones = _mm256_set1_epi16(255);
+    __m256i bias = _mm256_set1_epi16(128);
+    for (; i + 8 <= n; i += 8) {
+        __m256i sv = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i s1 = _mm256_or_si256(sv, opaque);
+        __m256i slo = _mm256_unpacklo_epi8(sv, zero), shi = _mm256_unpackhi_epi8(sv, zero);
+        __m256i alo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(slo, 0xFF), 0xFF);
+        __m256i ahi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(shi, 0xFF), 0xFF);
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(s1, zero), alo),
+                                      _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(ones, alo)));
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(s1, zero), ahi),
+                                      _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(ones, ahi)));
+        lo = _mm256_add_epi16(lo, bias);
+        hi = _mm256_add_epi16(hi, bias);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128i zero = _mm_setzero_si128();
+    __m128i opaque = _mm_set1_epi32((int)0xFF000000u);
+    __m128i ones = _mm_set1_epi16(255);
+    __m128i bias = _mm_set1_epi16(128);
+    for (; i + 4 <= n; i += 4) {
+        __m128i sv = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i s1 = _mm_or_si128(sv, opaque);
+        __m128i slo = _mm_unpacklo_epi8(sv, zero), shi = _mm_unpackhi_epi8(sv, zero);
+        __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xFF), 0xFF);
+        __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xFF), 0xFF);
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s1, zero), alo),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(ones, alo)));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s1, zero), ahi),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(ones, ahi)));
+        lo = _mm_add_epi16(lo, bias);
+        hi = _mm_add_epi16(hi, bias);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < n; i++) {
+        Uint32 sv = src[i] | 0xFF000000u, a = src[i] >> 24, d = dst[i], out = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            Uint32 v = ((sv >> shift) & 0xFF) * a + ((d >> shift) & 0xFF) * (255 - a) + 128;
+            out |= (((v + (v >> 8)) >> 8) & 0xFF) << shift;
+        }
+        dst[i] = out;
+    }
+}
+
+void PenRaster_clear(PenRaster* r) {
+    fill(r->pixels.begin(), r->pixels.end(), 0u);
+    r->dirty.clear();
+    r->dirty.push_back({0, 0, r->w, r->h});
+}
+
+// کپسول (خط ضخیم با سرهای گرد) سطر به سطر؛ چون محدب است هر سطر یک بازه است
+void PenRaster_line(PenRaster* r, float x1, float y1, float x2, float y2, float width, SDL_Color color) {
+    float half = max(width, 1.0f) * 0.5f;
+    bool round = width > 2;
+    float dx = x2 - x1, dy = y2 - y1;
+    float len = sqrtf(dx*dx + dy*dy);
+    float nx = 0, ny = 0;
+    if (len > 0.0001f) { nx = -dy / len * half; ny = dx / len * half; }
+    float px[4] = {x1 + nx, x2 + nx, x2 - nx, x1 - nx};
+    float py[4] = {y1 + ny, y2 + ny, y2 - ny, y1 - ny};
+
+    int top = (int)floorf(min(y1, y2) - half);
+    int bottom = (int)ceilf(max(y1, y2) + half);
+    int left = (int)floorf(min(x1, x2) - half);
+    int right = (int)ceilf(max(x1, x2) + half);
+    top = max(top, 0);
+    bottom = min(bottom, r->h - 1);
+    Uint32 argb = ((Uint32)color.a << 24) | ((Uint32)color.r << 16) | ((Uint32)color.g << 8) | color.b;
+
+    for (int y = top; y <= bottom; y++) {
+        float yc = y + 0.5f;
+        float lo = 1e9f, hi = -1e9f;
+        if (len > 0.0001f) {
+            for (int e = 0; e < 4; e++) {
+                float ax = px[e], ay = py[e], bx = px[(e + 1) % 4], by = py[(e + 1) % 4];
+                if ((yc < ay && yc < by) || (yc > ay && yc > by) || ay == by) continue;
+                float x = ax + (yc - ay) * (bx - ax) / (by - ay);
+                lo = min(lo, x);
+                hi = max(hi, x);
+            }
+        } else if (!round && fabsf(yc - y1) <= half) {
+            lo = x1 - half;
+            hi = x1 + half;
+        }
+        if (round) {
+            float ends[2][2] = {{x1, y1}, {x2, y2}};
+            for (auto& c : ends) {
+                float ddy = yc - c[1];
+                if (fabsf(ddy) > half) continue;
+                float ddx = sqrtf(half*half - ddy*ddy);
+                lo = min(lo, c[0] - ddx);
+                hi = max(hi, c[0] + ddx);
+            }
+        }
+        if (lo > hi) continue;
+        int xs = max((int)ceilf(lo - 0.5f), 0);
+        int xe = min((int)floorf(hi - 0.5f), r->w - 1);
+        if (xe < xs) continue;
+        PenRaster_blendSpan(&r->pixels[(size_t)y * r->w + xs], argb, xe - xs + 1);
+    }
+    PenRaster_markDirty(r, {left, top, right - left + 1, bottom - top + 1});
+}
+
+// تمبر با نمونه‌برداری نزدیک‌ترین همسایه از سطح ARGB8888 لباس
+void PenRaster_stamp(PenRaster* r, SDL_Surface* surface, SDL_Rect dst) {
+    if (!surface || dst.w <= 0 || dst.h <= 0) return;
+    SDL_Rect bounds = {0, 0, r->w, r->h};
+    SDL_Rect clipped;
+    if (!SDL_IntersectRect(&dst, &bounds, &clipped)) return;
+    vector<Uint32> row(clipped.w);
+    for (int y = clipped.y; y < clipped.y + clipped.h; y++) {
+        int sy = (y - dst.y) * surface->h / dst.h;
+        const Uint32* srcRow = (const Uint32*)((const Uint8*)surface->pixels + (size_t)sy * surface->pitch);
+        for (int x = 0; x < clipped.w; x++) {
+            row[x] = srcRow[(clipped.x + x - dst.x) * surface->w / dst.w];
+        }
+        PenRaster_blendRow(&r->pixels[(size_t)y * r->w + clipped.x], row.data(), clipped.w);
+    }
+    PenRaster_markDirty(r, clipped);
+}
+
+void PenRaster_upload(PenRaster* r, SDL_Texture* texture) {
+    for (const SDL_Rect& d : r->dirty) {
+        SDL_UpdateTexture(texture, &d, &r->pixels[(size_t)d.y * r->w + d.x], r->w * 4);
+    }
+    r->dirty.clear();
+}
+
+SDL_Texture* loadTexture(SDL_Renderer* renderer, const char* path) {
+    SDL_Texture* newTexture = NULL;
+    SDL_Surface* loadedSurface = IMG_Load(path);
+    if (loadedSurface == NULL) {
+        printf("Unable to load image %s! SDL_image Error: %s\n", path, IMG_GetError());
+    } else {
+        newTexture = SDL_CreateTextureFromSurface(renderer, loadedSurface);
+        SDL_FreeSurface(loadedSurface);
+        if (newTexture == NULL) {
+            printf("Unable to create texture from %s! SDL Error: %s\n", path, SDL_GetError());
+        }
+    }
+    return newTexture;
+}
+
+int findSoundByName(Project* proj, const char* name) {
+    for (size_t i = 0; i < proj->sounds.size(); i++) {
+        if (proj->sounds[i]->name == name) return i;
+    }
+    return -1;
+}
+
+Variable* findVariable(Project* proj, const string& name) {
+    for (size_t i = 0; i < proj->globalVariables.size(); i++) {
+        if (proj->globalVariables[i]->name == name)
+            return proj->globalVariables[i];
+    }
+    return nullptr;
+}
+
+void setVariable(Project* proj, const string& name, const Value& val) {
+    Variable* var = findVariable(proj, name);
+    if (var) {
+        var->value = val;
+    } else {
+        Variable* newVar = new Variable;
+        newVar->name = name;
+        newVar->value = val;
+        proj->globalVariables.push_back(newVar);
+    }
+}
+
+Value getVariable(Project* proj, const string& name) {
+    Variable* var = findVariable(proj, name);
+    if (var) return var->value;
+    return make_number(0);
+}
+
+SDL_Scancode keyNameToScancode(const char* name) {
+    if (!name) return SDL_SCANCODE_UNKNOWN;
+    string n = name;
+    if (n == "space") return SDL_SCANCODE_SPACE;
+    if (n == "up arrow") return SDL_SCANCODE_UP;
+    if (n == "down arrow") return SDL_SCANCODE_DOWN;
+    if (n == "left arrow") return SDL_SCANCODE_LEFT;
+    if (n == "right arrow") return SDL_SCANCODE_RIGHT;
+    if (n == "a") return SDL_SCANCODE_A;
+    if (n == "b") return SDL_SCANCODE_B;
+    if (n == "c") return SDL_SCANCODE_C;
+    if (n == "d") return SDL_SCANCODE_D;
+    if (n == "e") return SDL_SCANCODE_E;
+    if (n == "f") return SDL_SCANCODE_F;
+    if (n == "g") return SDL_SCANCODE_G;
+    if (n == "h") return SDL_SCANCODE_H;
+    if (n == "i") return SDL_SCANCODE_I;
+    if (n == "j") return SDL_SCANCODE_J;
+    if (n == "k") return SDL_SCANCODE_K;
+    if (n == "l") return SDL_SCANCODE_L;
+    if (n == "m") return SDL_SCANCODE_M;
+    if (n == "n") return SDL_SCANCODE_N;
+    if (n == "o") return SDL_SCANCODE_O;
+    if (n == "p") return SDL_SCANCODE_P;
+    if (n == "q") return SDL_SCANCODE_Q;
+    if (n == "r") return SDL_SCANCODE_R;
+    if (n == "s") return SDL_SCANCODE_S;
+    if (n == "t") return SDL_SCANCODE_T;
+    if (n == "u") return SDL_SCANCODE_U;
+    if (n == "v") return SDL_SCANCODE_V;
+    if (n == "w") return SDL_SCANCODE_W;
+    if (n == "x") return SDL_SCANCODE_X;
+    if (n == "y") return SDL_SCANCODE_Y;
+    if (n == "z") return SDL_SCANCODE_Z;
+    if (n == "0") return SDL_SCANCODE_0;
+    if (n == "1") return SDL_SCANCODE_1;
+    if (n == "2") return SDL_SCANCODE_2;
+    if (n == "3") return SDL_SCANCODE_3;
+    if (n == "4") return SDL_SCANCODE_4;
+    if (n == "5") return SDL_SCANCODE_5;
+    if (n == "6") return SDL_SCANCODE_6;
+    if (n == "7") return SDL_SCANCODE_7;
+    if (n == "8") return SDL_SCANCODE_8;
+    if (n == "9") return SDL_SCANCODE_9;
+    return SDL_SCANCODE_UNKNOWN;
+}
+// evaluateBlock function
+Value evaluateBlock(Block* b, ExecutionContext* ctx, Project* proj) {
+    switch (b->type) {
+        case BLOCK_NUMBER:
             return make_number(b->numParam1);
         case BLOCK_STRING:
             return make_string(b->strParam);
         case BLOCK_VARIABLE_GET:
-            return getVariable(proj, b->strParam);
+            return ExecutionContext_getVariable(ctx, proj, b->strParam);
         case BLOCK_ADD: {
             Value left = evaluateBlock(b->children[0], ctx, proj);
             Value right = evaluateBlock(b->children[1], ctx, proj);
@@ -762,7 +2835,7 @@ Value evaluateBlock(Block* b, ExecutionContext* ctx, Project* proj) {
             Value high = evaluateBlock(b->children[1], ctx, proj);
             float l = value_to_number(low);
             float h = value_to_number(high);
-            float r = l + (rand() / (float)RAND_MAX) * (h - l);
+            float r = l + ExecutionContext_random(ctx) * (h - l);
             return make_number(r);
         }
         case BLOCK_LT: {
@@ -910,21 +2983,14 @@ Value evaluateBlock(Block* b, ExecutionContext* ctx, Project* proj) {
             return make_number((s->x > 240 || s->x < -240 || s->y > 180 || s->y < -180) ? 1 : 0);
         }
         case BLOCK_MOUSE_X: {
-            int x, y;
-            SDL_GetMouseState(&x, &y);
-            SDL_Rect stageRect = {0, 40, 400, 600};
-            return make_number((float)(x - stageRect.w/2));
+            return make_number(roundf(proj->input.mouseX));
         }
         case BLOCK_MOUSE_Y: {
-            int x, y;
-            SDL_GetMouseState(&x, &y);
-            SDL_Rect stageRect = {0, 40, 400, 600};
-            return make_number((float)(stageRect.h/2 - y));
+            return make_number(roundf(proj->input.mouseY));
         }
         case BLOCK_KEY_PRESSED: {
-            const Uint8* state = SDL_GetKeyboardState(NULL);
             SDL_Scancode sc = keyNameToScancode(b->strParam.c_str());
-            return make_number((sc != SDL_SCANCODE_UNKNOWN && state[sc]) ? 1 : 0);
+            return make_number((sc != SDL_SCANCODE_UNKNOWN && proj->input.keys[sc]) ? 1 : 0);
         }
         case BLOCK_COSTUME_NUMBER: {
             Sprite* s = proj->sprites[ctx->spriteId];
@@ -952,79 +3018,60 @@ Value evaluateBlock(Block* b, ExecutionContext* ctx, Project* proj) {
         }
         case BLOCK_TOUCHING_MOUSEPOINTER: {
             Sprite* s = proj->sprites[ctx->spriteId];
-            int mouseX, mouseY;
-            SDL_GetMouseState(&mouseX, &mouseY);
-            int winW, winH;
-            SDL_GetWindowSize(gWindow, &winW, &winH);
-            int paletteWidth = 200, codeWidth = 400;
-            int sceneWidth = winW - paletteWidth - codeWidth;
-            int bottomHeight = 128;
-            int rightPanelHeight = winH - 40 - bottomHeight;
-            int backdropPanelHeight = 150, soundPanelHeight = 150;
-            int sceneHeight = rightPanelHeight - backdropPanelHeight - soundPanelHeight;
-            if (sceneHeight < 200) sceneHeight = 200;
-            SDL_Rect stageRect = {paletteWidth + codeWidth, 40, sceneWidth, sceneHeight};
-            float stageX = mouseX - (stageRect.x + stageRect.w/2);
-            float stageY = (stageRect.y + stageRect.h/2) - mouseY;
-            int spriteW = (int)(50 * s->size / 100.0f);
-            int spriteH = (int)(50 * s->size / 100.0f);
-            int touching = (stageX >= s->x - spriteW/2 && stageX <= s->x + spriteW/2 &&
-                            stageY >= s->y - spriteH/2 && stageY <= s->y + spriteH/2);
+            float stageX = proj->input.mouseX, stageY = proj->input.mouseY;
+            SDL_Rect r = spriteFootprint(s->x, s->y, s->size);
+            SDL_Point p = {(int)floorf(STAGE_WIDTH/2 + stageX), (int)floorf(STAGE_HEIGHT/2 - stageY)};
+            if (!SDL_PointInRect(&p, &r)) return make_number(0);
+            const CollisionMask* mask = Sprite_mask(s, s->currentCostume, r.w);
+            int touching = !mask || CollisionMask_test(mask, p.x - r.x, p.y - r.y);
             return make_number(touching ? 1 : 0);
         }
         case BLOCK_TOUCHING_SPRITE: {
             Sprite* s = proj->sprites[ctx->spriteId];
             string otherName = b->strParam;
             if (otherName.empty()) return make_number(0);
-            for (size_t i = 0; i < proj->sprites.size(); i++) {
-                if ((int)i == ctx->spriteId) continue;
-                Sprite* other = proj->sprites[i];
-                if (other->name != otherName) continue;
-                if (!other->visible) continue;
-                int w1 = (int)(50 * s->size / 100.0f);
-                int h1 = (int)(50 * s->size / 100.0f);
-                int w2 = (int)(50 * other->size / 100.0f);
-                int h2 = (int)(50 * other->size / 100.0f);
-                if (abs(s->x - other->x) < (w1/2 + w2/2) && abs(s->y - other->y) < (h1/2 + h2/2)) {
-                    return make_number(1);
-                }
-                break;
+            SDL_Rect r1 = spriteFootprint(s->x, s->y, s->size);
+            if (r1.w <= 0) return make_number(0);
+            // فقط اسپرایت‌های هم‌خانه در شبکه؛ اول مستطیل‌ها، بعد ماسک‌ها روی ناحیه‌ی مشترک
+            vector<int> near;
+            SpriteGrid_query(proj, r1, near);
+            for (int i : near) {
+                if (i == ctx->spriteId) continue;
+                if (proj->sprites[i]->name != otherName) continue;
+                SpritePose other = ExecutionContext_spritePose(ctx, proj, i);
+                if (!other.visible) continue;
+                SDL_Rect r2 = spriteFootprint(other.x, other.y, other.size);
+                if (!SDL_HasIntersection(&r1, &r2)) continue;
+                const CollisionMask* m1 = Sprite_mask(s, s->currentCostume, r1.w);
+                const CollisionMask* m2 = Sprite_mask(proj->sprites[i], other.costume, r2.w);
+                if (CollisionMask_overlap(m1, r1, m2, r2)) return make_number(1);
             }
             return make_number(0);
         }
-        case BLOCK_TOUCHING_COLOR:
-        case BLOCK_COLOR_TOUCHING_COLOR:
-            // فعلاً پیاده‌سازی نشده
-            return make_number(0);
+        case BLOCK_TOUCHING_COLOR: {
+            bool touching = ExecutionContext_touchingColor(ctx, proj, (Uint32)(int)b->numParam1 & 0xFFFFFF, false, 0);
+            return make_number(touching ? 1 : 0);
+        }
+        case BLOCK_COLOR_TOUCHING_COLOR: {
+            // numParam1 رنگ خود اسپرایت، numParam2 رنگی که باید لمس شود
+            bool touching = ExecutionContext_touchingColor(ctx, proj, (Uint32)(int)b->numParam2 & 0xFFFFFF,
+                                                           true, (Uint32)(int)b->numParam1 & 0xFFFFFF);
+            return make_number(touching ? 1 : 0);
+        }
         case BLOCK_DISTANCE_TO: {
             Sprite* s = proj->sprites[ctx->spriteId];
             string target = b->strParam;
             if (target.empty()) return make_number(0);
             float dx = 0, dy = 0;
             if (target == "mouse-pointer") {
-                int mouseX, mouseY;
-                SDL_GetMouseState(&mouseX, &mouseY);
-                int winW, winH;
-                SDL_GetWindowSize(gWindow, &winW, &winH);
-                int paletteWidth = 200, codeWidth = 400;
-                int sceneWidth = winW - paletteWidth - codeWidth;
-                int bottomHeight = 128;
-                int rightPanelHeight = winH - 40 - bottomHeight;
-                int backdropPanelHeight = 150, soundPanelHeight = 150;
-                int sceneHeight = rightPanelHeight - backdropPanelHeight - soundPanelHeight;
-                if (sceneHeight < 200) sceneHeight = 200;
-                SDL_Rect stageRect = {paletteWidth + codeWidth, 40, sceneWidth, sceneHeight};
-                float stageX = mouseX - (stageRect.x + stageRect.w/2);
-                float stageY = (stageRect.y + stageRect.h/2) - mouseY;
-                dx = stageX - s->x;
-                dy = stageY - s->y;
+                dx = proj->input.mouseX - s->x;
+                dy = proj->input.mouseY - s->y;
             } else {
-                for (size_t i = 0; i < proj->sprites.size(); i++) {
-                    if (proj->sprites[i]->name == target) {
-                        dx = proj->sprites[i]->x - s->x;
-                        dy = proj->sprites[i]->y - s->y;
-                        break;
-                    }
+                int i = Project_findSprite(proj, target);
+                if (i >= 0) {
+                    SpritePose other = ExecutionContext_spritePose(ctx, proj, i);
+                    dx = other.x - s->x;
+                    dy = other.y - s->y;
                 }
             }
             return make_number(sqrtf(dx*dx + dy*dy));
@@ -1033,8 +3080,7 @@ Value evaluateBlock(Block* b, ExecutionContext* ctx, Project* proj) {
             return make_string(proj->answer);
         }
         case BLOCK_MOUSE_DOWN: {
-            Uint32 buttons = SDL_GetMouseState(NULL, NULL);
-            return make_number((buttons & SDL_BUTTON_LMASK) ? 1 : 0);
+            return make_number(proj->input.mouseDown ? 1 : 0);
         }
         case BLOCK_TIMER: {
             return make_number((SDL_GetTicks() - proj->timerStart) / 1000.0f);
@@ -1061,30 +3107,44 @@ SDL_Color hslToRgb(float h, float s, float l) {
     return {(Uint8)((r + m)*255), (Uint8)((g + m)*255), (Uint8)((b + m)*255), 255};
 }
 
-void drawLineOnCanvas(SDL_Renderer* renderer, SDL_Texture* canvas, int x1, int y1, int x2, int y2, SDL_Color color, int size) {
-    SDL_Texture* oldTarget = SDL_GetRenderTarget(renderer);
-    SDL_SetRenderTarget(renderer, canvas);
-    SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
-    SDL_RenderDrawLine(renderer, x1, y1, x2, y2);
-    SDL_SetRenderTarget(renderer, oldTarget);
-}
-
-void Application_createPenCanvasForSprite(Application* app, Sprite* sprite) {
-    int winW, winH;
-    SDL_GetWindowSize(app->window, &winW, &winH);
-    if (sprite->penCanvas) SDL_DestroyTexture(sprite->penCanvas);
-    sprite->penCanvas = SDL_CreateTexture(app->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, winW, winH);
-    SDL_SetTextureBlendMode(sprite->penCanvas, SDL_BLENDMODE_BLEND);
-    SDL_SetRenderTarget(app->renderer, sprite->penCanvas);
+// یک لایه‌ی قلم به اندازه‌ی صحنه برای همه‌ی اسپرایت‌ها
+void Application_createPenLayer(Application* app) {
+    Project* proj = app->currentProject;
+    proj->penStrokes.vertices.clear();
+    proj->penStrokes.indices.clear();
+    // لایه فقط وقتی نوع یا کیفیتش عوض شود از نو ساخته می‌شود، نه با تغییر اندازه‌ی پنجره
+    if (proj->penLayer && ((proj->penRaster != NULL) != app->cpuPen || proj->penScale != app->penQuality)) {
+        SDL_DestroyTexture(proj->penLayer);
+        proj->penLayer = NULL;
+        delete proj->penRaster;
+        proj->penRaster = NULL;
+    }
+    proj->penScale = app->penQuality;
+    int layerW = STAGE_WIDTH * proj->penScale, layerH = STAGE_HEIGHT * proj->penScale;
+    if (app->cpuPen) {
+        if (!proj->penLayer) {
+            proj->penLayer = SDL_CreateTexture(app->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, layerW, layerH);
+            if (!proj->penLayer) return;
+            SDL_SetTextureBlendMode(proj->penLayer, SDL_BLENDMODE_BLEND);
+            SDL_SetTextureScaleMode(proj->penLayer, SDL_ScaleModeLinear);
+            proj->penRaster = PenRaster_create(layerW, layerH);
+        }
+        PenRaster_clear(proj->penRaster);
+        PenRaster_upload(proj->penRaster, proj->penLayer);
+        return;
+    }
+    if (!proj->penLayer) {
+        proj->penLayer = SDL_CreateTexture(app->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, layerW, layerH);
+        if (!proj->penLayer) return;
+        SDL_SetTextureBlendMode(proj->penLayer, SDL_BLENDMODE_BLEND);
+        SDL_SetTextureScaleMode(proj->penLayer, SDL_ScaleModeLinear);
+    }
+    SDL_Texture* oldTarget = SDL_GetRenderTarget(app->renderer);
+    SDL_SetRenderTarget(app->renderer, proj->penLayer);
     SDL_SetRenderDrawColor(app->renderer, 0, 0, 0, 0);
     SDL_RenderClear(app->renderer);
-    SDL_SetRenderTarget(app->renderer, NULL);
-}
-
-int compareSpritesByLayer(const void* a, const void* b) {
-    Sprite* sa = *(Sprite**)a;
-    Sprite* sb = *(Sprite**)b;
-    return sa->layer - sb->layer;
+    SDL_SetRenderTarget(app->renderer, oldTarget);
+    proj->penMirrorDirty = true;
 }
 
 int main(int argc, char* argv[]) {
@@ -1093,6 +3153,26 @@ int main(int argc, char* argv[]) {
     if (!Application_init(&app)) {
         return 1;
     }
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--tick-rate") == 0) {
+            app.tickRate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pen-quality") == 0) {
+            app.penQuality = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stage-quality") == 0) {
+            app.stageQuality = atoi(argv[++i]);
+        }
+    }
+    if (app.tickRate <= 0) app.tickRate = DEFAULT_TICK_RATE;
+    if (app.penQuality < 1) app.penQuality = 1;
+    if (app.penQuality > MAX_PEN_QUALITY) app.penQuality = MAX_PEN_QUALITY;
+    if (app.stageQuality < 1) app.stageQuality = 1;
+    if (app.stageQuality > MAX_STAGE_QUALITY) app.stageQuality = MAX_STAGE_QUALITY;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cpu-pen") == 0) app.cpuPen = true;
+        if (strcmp(argv[i], "--present") == 0) SDL_AtomicSet(&app.presenting, 1);
+        if (strcmp(argv[i], "--show-fps") == 0) app.showFps = true;
+    }
+    Application_createPenLayer(&app);
     Application_run(&app);
     Application_shutdown(&app);
     return 0;
@@ -1115,11 +3195,32 @@ bool Application_init(Application* app) {
                                    0, 0,
                                    SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE | SDL_WINDOW_FULLSCREEN_DESKTOP);
     if (!app->window) return false;
-    app->renderer = SDL_CreateRenderer(app->window, -1, SDL_RENDERER_ACCELERATED);
+    app->renderer = SDL_CreateRenderer(app->window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
     if (!app->renderer) return false;
+    SDL_RendererInfo rendererInfo;
+    app->vsync = SDL_GetRendererInfo(app->renderer, &rendererInfo) == 0 &&
+                 (rendererInfo.flags & SDL_RENDERER_PRESENTVSYNC);
+    SDL_DisplayMode displayMode;
+    if (SDL_GetCurrentDisplayMode(0, &displayMode) == 0 && displayMode.refresh_rate > 0) {
+        app->frameInterval = 1.0 / displayMode.refresh_rate;
+    } else {
+        app->frameInterval = 1.0 / 60.0;
+    }
 
     gWindow = app->window;
-
+    gErrorLock = SDL_CreateMutex();
+    gMainThread = SDL_ThreadID();
+    gMaskLock = SDL_CreateMutex();
+    gStageColorLock = SDL_CreateMutex();
+    gTextCache = TextCache_create(app->renderer, TEXT_CACHE_MAX_BYTES);
+    gBlockTiles = BlockTileAtlas_create(app->renderer, CODE_SCRIPT_WIDTH - 10, CODE_BLOCK_HEIGHT);
+    gCostumeAtlas = CostumeAtlas_create(app->renderer);
+    gMipBuilder = MipBuilder_create();
+    gEffectCache = EffectCache_create(app->renderer, EFFECT_CACHE_MAX_BYTES);
+
+    // تنظیمات لایه‌ی قلم پیش از هر چیزی که پروژه را می‌سازد
+    app->cpuPen = false;
+    app->penQuality = 1;
     app->currentProject = Project_create();
     app->engine = ExecutionEngine_create(app->currentProject);
     app->spriteManagerUI = SpriteManagerUI_create(app->renderer, app->currentProject);
@@ -1140,10 +3241,6 @@ bool Application_init(Application* app) {
     Project_addDefaultBackdrop(app->currentProject, "Backdrop1");
     Project_addDefaultSound(app->currentProject, "Sound1");
 
-    for (size_t i = 0; i < app->currentProject->sprites.size(); i++) {
-        Application_createPenCanvasForSprite(app, app->currentProject->sprites[i]);
-    }
-
     app->running = true;
     app->paused = false;
     app->executing = false;
@@ -1152,32 +3249,359 @@ bool Application_init(Application* app) {
     app->textInputBuffer[0] = '\0';
     app->lastError[0] = '\0';
     app->errorTime = 0;
+    app->tickRate = DEFAULT_TICK_RATE;
+    app->stageQuality = 1;
+    app->stageTarget = NULL;
+    app->stageTargetQuality = 0;
+    app->lastCounter = SDL_GetPerformanceCounter();
+    app->tickAccumulator = 0;
+    app->simTime = SDL_GetTicks();
+    app->renderAlpha = 1.0f;
+    app->uiLayer = NULL;
+    app->uiLayerW = 0;
+    app->uiLayerH = 0;
+    app->dirtyPanels = PANEL_ALL;
+    app->errorVisible = false;
+    app->visibleBubbles = 0;
+    app->simThread = NULL;
+    app->simLock = SDL_CreateMutex();
+    app->simWake = SDL_CreateSemaphore(0);
+    SDL_AtomicSet(&app->simRunning, 0);
+    SDL_AtomicSet(&app->wakePending, 0);
+    app->snapshotEvent = SDL_RegisterEvents(1);
+    app->editSerial = 0;
+    SDL_AtomicSet(&app->commands.head, 0);
+    SDL_AtomicSet(&app->commands.tail, 0);
+    for (StageSnapshot& snap : app->snapshots.slots) {
+        snap.project = NULL;
+        snap.currentBackdrop = -1;
+        snap.running = false;
+        snap.active = false;
+        snap.tickRate = DEFAULT_TICK_RATE;
+        snap.accumulator = 0;
+        snap.publishedAt = 0;
+        snap.editSerial = (Uint32)-1;
+    }
+    app->snapshots.readSlot = 0;
+    app->snapshots.writeSlot = 1;
+    SDL_AtomicSet(&app->snapshots.latest, 2);
+    app->snapshot = &app->snapshots.slots[0];
+    SDL_AtomicSet(&app->presenting, 0);
+    app->showFps = false;
+    app->fpsFrames = 0;
+    app->fpsStart = SDL_GetTicks();
+    app->fps = 0;
+    int winW, winH;
+    SDL_GetWindowSize(app->window, &winW, &winH);
+    Application_layout(app, winW, winH);
     return true;
 }
 
+// رشته‌ی اصلی فقط رویدادها و رسم را انجام می‌دهد؛ تیک‌ها در رشته‌ی شبیه‌سازی جلو می‌روند
 void Application_run(Application* app) {
+    Application_startSimulation(app);
     while (app->running) {
+        Application_acquireSnapshot(app);
+        int timeout = Application_idleTimeout(app);
+        if (!app->simThread) {
+            int wait = Application_simTimeout(app);
+            if (wait >= 0 && (timeout < 0 || wait < timeout)) timeout = wait;
+        }
+        if (timeout < 0) {
+            SDL_WaitEvent(NULL);
+        } else if (timeout > 0) {
+            SDL_WaitEventTimeout(NULL, timeout);
+        }
+        Uint64 frameStart = SDL_GetPerformanceCounter();
         Application_handleEvents(app);
-        if (!app->paused) {
-            Application_update(app);
-        }
+        if (!app->simThread) Application_simulate(app);
+        Application_acquireSnapshot(app);
         Application_render(app);
-        SDL_Delay(16);
+        if (!app->vsync) Application_paceFrame(app, frameStart);
+    }
+    Application_stopSimulation(app);
+}
+
+// 0 یعنی چیزی در حال حرکت است، -1 یعنی تا رویداد بعدی (یا عکس بعدی صحنه) می‌شود خوابید
+int Application_idleTimeout(Application* app) {
+    Uint32 now = SDL_GetTicks();
+    int timeout = -1;
+    for (const SpriteSnapshot& s : app->snapshot->sprites) {
+        if (s.prevX != s.x || s.prevY != s.y) return 0;
+        if (!s.bubbleText.empty() && s.bubbleUntil > now) {
+            int left = (int)(s.bubbleUntil - now);
+            if (timeout < 0 || left < timeout) timeout = left;
+        }
     }
+    // خطا را رشته‌ی شبیه‌سازی هم می‌نویسد
+    SDL_LockMutex(gErrorLock);
+    bool hasError = app->lastError[0] != '\0';
+    Uint32 errorTime = app->errorTime;
+    SDL_UnlockMutex(gErrorLock);
+    if (hasError && now - errorTime < 5000) {
+        int left = (int)(errorTime + 5000 - now);
+        if (timeout < 0 || left < timeout) timeout = left;
+    }
+    return timeout;
+}
+
+void Application_startSimulation(Application* app) {
+    app->lastCounter = SDL_GetPerformanceCounter();
+    app->simTime = SDL_GetTicks();
+    SDL_AtomicSet(&app->simRunning, 1);
+    app->simThread = SDL_CreateThread(Application_simThreadMain, "simulation", app);
+    if (!app->simThread) {
+        printf("Could not start simulation thread, running it on the main thread: %s\n", SDL_GetError());
+    }
+}
+
+void Application_stopSimulation(Application* app) {
+    if (!app->simThread) return;
+    SDL_AtomicSet(&app->simRunning, 0);
+    SDL_SemPost(app->simWake);
+    SDL_WaitThread(app->simThread, NULL);
+    app->simThread = NULL;
+}
+
+int Application_simThreadMain(void* data) {
+    Application* app = (Application*)data;
+    while (SDL_AtomicGet(&app->simRunning)) {
+        int wait = Application_simulate(app);
+        if (wait < 0) {
+            SDL_SemWait(app->simWake);
+        } else if (wait > 0) {
+            SDL_SemWaitTimeout(app->simWake, wait);
+        }
+    }
+    return 0;
+}
+
+// یک دور شبیه‌سازی: فرمان‌های صف، تیک‌های رسیده و انتشار عکس صحنه؛ مدت خواب تا دور بعد را برمی‌گرداند
+int Application_simulate(Application* app) {
+    SDL_LockMutex(app->simLock);
+    SimCommand cmd;
+    while (SimCommandQueue_pop(&app->commands, &cmd)) {
+        Application_applyCommand(app, cmd);
+    }
+    Application_update(app);
+    Application_publishSnapshot(app);
+    int wait = Application_simTimeout(app);
+    SDL_UnlockMutex(app->simLock);
+    if (app->simThread && SDL_AtomicCAS(&app->wakePending, 0, 1)) {
+        SDL_Event e;
+        SDL_zero(e);
+        e.type = app->snapshotEvent;
+        SDL_PushEvent(&e);
+    }
+    return wait;
+}
+
+int Application_simTimeout(Application* app) {
+    if (!app->executing || app->paused) return -1;
+    double tickLength = 1.0 / app->tickRate;
+    int untilTick = (int)ceil((tickLength - app->tickAccumulator) * 1000.0);
+    if (untilTick < 1) untilTick = 1;
+    // یک تیک دیگر لازم است تا موقعیت‌های قبلی به موقعیت فعلی برسند
+    for (Sprite* s : app->currentProject->sprites) {
+        if (s->prevX != s->x || s->prevY != s->y) return untilTick;
+    }
+    int left = ExecutionEngine_nextWake(app->engine, (Uint32)app->simTime);
+    if (left < 0) return -1;
+    return left > untilTick ? left : untilTick;
+}
+
+void Application_wakeSimulation(Application* app) {
+    if (app->simThread) SDL_SemPost(app->simWake);
+}
+
+bool SimCommandQueue_push(SimCommandQueue* queue, const SimCommand& cmd) {
+    int tail = SDL_AtomicGet(&queue->tail);
+    int next = (tail + 1) % SIM_QUEUE_SIZE;
+    if (next == SDL_AtomicGet(&queue->head)) return false;
+    queue->items[tail] = cmd;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&queue->tail, next);
+    return true;
+}
+
+bool SimCommandQueue_pop(SimCommandQueue* queue, SimCommand* cmd) {
+    int head = SDL_AtomicGet(&queue->head);
+    if (head == SDL_AtomicGet(&queue->tail)) return false;
+    SDL_MemoryBarrierAcquire();
+    *cmd = queue->items[head];
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&queue->head, (head + 1) % SIM_QUEUE_SIZE);
+    return true;
+}
+
+void Application_sendCommand(Application* app, SimCommandType type, int value, const char* text) {
+    SimCommand cmd;
+    cmd.type = type;
+    cmd.value = value;
+    cmd.text[0] = '\0';
+    if (text) {
+        strncpy(cmd.text, text, sizeof(cmd.text) - 1);
+        cmd.text[sizeof(cmd.text) - 1] = '\0';
+    }
+    if (!SimCommandQueue_push(&app->commands, cmd)) {
+        printf("Command queue full, dropped command %d\n", (int)type);
+    }
+    Application_wakeSimulation(app);
+}
+
+// فقط در رشته‌ی شبیه‌سازی و با simLock گرفته‌شده
+void Application_applyCommand(Application* app, const SimCommand& cmd) {
+    switch (cmd.type) {
+        case SIM_START:
+            app->executing = true;
+            app->paused = false;
+            ExecutionEngine_run(app->engine);
+            break;
+        case SIM_STOP:
+            app->executing = false;
+            ExecutionEngine_stop(app->engine);
+            break;
+        case SIM_STEP:
+            // یک تیک روی همان ساعت شبیه‌سازی، نه زمان دیواری
+            app->simTime += 1000.0 / app->tickRate;
+            app->engine->stepMode = true;
+            ExecutionEngine_step(app->engine, (Uint32)app->simTime);
+            app->engine->stepMode = false;
+            break;
+        case SIM_TOGGLE_PAUSE:
+            app->paused = !app->paused;
+            break;
+        case SIM_TOGGLE_PARALLEL:
+            ExecutionEngine_setParallel(app->engine, !app->engine->parallel);
+            printf("Parallel execution: %s\n", app->engine->parallel ? "on" : "off");
+            break;
+        case SIM_KEY:
+            ExecutionEngine_startKeyScripts(app->engine, (SDL_Keycode)cmd.value);
+            break;
+        case SIM_CLICK:
+            if (cmd.value >= 0 && cmd.value < (int)app->currentProject->sprites.size()) {
+                ExecutionEngine_startSpriteClickScripts(app->engine, cmd.value);
+            }
+            break;
+        case SIM_ANSWER:
+            if (!app->answerReady) {
+                strncpy(app->pendingAnswer, cmd.text, sizeof(app->pendingAnswer) - 1);
+                app->pendingAnswer[sizeof(app->pendingAnswer) - 1] = '\0';
+                app->answerReady = true;
+            }
+            break;
+    }
+}
+
+void Application_publishSnapshot(Application* app) {
+    SnapshotBuffer* buf = &app->snapshots;
+    StageSnapshot* snap = &buf->slots[buf->writeSlot];
+    Project* proj = app->currentProject;
+    snap->project = proj;
+    snap->currentBackdrop = proj->currentBackdrop;
+    snap->backdrop = NULL;
+    if (proj->currentBackdrop >= 0 && proj->currentBackdrop < (int)proj->backdrops.size()) {
+        snap->backdrop = proj->backdrops[proj->currentBackdrop];
+    }
+    snap->running = app->executing && !app->paused;
+    snap->active = !app->engine->contexts.empty();
+    snap->tickRate = app->tickRate;
+    snap->accumulator = app->tickAccumulator;
+    snap->publishedAt = SDL_GetPerformanceCounter();
+    snap->editSerial = app->editSerial;
+    // رشته‌های خانه‌های قبلی دوباره استفاده می‌شوند تا هر تیک حافظه نگیرد
+    snap->sprites.resize(proj->drawOrder.size());
+    size_t n = 0;
+    for (Sprite* s : proj->drawOrder) {
+        if (!s->visible) continue;
+        SpriteSnapshot& out = snap->sprites[n++];
+        out.sprite = s;
+        out.x = s->x;
+        out.y = s->y;
+        out.prevX = s->prevX;
+        out.prevY = s->prevY;
+        out.size = s->size;
+        out.costume = s->currentCostume;
+        out.shown = NULL;
+        if (s->currentCostume >= 0 && s->currentCostume < (int)s->costumes.size()) {
+            out.shown = s->costumes[s->currentCostume];
+        }
+        out.colorEffect = s->colorEffect;
+        out.brightnessEffect = s->brightnessEffect;
+        out.saturationEffect = s->saturationEffect;
+        out.ghostEffect = s->ghostEffect;
+        out.think = !s->thinkText.empty();
+        out.bubbleText = out.think ? s->thinkText : s->sayText;
+        out.bubbleUntil = out.think ? s->thinkUntil : s->sayUntil;
+    }
+    snap->sprites.resize(n);
+    SDL_MemoryBarrierRelease();
+    int previous = SDL_AtomicSet(&buf->latest, buf->writeSlot | SNAPSHOT_FRESH);
+    buf->writeSlot = previous & ~SNAPSHOT_FRESH;
+}
+
+// آخرین عکس منتشرشده را برمی‌دارد؛ تا عکس تازه‌ای نیامده همان قبلی می‌ماند
+void Application_acquireSnapshot(Application* app) {
+    SnapshotBuffer* buf = &app->snapshots;
+    if (!(SDL_AtomicGet(&buf->latest) & SNAPSHOT_FRESH)) return;
+    SDL_AtomicSet(&app->wakePending, 0);
+    int previous = SDL_AtomicSet(&buf->latest, buf->readSlot);
+    SDL_MemoryBarrierAcquire();
+    buf->readSlot = previous & ~SNAPSHOT_FRESH;
+    app->snapshot = &buf->slots[buf->readSlot];
+    Application_markDirty(app, app->snapshot->active ? PANEL_ALL & ~(PANEL_PALETTE | PANEL_PEN) : PANEL_STAGE);
+}
+
+void Application_paceFrame(Application* app, Uint64 frameStart) {
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 target = frameStart + (Uint64)(app->frameInterval * frequency);
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (now >= target) return;
+    double remainingMs = (double)(target - now) * 1000.0 / frequency;
+    if (remainingMs > 2.0) SDL_Delay((Uint32)(remainingMs - 2.0));
+    while (SDL_GetPerformanceCounter() < target) {
+    }
+}
+
+// ویرایش‌های رابط ساختار پروژه را عوض می‌کنند، پس با simLock بین دو دور شبیه‌سازی انجام می‌شوند
+// فقط در رشته‌ی اصلی و با simLock گرفته‌شده
+void Application_sampleInput(Application* app) {
+    InputState* in = &app->currentProject->input;
+    int x, y, numKeys = 0;
+    Uint32 buttons = SDL_GetMouseState(&x, &y);
+    screenToStage(stageRectForWindow(app->window), x, y, &in->mouseX, &in->mouseY);
+    in->mouseDown = (buttons & SDL_BUTTON_LMASK) != 0;
+    const Uint8* keys = SDL_GetKeyboardState(&numKeys);
+    if (numKeys > SDL_NUM_SCANCODES) numKeys = SDL_NUM_SCANCODES;
+    memcpy(in->keys, keys, numKeys);
 }
 
 void Application_handleEvents(Application* app) {
     SDL_Event e;
+    // edited فقط برای تغییر ساختار پروژه است؛ wake برای جابه‌جایی‌هایی که فقط عکس تازه می‌خواهند
+    bool edited = false;
+    bool wake = false;
+    SDL_LockMutex(app->simLock);
     while (SDL_PollEvent(&e)) {
+        if (e.type == app->snapshotEvent) continue;
         if (e.type == SDL_QUIT) {
             app->running = false;
         }
-        SpriteManagerUI_handleEvent(app->spriteManagerUI, &e);
-        BackdropManagerUI_handleEvent(app->backdropManagerUI, &e);
-        SoundManagerUI_handleEvent(app->soundManagerUI, &e);
-        PenToolUI_handleEvent(app->penToolUI, &e, app);
-        BlockPaletteUI_handleEvent(app->blockPalette, &e);
-        CodeAreaUI_handleEvent(app->codeArea, &e);
+        if (e.type == SDL_RENDER_TARGETS_RESET) {
+            BlockTileAtlas_invalidate(gBlockTiles);
+            Application_markDirty(app, PANEL_ALL);
+        }
+        // در حالت نمایش پنل‌های ویرایشگر دیده نمی‌شوند، پس رویدادی هم نمی‌گیرند
+        bool presenting = SDL_AtomicGet(&app->presenting) != 0;
+        if (!presenting) {
+            Application_markDirtyForEvent(app, &e);
+            SpriteManagerUI_handleEvent(app->spriteManagerUI, &e);
+            BackdropManagerUI_handleEvent(app->backdropManagerUI, &e);
+            SoundManagerUI_handleEvent(app->soundManagerUI, &e);
+            PenToolUI_handleEvent(app->penToolUI, &e, app);
+            BlockPaletteUI_handleEvent(app->blockPalette, &e);
+            CodeAreaUI_handleEvent(app->codeArea, &e);
+        }
 
         if (app->spriteManagerUI->selectedSpriteIndex != app->codeArea->selectedSpriteIndex) {
             app->codeArea->selectedSpriteIndex = app->spriteManagerUI->selectedSpriteIndex;
@@ -1207,34 +3631,24 @@ void Application_handleEvents(Application* app) {
                 app->textInputBuffer[len - 1] = '\0';
             }
         }
-        if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_RETURN && app->answerReady == false) {
+        if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_RETURN) {
             SDL_StopTextInput();
-            strncpy(app->pendingAnswer, app->textInputBuffer, sizeof(app->pendingAnswer)-1);
-            app->pendingAnswer[sizeof(app->pendingAnswer)-1] = '\0';
-            app->answerReady = true;
+            Application_sendCommand(app, SIM_ANSWER, 0, app->textInputBuffer);
             app->textInputBuffer[0] = '\0';
         }
 
         if (e.type == SDL_MOUSEBUTTONDOWN && e.button.button == SDL_BUTTON_LEFT) {
             int x = e.button.x, y = e.button.y;
-            int winW, winH;
-            SDL_GetWindowSize(app->window, &winW, &winH);
-
-            int startY = 70;
-            int paletteWidth = 200;
-            int codeWidth = 400;
-            int sceneWidth = winW - paletteWidth - codeWidth;
-            int bottomHeight = 128;
-            int rightPanelHeight = winH - startY - bottomHeight;
-            int backdropPanelHeight = 150;
-            int soundPanelHeight = 150;
-            int sceneHeight = rightPanelHeight - backdropPanelHeight - soundPanelHeight;
-            if (sceneHeight < 200) sceneHeight = 200;
-            SDL_Rect sceneRect = {paletteWidth + codeWidth, startY, sceneWidth, sceneHeight};
-
-            if (y >= startY && y < winH - bottomHeight && x >= sceneRect.x && x < sceneRect.x + sceneRect.w) {
-                int clickedSprite = ExecutionEngine_startSpriteClickScripts(app->engine, x, y, sceneRect);
+            SDL_Rect sceneRect = stageRectForWindow(app->window);
+            SDL_Rect view = stageViewRect(sceneRect);
+            SDL_Point p = {x, y};
+
+            if (SDL_PointInRect(&p, &view)) {
+                float stageX, stageY;
+                screenToStage(sceneRect, x, y, &stageX, &stageY);
+                int clickedSprite = Project_spriteAt(app->currentProject, stageX, stageY);
                 if (clickedSprite >= 0) {
+                    Application_sendCommand(app, SIM_CLICK, clickedSprite, NULL);
                     app->spriteManagerUI->selectedSpriteIndex = clickedSprite;
                     app->codeArea->selectedSpriteIndex = clickedSprite;
                     Sprite* s = app->currentProject->sprites[clickedSprite];
@@ -1248,7 +3662,7 @@ void Application_handleEvents(Application* app) {
                 }
             }
 
-            if (y < 40) {
+            if (!presenting && y < 40) {
                 int btnX = 5;
                 const char* buttons[] = {"New", "Save", "Load", "Start", "Stop", "Step", "Sprite", "Backdrop", "Sound"};
                 int numButtons = 9;
@@ -1269,6 +3683,7 @@ void Application_handleEvents(Application* app) {
                                 app->codeArea->project = app->currentProject;
                                 app->engine->project = app->currentProject;
                                 app->engine->contexts.clear();
+                                app->engine->mainOps.clear();
                                 app->spriteManagerUI->scrollOffset = 0;
                                 app->backdropManagerUI->scrollOffset = 0;
                                 app->soundManagerUI->scrollOffset = 0;
@@ -1282,9 +3697,8 @@ void Application_handleEvents(Application* app) {
                                 app->codeArea->editingParam = -1;
                                 app->codeArea->editBuffer.clear();
                                 SDL_StopTextInput();
-                                for (size_t j = 0; j < app->currentProject->sprites.size(); j++) {
-                                    Application_createPenCanvasForSprite(app, app->currentProject->sprites[j]);
-                                }
+                                Application_createPenLayer(app);
+                                edited = true;
                                 printf("New project created\n");
                                 break;
                             case 1:
@@ -1297,9 +3711,7 @@ void Application_handleEvents(Application* app) {
                             case 2:
                                 if (Project_load(app->currentProject, "project.txt")) {
                                     printf("Project loaded from project.txt\n");
-                                    for (size_t j = 0; j < app->currentProject->sprites.size(); j++) {
-                                        Application_createPenCanvasForSprite(app, app->currentProject->sprites[j]);
-                                    }
+                                    Application_createPenLayer(app);
                                     app->spriteManagerUI->selectedSpriteIndex = (app->currentProject->sprites.size() > 0) ? 0 : -1;
                                     app->codeArea->selectedSpriteIndex = app->spriteManagerUI->selectedSpriteIndex;
                                     app->spriteManagerUI->scrollOffset = 0;
@@ -1313,41 +3725,39 @@ void Application_handleEvents(Application* app) {
                                     app->codeArea->editingParam = -1;
                                     app->codeArea->editBuffer.clear();
                                     SDL_StopTextInput();
+                                    edited = true;
                                 } else {
                                     printf("Failed to load project\n");
                                 }
                                 break;
                             case 3:
-                                app->executing = true;
-                                app->paused = false;
-                                ExecutionEngine_run(app->engine);
+                                Application_sendCommand(app, SIM_START, 0, NULL);
                                 printf("Start\n");
                                 break;
                             case 4:
-                                app->executing = false;
-                                ExecutionEngine_stop(app->engine);
+                                Application_sendCommand(app, SIM_STOP, 0, NULL);
                                 printf("Stop\n");
                                 break;
                             case 5:
-                                app->engine->stepMode = true;
-                                ExecutionEngine_step(app->engine, SDL_GetTicks());
-                                app->engine->stepMode = false;
+                                Application_sendCommand(app, SIM_STEP, 0, NULL);
                                 printf("Step\n");
                                 break;
                             case 6:
                                 Project_addDefaultSprite(app->currentProject, "Sprite");
-                                Application_createPenCanvasForSprite(app, app->currentProject->sprites.back());
                                 app->spriteManagerUI->selectedSpriteIndex = app->currentProject->sprites.size() - 1;
                                 app->codeArea->selectedSpriteIndex = app->currentProject->sprites.size() - 1;
+                                edited = true;
                                 printf("Add sprite\n");
                                 break;
                             case 7:
                                 Project_addDefaultBackdrop(app->currentProject, "Backdrop");
+                                edited = true;
                                 printf("Add backdrop\n");
                                 break;
                             case 8:
                                 Project_addDefaultSound(app->currentProject, "Sound");
                                 app->soundManagerUI->selectedSoundIndex = app->currentProject->sounds.size() - 1;
+                                edited = true;
                                 printf("Add sound\n");
                                 break;
                         }
@@ -1361,19 +3771,8 @@ void Application_handleEvents(Application* app) {
 
         if (e.type == SDL_MOUSEMOTION && app->dragSpriteIndex >= 0) {
             int x = e.motion.x, y = e.motion.y;
-            int winW, winH;
-            SDL_GetWindowSize(app->window, &winW, &winH);
-            int startY = 70;
-            int paletteWidth = 200, codeWidth = 400;
-            int sceneWidth = winW - paletteWidth - codeWidth;
-            int bottomHeight = 128, rightPanelHeight = winH - startY - bottomHeight;
-            int backdropPanelHeight = 150, soundPanelHeight = 150;
-            int sceneHeight = rightPanelHeight - backdropPanelHeight - soundPanelHeight;
-            if (sceneHeight < 200) sceneHeight = 200;
-            SDL_Rect sceneRect = {paletteWidth + codeWidth, startY, sceneWidth, sceneHeight};
-
-            float stageX = (x - (sceneRect.x + sceneRect.w/2));
-            float stageY = (sceneRect.y + sceneRect.h/2 - y);
+            float stageX, stageY;
+            screenToStage(stageRectForWindow(app->window), x, y, &stageX, &stageY);
             if (stageX < -240) stageX = -240;
             if (stageX > 240) stageX = 240;
             if (stageY < -180) stageY = -180;
@@ -1382,6 +3781,10 @@ void Application_handleEvents(Application* app) {
             Sprite* s = app->currentProject->sprites[app->dragSpriteIndex];
             s->x = stageX;
             s->y = stageY;
+            s->prevX = stageX;
+            s->prevY = stageY;
+            Project_spriteMoved(app->currentProject, NULL, app->dragSpriteIndex);
+            wake = true;
         }
 
         if (e.type == SDL_MOUSEBUTTONUP && e.button.button == SDL_BUTTON_LEFT && app->dragSpriteIndex >= 0) {
@@ -1391,21 +3794,18 @@ void Application_handleEvents(Application* app) {
         if (e.type == SDL_KEYDOWN) {
             switch (e.key.keysym.sym) {
                 case SDLK_SPACE:
-                    app->paused = !app->paused;
+                    Application_sendCommand(app, SIM_TOGGLE_PAUSE, 0, NULL);
                     break;
                 case SDLK_F5:
-                    app->executing = true;
-                    app->paused = false;
-                    ExecutionEngine_run(app->engine);
+                    Application_sendCommand(app, SIM_START, 0, NULL);
                     break;
                 case SDLK_F6:
-                    app->engine->stepMode = true;
-                    ExecutionEngine_step(app->engine, SDL_GetTicks());
-                    app->engine->stepMode = false;
+                    Application_sendCommand(app, SIM_STEP, 0, NULL);
                     break;
                 case SDLK_F7:
                     if (app->spriteManagerUI->selectedSpriteIndex >= 0) {
                         SpriteManagerUI_uploadCostume(app->spriteManagerUI, "sprite.png");
+                        edited = true;
                     } else {
                         printf("No sprite selected.\n");
                     }
@@ -1413,6 +3813,7 @@ void Application_handleEvents(Application* app) {
                 case SDLK_F8:
                     if (app->backdropManagerUI->selectedBackdropIndex >= 0) {
                         BackdropManagerUI_uploadBackdrop(app->backdropManagerUI, "backdrop.png");
+                        edited = true;
                     } else {
                         printf("Please select a backdrop first from the left panel.\n");
                     }
@@ -1420,30 +3821,352 @@ void Application_handleEvents(Application* app) {
                 case SDLK_F9:
                     if (app->soundManagerUI->selectedSoundIndex >= 0) {
                         SoundManagerUI_uploadSound(app->soundManagerUI, "sound.wav");
+                        edited = true;
                     } else {
                         printf("No sound selected.\n");
                     }
                     break;
+                case SDLK_F10:
+                    Application_sendCommand(app, SIM_TOGGLE_PARALLEL, 0, NULL);
+                    break;
+                case SDLK_F11:
+                case SDLK_ESCAPE:
+                    if (e.key.keysym.sym == SDLK_ESCAPE && !presenting) break;
+                    SDL_AtomicSet(&app->presenting, presenting ? 0 : 1);
+                    app->dragSpriteIndex = -1;
+                    Application_markDirty(app, PANEL_ALL);
+                    break;
+                case SDLK_F12:
+                    app->showFps = !app->showFps;
+                    app->fpsFrames = 0;
+                    app->fpsStart = SDL_GetTicks();
+                    break;
+            }
+            Application_sendCommand(app, SIM_KEY, e.key.keysym.sym, NULL);
+        }
+    }
+    if (app->currentProject->edited) {
+        app->currentProject->edited = false;
+        edited = true;
+    }
+    Application_sampleInput(app);
+    if (edited) app->editSerial++;
+    SDL_UnlockMutex(app->simLock);
+    if (edited || wake) Application_wakeSimulation(app);
+}
+
+void Application_update(Application* app) {
+    Uint64 now = SDL_GetPerformanceCounter();
+    double elapsed = (double)(now - app->lastCounter) / SDL_GetPerformanceFrequency();
+    app->lastCounter = now;
+
+    // در مکث ساعت شبیه‌سازی می‌ایستد تا Step و انتظارها فقط با تیک جلو بروند
+    if (!app->executing || app->paused) {
+        app->tickAccumulator = 0;
+        if (!app->executing) app->simTime = SDL_GetTicks();
+        Application_snapSpritePositions(app);
+        return;
+    }
+
+    // اگر فریم خیلی طول کشید، به جای جبران همه تیک‌ها فقط ۲۵۰ میلی‌ثانیه جلو می‌رویم
+    if (elapsed > 0.25) elapsed = 0.25;
+    double tickLength = 1.0 / app->tickRate;
+    app->tickAccumulator += elapsed;
+    while (app->tickAccumulator >= tickLength) {
+        Application_snapSpritePositions(app);
+        app->simTime += tickLength * 1000.0;
+        ExecutionEngine_step(app->engine, (Uint32)app->simTime);
+        app->tickAccumulator -= tickLength;
+    }
+}
+
+void Application_snapSpritePositions(Application* app) {
+    for (Sprite* s : app->currentProject->sprites) {
+        s->prevX = s->x;
+        s->prevY = s->y;
+    }
+}
+
+void Application_render(Application* app) {
+    int winW, winH;
+    SDL_GetWindowSize(app->window, &winW, &winH);
+    if (SDL_AtomicGet(&app->presenting)) {
+        Application_renderPresentation(app, winW, winH);
+        return;
+    }
+    Application_layout(app, winW, winH);
+
+    if (!app->uiLayer || app->uiLayerW != winW || app->uiLayerH != winH) {
+        if (app->uiLayer) SDL_DestroyTexture(app->uiLayer);
+        app->uiLayer = SDL_CreateTexture(app->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, winW, winH);
+        app->uiLayerW = winW;
+        app->uiLayerH = winH;
+        app->dirtyPanels = PANEL_ALL;
+    }
+    Application_updateRenderAlpha(app);
+
+    // فقط کارهای رندرکننده که پروژه را تغییر می‌دهند زیر قفل‌اند؛ صحنه از روی عکس کشیده می‌شود
+    SDL_LockMutex(app->simLock);
+    ExecutionEngine_applyMainOps(app->engine);
+    Project_flushPen(app->currentProject, app->renderer);
+    Project_readBackPen(app->currentProject, app->renderer);
+    SDL_UnlockMutex(app->simLock);
+
+    Application_checkTimers(app);
+    Uint32 staleStage = 0;
+    if (!Application_snapshotCurrent(app)) {
+        staleStage = app->dirtyPanels & PANEL_STAGE;
+        app->dirtyPanels &= ~PANEL_STAGE;
+    }
+
+    SDL_SetRenderTarget(app->renderer, app->uiLayer);
+    if (app->dirtyPanels == PANEL_ALL) {
+        SDL_SetRenderDrawColor(app->renderer, 255, 255, 255, 255);
+        SDL_RenderClear(app->renderer);
+    }
+    SDL_Rect menuArea = {0, 0, winW, 70};
+    if (Application_beginPanel(app, PANEL_MENU, menuArea)) Application_renderMenu(app);
+    if (Application_beginPanel(app, PANEL_STAGE, app->sceneRect)) Application_renderStage(app);
+    if (Application_beginPanel(app, PANEL_PALETTE, app->paletteRect)) BlockPaletteUI_render(app->blockPalette);
+    // این پنل‌ها متغیرها، اسپرایت‌ها، صداها و زمینه‌های موتور را زنده می‌خوانند
+    if (app->dirtyPanels & PANEL_LIVE) {
+        SDL_LockMutex(app->simLock);
+        if (Application_beginPanel(app, PANEL_VARIABLES, app->varPanelRect)) Application_renderVariables(app);
+        if (Application_beginPanel(app, PANEL_SPRITES, app->spritePanelRect)) SpriteManagerUI_render(app->spriteManagerUI);
+        if (Application_beginPanel(app, PANEL_PEN, app->penPanelRect)) PenToolUI_render(app->penToolUI);
+        if (Application_beginPanel(app, PANEL_BACKDROPS, app->backdropPanelRect)) BackdropManagerUI_render(app->backdropManagerUI);
+        if (Application_beginPanel(app, PANEL_SOUNDS, app->soundPanelRect)) SoundManagerUI_render(app->soundManagerUI);
+        if (Application_beginPanel(app, PANEL_CODE, app->codeRect)) CodeAreaUI_render(app->codeArea);
+        SDL_UnlockMutex(app->simLock);
+    }
+    SDL_RenderSetClipRect(app->renderer, NULL);
+    SDL_SetRenderTarget(app->renderer, NULL);
+    app->dirtyPanels = staleStage;
+
+    SDL_RenderCopy(app->renderer, app->uiLayer, NULL, NULL);
+    BlockPaletteUI_renderDragPreview(app->blockPalette);
+
+    int stageRight = app->sceneRect.x + app->sceneRect.w;
+    int bottomY = app->spritePanelRect.y;
+    SDL_SetRenderDrawColor(app->renderer, 0, 0, 0, 255);
+    SDL_RenderDrawLine(app->renderer, app->codeRect.x, app->paletteRect.y, app->codeRect.x, bottomY);
+    SDL_RenderDrawLine(app->renderer, app->sceneRect.x, app->paletteRect.y, app->sceneRect.x, bottomY);
+    SDL_RenderDrawLine(app->renderer, 0, bottomY, winW, bottomY);
+    SDL_RenderDrawLine(app->renderer, app->sceneRect.x, app->backdropPanelRect.y, stageRight, app->backdropPanelRect.y);
+    SDL_RenderDrawLine(app->renderer, app->sceneRect.x, app->soundPanelRect.y, stageRight, app->soundPanelRect.y);
+    SDL_RenderDrawLine(app->renderer, app->penPanelRect.x, bottomY, app->penPanelRect.x, winH);
+
+    SDL_RenderPresent(app->renderer);
+}
+
+// عکسی که پیش از آخرین ویرایش گرفته شده ممکن است به اسپرایت یا لباس حذف‌شده اشاره کند
+bool Application_snapshotCurrent(Application* app) {
+    return app->snapshot->editSerial == app->editSerial && app->snapshot->project == app->currentProject;
+}
+
+void Application_updateRenderAlpha(Application* app) {
+    const StageSnapshot* snap = app->snapshot;
+    app->renderAlpha = 1.0f;
+    if (!snap->running) return;
+    double tickLength = 1.0 / snap->tickRate;
+    double since = (double)(SDL_GetPerformanceCounter() - snap->publishedAt) / SDL_GetPerformanceFrequency();
+    double alpha = (snap->accumulator + since) / tickLength;
+    if (alpha < 1.0) app->renderAlpha = (float)alpha;
+}
+
+// حالت نمایش: بدون چیدمان، لایه‌ی رابط و متن‌های ویرایشگر؛ صحنه مستقیم در کل پنجره کشیده می‌شود
+void Application_renderPresentation(Application* app, int winW, int winH) {
+    app->sceneRect = {0, 0, winW, winH};
+    Application_updateRenderAlpha(app);
+
+    SDL_LockMutex(app->simLock);
+    ExecutionEngine_applyMainOps(app->engine);
+    Project_flushPen(app->currentProject, app->renderer);
+    Project_readBackPen(app->currentProject, app->renderer);
+    SDL_UnlockMutex(app->simLock);
+    SDL_SetRenderTarget(app->renderer, NULL);
+    SDL_RenderSetClipRect(app->renderer, NULL);
+    SDL_SetRenderDrawColor(app->renderer, 0, 0, 0, 255);
+    SDL_RenderClear(app->renderer);
+    if (Application_snapshotCurrent(app)) {
+        Application_renderStage(app);
+    } else if (app->stageTarget) {
+        SDL_Rect view = stageViewRect(app->sceneRect);
+        SDL_RenderCopy(app->renderer, app->stageTarget, NULL, &view);
+    }
+
+    if (app->showFps) Application_renderFps(app);
+    SDL_RenderPresent(app->renderer);
+}
+
+void Application_renderFps(Application* app) {
+    Uint32 now = SDL_GetTicks();
+    app->fpsFrames++;
+    if (now - app->fpsStart >= 1000) {
+        app->fps = (int)(app->fpsFrames * 1000 / (now - app->fpsStart));
+        app->fpsFrames = 0;
+        app->fpsStart = now;
+    }
+    TTF_Font* font = app->spriteManagerUI->font;
+    if (!font) return;
+    char text[32];
+    snprintf(text, sizeof(text), "%d FPS", app->fps);
+    GlyphAtlas* atlas = GlyphAtlas_forFont(app->renderer, font);
+    SDL_Rect box = {8, 8, GlyphAtlas_measure(atlas, text) + 12, TTF_FontHeight(font) + 6};
+    SDL_SetRenderDrawBlendMode(app->renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(app->renderer, 0, 0, 0, 160);
+    SDL_RenderFillRect(app->renderer, &box);
+    SDL_SetRenderDrawBlendMode(app->renderer, SDL_BLENDMODE_NONE);
+    GlyphAtlas_addText(atlas, text, box.x + 6, box.y + 3, {255,255,255,255});
+    GlyphAtlas_flush(atlas);
+}
+
+// تنها جای محاسبه‌ی مستطیل صحنه؛ موتور، رویدادها و رسم همه از این استفاده می‌کنند
+SDL_Rect stageRectForSize(int winW, int winH) {
+    int startY = 100;
+    int paletteWidth = 200;
+    int codeWidth = 400;
+    int sceneWidth = winW - paletteWidth - codeWidth;
+    int bottomHeight = 128;
+    int rightPanelHeight = winH - startY - bottomHeight;
+    int backdropPanelHeight = 150;
+    int soundPanelHeight = 150;
+    int sceneHeight = rightPanelHeight - backdropPanelHeight - soundPanelHeight;
+    if (sceneHeight < 200) sceneHeight = 200;
+    return {paletteWidth + codeWidth, startY, sceneWidth, sceneHeight};
+}
+
+SDL_Rect stageRectForWindow(SDL_Window* window) {
+    int winW, winH;
+    SDL_GetWindowSize(window, &winW, &winH);
+    if (gApp && SDL_AtomicGet(&gApp->presenting)) return {0, 0, winW, winH};
+    return stageRectForSize(winW, winH);
+}
+
+// صحنه‌ی ۴۸۰×۳۶۰ با حفظ نسبت وسط مستطیل صحنه بزرگ یا کوچک می‌شود
+SDL_Rect stageViewRect(SDL_Rect sceneRect) {
+    int w = sceneRect.w, h = sceneRect.w * STAGE_HEIGHT / STAGE_WIDTH;
+    if (h > sceneRect.h) {
+        h = sceneRect.h;
+        w = sceneRect.h * STAGE_WIDTH / STAGE_HEIGHT;
+    }
+    if (w < 1) w = 1;
+    if (h < 1) h = 1;
+    return {sceneRect.x + (sceneRect.w - w)/2, sceneRect.y + (sceneRect.h - h)/2, w, h};
+}
+
+// پیکسل پنجره به مختصات صحنه (x ±240، y ±180)
+void screenToStage(SDL_Rect sceneRect, int x, int y, float* outX, float* outY) {
+    SDL_Rect view = stageViewRect(sceneRect);
+    *outX = (x - view.x) * (float)STAGE_WIDTH / view.w - STAGE_WIDTH/2;
+    *outY = STAGE_HEIGHT/2 - (y - view.y) * (float)STAGE_HEIGHT / view.h;
+}
+
+void Application_layout(Application* app, int winW, int winH) {
+    int startY = 100;
+    int paletteWidth = 200;
+    int codeWidth = 400;
+    int sceneWidth = winW - paletteWidth - codeWidth;
+    int bottomHeight = 128;
+    int backdropPanelHeight = 150;
+    int soundPanelHeight = 150;
+    SDL_Rect stage = stageRectForSize(winW, winH);
+    int sceneHeight = stage.h;
+
+    app->paletteRect = {0, startY, paletteWidth, sceneHeight};
+    app->codeRect = {paletteWidth, startY, codeWidth, sceneHeight};
+    app->sceneRect = stage;
+    app->backdropPanelRect = {paletteWidth + codeWidth, startY + sceneHeight, sceneWidth, backdropPanelHeight};
+    app->soundPanelRect = {paletteWidth + codeWidth, startY + sceneHeight + backdropPanelHeight, sceneWidth, soundPanelHeight};
+
+    int penPanelWidth = 200;
+    app->spritePanelRect = {0, winH - bottomHeight, winW - penPanelWidth, bottomHeight};
+    app->penPanelRect = {winW - penPanelWidth, winH - bottomHeight, penPanelWidth, bottomHeight};
+
+    app->menuRect = {0, 0, winW, 40};
+    app->varPanelRect = {0, 70, winW, 30};
+
+    app->blockPalette->rect = app->paletteRect;
+    app->codeArea->rect = app->codeRect;
+    app->spriteManagerUI->rect = app->spritePanelRect;
+    app->penToolUI->rect = app->penPanelRect;
+    app->backdropManagerUI->rect = app->backdropPanelRect;
+    app->soundManagerUI->rect = app->soundPanelRect;
+}
+
+// پنل کثیف را پاک می‌کند و برش را روی آن تنظیم می‌کند
+bool Application_beginPanel(Application* app, Uint32 panel, SDL_Rect rect) {
+    if (!(app->dirtyPanels & panel)) return false;
+    SDL_RenderSetClipRect(app->renderer, &rect);
+    SDL_SetRenderDrawColor(app->renderer, 255, 255, 255, 255);
+    SDL_RenderFillRect(app->renderer, &rect);
+    return true;
+}
+
+void Application_markDirty(Application* app, Uint32 panels) {
+    app->dirtyPanels |= panels;
+}
+
+void Application_markDirtyAt(Application* app, int x, int y) {
+    SDL_Point p = {x, y};
+    SDL_Rect menuArea = {0, 0, app->menuRect.w, 70};
+    if (SDL_PointInRect(&p, &menuArea)) app->dirtyPanels |= PANEL_MENU;
+    if (SDL_PointInRect(&p, &app->varPanelRect)) app->dirtyPanels |= PANEL_VARIABLES;
+    if (SDL_PointInRect(&p, &app->paletteRect)) app->dirtyPanels |= PANEL_PALETTE;
+    if (SDL_PointInRect(&p, &app->codeRect)) app->dirtyPanels |= PANEL_CODE;
+    if (SDL_PointInRect(&p, &app->sceneRect)) app->dirtyPanels |= PANEL_STAGE;
+    if (SDL_PointInRect(&p, &app->spritePanelRect)) app->dirtyPanels |= PANEL_SPRITES;
+    if (SDL_PointInRect(&p, &app->backdropPanelRect)) app->dirtyPanels |= PANEL_BACKDROPS;
+    if (SDL_PointInRect(&p, &app->soundPanelRect)) app->dirtyPanels |= PANEL_SOUNDS;
+    if (SDL_PointInRect(&p, &app->penPanelRect)) app->dirtyPanels |= PANEL_PEN;
+}
+
+void Application_markDirtyForEvent(Application* app, SDL_Event* e) {
+    switch (e->type) {
+        case SDL_MOUSEMOTION:
+            Application_markDirtyAt(app, e->motion.x, e->motion.y);
+            Application_markDirtyAt(app, e->motion.x - e->motion.xrel, e->motion.y - e->motion.yrel);
+            if (app->dragSpriteIndex >= 0) Application_markDirty(app, PANEL_STAGE | PANEL_SPRITES);
+            if (app->penToolUI->draggingHue || app->penToolUI->draggingSat ||
+                app->penToolUI->draggingBright || app->penToolUI->draggingSize) {
+                Application_markDirty(app, PANEL_PEN);
             }
-            ExecutionEngine_startKeyScripts(app->engine, e.key.keysym.sym);
+            break;
+        case SDL_MOUSEWHEEL: {
+            int mouseX, mouseY;
+            SDL_GetMouseState(&mouseX, &mouseY);
+            Application_markDirtyAt(app, mouseX, mouseY);
+            break;
         }
+        default:
+            Application_markDirty(app, PANEL_ALL);
+            break;
     }
 }
 
-void Application_update(Application* app) {
-    if (app->executing && !app->paused) {
-        ExecutionEngine_step(app->engine, SDL_GetTicks());
+// تغییرهایی که با گذشت زمان پیش می‌آیند و رویدادی ندارند
+void Application_checkTimers(Application* app) {
+    Uint32 now = SDL_GetTicks();
+    SDL_LockMutex(gErrorLock);
+    bool errorVisible = app->lastError[0] != '\0' && now - app->errorTime < 5000;
+    SDL_UnlockMutex(gErrorLock);
+    if (errorVisible != app->errorVisible) {
+        app->errorVisible = errorVisible;
+        Application_markDirty(app, PANEL_MENU);
+    }
+    int bubbles = 0;
+    for (const SpriteSnapshot& s : app->snapshot->sprites) {
+        if (s.prevX != s.x || s.prevY != s.y) Application_markDirty(app, PANEL_STAGE);
+        if (!s.bubbleText.empty() && (s.bubbleUntil == 0 || now < s.bubbleUntil)) bubbles++;
+    }
+    if (bubbles != app->visibleBubbles) {
+        app->visibleBubbles = bubbles;
+        Application_markDirty(app, PANEL_STAGE);
     }
 }
 
-void Application_render(Application* app) {
-    SDL_SetRenderDrawColor(app->renderer, 255, 255, 255, 255);
-    SDL_RenderClear(app->renderer);
-
-    int winW, winH;
-    SDL_GetWindowSize(app->window, &winW, &winH);
-
-    app->menuRect = {0, 0, winW, 40};
+void Application_renderMenu(Application* app) {
+    int winW = app->menuRect.w;
     SDL_SetRenderDrawColor(app->renderer, 100, 100, 100, 255);
     SDL_RenderFillRect(app->renderer, &app->menuRect);
     SDL_SetRenderDrawColor(app->renderer, 0, 0, 0, 255);
@@ -1460,19 +4183,22 @@ void Application_render(Application* app) {
         SDL_RenderDrawRect(app->renderer, &btnRect);
 
         if (app->spriteManagerUI->font) {
-            SDL_Surface* surf = TTF_RenderText_Blended(app->spriteManagerUI->font, buttons[i], {0,0,0,255});
-            if (surf) {
-                SDL_Texture* tex = SDL_CreateTextureFromSurface(app->renderer, surf);
-                SDL_Rect textRect = {x + (70 - surf->w)/2, 5 + (30 - surf->h)/2, surf->w, surf->h};
-                SDL_RenderCopy(app->renderer, tex, NULL, &textRect);
-                SDL_DestroyTexture(tex);
-                SDL_FreeSurface(surf);
+            CachedText* label = TextCache_get(gTextCache, app->spriteManagerUI->font, buttons[i], {0,0,0,255});
+            if (label) {
+                SDL_Rect textRect = {x + (70 - label->w)/2, 5 + (30 - label->h)/2, label->w, label->h};
+                SDL_RenderCopy(app->renderer, label->texture, NULL, &textRect);
             }
         }
         x += 80;
     }
 
-    if (app->lastError[0] != '\0' && SDL_GetTicks() - app->errorTime < 5000) {
+    // متن خطا را ریسمان شبیه‌سازی هم می‌نویسد
+    char error[sizeof(app->lastError)];
+    SDL_LockMutex(gErrorLock);
+    memcpy(error, app->lastError, sizeof(error));
+    Uint32 errorTime = app->errorTime;
+    SDL_UnlockMutex(gErrorLock);
+    if (error[0] != '\0' && SDL_GetTicks() - errorTime < 5000) {
         SDL_Rect errorBar = {0, 40, winW, 30};
         SDL_SetRenderDrawColor(app->renderer, 255, 100, 100, 255);
         SDL_RenderFillRect(app->renderer, &errorBar);
@@ -1480,27 +4206,23 @@ void Application_render(Application* app) {
         SDL_RenderDrawRect(app->renderer, &errorBar);
 
         if (app->spriteManagerUI->font) {
-            SDL_Surface* surf = TTF_RenderText_Blended(app->spriteManagerUI->font, app->lastError, {255,255,255,255});
-            if (surf) {
-                SDL_Texture* tex = SDL_CreateTextureFromSurface(app->renderer, surf);
-                SDL_Rect textRect = {10, 40 + (30 - surf->h)/2, surf->w, surf->h};
-                SDL_RenderCopy(app->renderer, tex, NULL, &textRect);
-                SDL_DestroyTexture(tex);
-                SDL_FreeSurface(surf);
-            }
+            TTF_Font* font = app->spriteManagerUI->font;
+            drawGlyphText(app->renderer, font, error, 10, 40 + (30 - TTF_FontHeight(font))/2, {255,255,255,255});
         }
     }
+}
 
-    app->varPanelRect = {0, 70, winW, 30};
+void Application_renderVariables(Application* app) {
+    Project* proj = app->currentProject;
     SDL_SetRenderDrawColor(app->renderer, 200, 200, 200, 255);
     SDL_RenderFillRect(app->renderer, &app->varPanelRect);
     SDL_SetRenderDrawColor(app->renderer, 0, 0, 0, 255);
     SDL_RenderDrawRect(app->renderer, &app->varPanelRect);
 
-    Project* proj = app->currentProject;
     if (app->spriteManagerUI->font) {
         int textX = 10;
         int textY = app->varPanelRect.y + (app->varPanelRect.h - 16) / 2;
+        GlyphAtlas* atlas = GlyphAtlas_forFont(app->renderer, app->spriteManagerUI->font);
         for (size_t i = 0; i < proj->globalVariables.size(); i++) {
             Variable* var = proj->globalVariables[i];
             string buffer;
@@ -1509,961 +4231,1434 @@ void Application_render(Application* app) {
             } else {
                 buffer = var->name + " = " + var->value.str;
             }
-            SDL_Surface* surf = TTF_RenderText_Blended(app->spriteManagerUI->font, buffer.c_str(), {0,0,0,255});
-            if (surf) {
-                SDL_Texture* tex = SDL_CreateTextureFromSurface(app->renderer, surf);
-                SDL_Rect textRect = {textX, textY, surf->w, surf->h};
-                SDL_RenderCopy(app->renderer, tex, NULL, &textRect);
-                SDL_DestroyTexture(tex);
-                SDL_FreeSurface(surf);
-                textX += surf->w + 20;
-            }
+            textX += GlyphAtlas_addText(atlas, buffer.c_str(), textX, textY, {0,0,0,255}) + 20;
         }
+        GlyphAtlas_flush(atlas);
     }
+}
 
-    int startY = 100;
-    int paletteWidth = 200;
-    int codeWidth = 400;
-    int sceneWidth = winW - paletteWidth - codeWidth;
-    int bottomHeight = 128;
-    int rightPanelHeight = winH - startY - bottomHeight;
-    int backdropPanelHeight = 150;
-    int soundPanelHeight = 150;
-    int sceneHeight = rightPanelHeight - backdropPanelHeight - soundPanelHeight;
-    if (sceneHeight < 200) sceneHeight = 200;
-
-    app->paletteRect = {0, startY, paletteWidth, sceneHeight};
-    app->codeRect = {paletteWidth, startY, codeWidth, sceneHeight};
-    app->sceneRect = {paletteWidth + codeWidth, startY, sceneWidth, sceneHeight};
-    app->backdropPanelRect = {paletteWidth + codeWidth, startY + sceneHeight, sceneWidth, backdropPanelHeight};
-    app->soundPanelRect = {paletteWidth + codeWidth, startY + sceneHeight + backdropPanelHeight, sceneWidth, soundPanelHeight};
-
-    int penPanelWidth = 200;
-    app->spritePanelRect = {0, winH - bottomHeight, winW - penPanelWidth, bottomHeight};
-    app->penPanelRect = {winW - penPanelWidth, winH - bottomHeight, penPanelWidth, bottomHeight};
-
-    app->blockPalette->rect = app->paletteRect;
-    app->codeArea->rect = app->codeRect;
-    app->spriteManagerUI->rect = app->spritePanelRect;
-    app->penToolUI->rect = app->penPanelRect;
-    app->backdropManagerUI->rect = app->backdropPanelRect;
-    app->soundManagerUI->rect = app->soundPanelRect;
-
-    if (proj->currentBackdrop >= 0 && proj->currentBackdrop < (int)proj->backdrops.size()) {
-        Backdrop* b = proj->backdrops[proj->currentBackdrop];
+// صحنه در بافتی با اندازه‌ی ثابت (۴۸۰×۳۶۰ ضربدر کیفیت) چیده و یک بار در پنجره کشیده می‌شود
+void Application_renderStage(Application* app) {
+    const StageSnapshot* snap = app->snapshot;
+    Project* proj = snap->project;
+    int q = app->stageQuality;
+    if (app->stageTarget && app->stageTargetQuality != q) {
+        SDL_DestroyTexture(app->stageTarget);
+        app->stageTarget = NULL;
+    }
+    if (!app->stageTarget) {
+        app->stageTarget = SDL_CreateTexture(app->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+                                             STAGE_WIDTH * q, STAGE_HEIGHT * q);
+        if (!app->stageTarget) return;
+        SDL_SetTextureScaleMode(app->stageTarget, SDL_ScaleModeLinear);
+        app->stageTargetQuality = q;
+    }
+    SDL_Texture* prevTarget = SDL_GetRenderTarget(app->renderer);
+    SDL_Rect prevClip;
+    SDL_RenderGetClipRect(app->renderer, &prevClip);
+    bool clipped = SDL_RenderIsClipEnabled(app->renderer);
+    SDL_SetRenderTarget(app->renderer, app->stageTarget);
+    SDL_Rect stage = {0, 0, STAGE_WIDTH * q, STAGE_HEIGHT * q};
+
+    if (snap->backdrop) {
+        Backdrop* b = snap->backdrop;
         if (b->texture) {
-            SDL_RenderCopy(app->renderer, b->texture, NULL, &app->sceneRect);
+            const MipLevel* level = MipChain_level(b->mips, app->renderer, stage.w, stage.h);
+            if (level) SDL_RenderCopy(app->renderer, level->page, &level->rect, NULL);
+            else SDL_RenderCopy(app->renderer, b->texture, NULL, NULL);
         } else {
             SDL_SetRenderDrawColor(app->renderer, 200, 200, 255, 255);
-            SDL_RenderFillRect(app->renderer, &app->sceneRect);
+            SDL_RenderClear(app->renderer);
         }
     } else {
         SDL_SetRenderDrawColor(app->renderer, 200, 200, 200, 255);
-        SDL_RenderFillRect(app->renderer, &app->sceneRect);
+        SDL_RenderClear(app->renderer);
     }
 
-    for (size_t i = 0; i < proj->sprites.size(); i++) {
-        Sprite* s = proj->sprites[i];
-        if (s->penCanvas) {
-            SDL_RenderCopy(app->renderer, s->penCanvas, NULL, &app->sceneRect);
-        }
+    if (proj->penLayer) {
+        SDL_RenderCopy(app->renderer, proj->penLayer, NULL, NULL);
     }
 
-    vector<Sprite*> sortedSprites = proj->sprites;
-    sort(sortedSprites.begin(), sortedSprites.end(), [](Sprite* a, Sprite* b) { return a->layer < b->layer; });
-
     Uint32 now = SDL_GetTicks();
 
-    for (Sprite* s : sortedSprites) {
-        if (!s->visible) continue;
-
-        int screenX = app->sceneRect.x + app->sceneRect.w / 2 + (int)s->x;
-        int screenY = app->sceneRect.y + app->sceneRect.h / 2 - (int)s->y;
-        int spriteW = (int)(50 * s->size / 100.0f);
-        int spriteH = (int)(50 * s->size / 100.0f);
+    // اسپرایت‌های پشت سر هم روی یک صفحه‌ی اطلس با یک فراخوانی رسم می‌شوند
+    ShapeBatch batch;
+    for (const SpriteSnapshot& ss : snap->sprites) {
+        float drawX = ss.prevX + (ss.x - ss.prevX) * app->renderAlpha;
+        float drawY = ss.prevY + (ss.y - ss.prevY) * app->renderAlpha;
+        int screenX = (int)((STAGE_WIDTH/2 + drawX) * q);
+        int screenY = (int)((STAGE_HEIGHT/2 - drawY) * q);
+        int spriteW = (int)(50 * ss.size / 100.0f) * q;
+        int spriteH = (int)(50 * ss.size / 100.0f) * q;
         if (spriteW <= 0 || spriteH <= 0) continue;
 
         SDL_Rect destRect = {screenX - spriteW/2, screenY - spriteH/2, spriteW, spriteH};
-
-        SDL_Texture* texture = NULL;
-        if (!s->costumes.empty() && s->currentCostume < (int)s->costumes.size()) {
-            texture = s->costumes[s->currentCostume]->texture;
-        }
-
-        if (texture) {
-            Uint8 origR, origG, origB, origA;
-            SDL_GetTextureColorMod(texture, &origR, &origG, &origB);
-            SDL_GetTextureAlphaMod(texture, &origA);
-
-            Uint8 r = origR, g = origG, b = origB;
-
-            if (s->colorEffect != 0) {
-                float factor = s->colorEffect / 200.0f;
-                r = (Uint8)(origR * (1.0f - factor) + 255 * factor);
-                g = (Uint8)(origG * (1.0f - factor));
-                b = (Uint8)(origB * (1.0f - factor) + 255 * factor);
+        // بیرون از صحنه: قبل از هر کار روی بافت رد می‌شود
+        if (!SDL_HasIntersection(&destRect, &stage)) continue;
+
+        Costume* costume = ss.shown;
+        Uint8 alpha = (Uint8)(255 * (1.0f - ss.ghostEffect / 100.0f));
+        if (costume && costume->texture) {
+            // رنگ/روشنایی/اشباع در نسخه‌ی کش‌شده‌ی لباس، شبح با آلفای رأس‌ها
+            SDL_Color tint = {255, 255, 255, alpha};
+            SDL_Texture* variant = EffectCache_get(gEffectCache, costume, ss.colorEffect, ss.brightnessEffect, ss.saturationEffect);
+            const MipLevel* level = variant ? NULL : MipChain_level(costume->mips, app->renderer, spriteW, spriteH);
+            if (variant) {
+                if (batch.texture != variant) {
+                    ShapeBatch_flush(app->renderer, &batch);
+                    batch.texture = variant;
+                }
+                SDL_Rect src = {0, 0, costume->surface->w, costume->surface->h};
+                ShapeBatch_addQuad(&batch, destRect, src, src.w, src.h, tint);
+            } else if (level) {
+                if (batch.texture != level->page) {
+                    ShapeBatch_flush(app->renderer, &batch);
+                    batch.texture = level->page;
+                }
+                ShapeBatch_addQuad(&batch, destRect, level->rect, level->texW, level->texH, tint);
+            } else if (costume->atlasPage) {
+                if (batch.texture != costume->atlasPage) {
+                    ShapeBatch_flush(app->renderer, &batch);
+                    batch.texture = costume->atlasPage;
+                }
+                ShapeBatch_addQuad(&batch, destRect, costume->atlasRect, COSTUME_ATLAS_SIZE, COSTUME_ATLAS_SIZE, tint);
+            } else {
+                ShapeBatch_flush(app->renderer, &batch);
+                SDL_SetTextureAlphaMod(costume->texture, alpha);
+                SDL_RenderCopy(app->renderer, costume->texture, NULL, &destRect);
+                SDL_SetTextureAlphaMod(costume->texture, 255);
             }
-
-            float brightFactor = s->brightnessEffect / 100.0f;
-            r = (Uint8)(r * brightFactor);
-            g = (Uint8)(g * brightFactor);
-            b = (Uint8)(b * brightFactor);
-
-            float satFactor = s->saturationEffect / 100.0f;
-            Uint8 gray = (Uint8)(0.3f * r + 0.59f * g + 0.11f * b);
-            r = (Uint8)(r * satFactor + gray * (1.0f - satFactor));
-            g = (Uint8)(g * satFactor + gray * (1.0f - satFactor));
-            b = (Uint8)(b * satFactor + gray * (1.0f - satFactor));
-
-            SDL_SetTextureColorMod(texture, r, g, b);
-            SDL_RenderCopy(app->renderer, texture, NULL, &destRect);
-            SDL_SetTextureColorMod(texture, origR, origG, origB);
-            SDL_SetTextureAlphaMod(texture, origA);
         } else {
-            Uint8 r = (s->currentCostume * 50) % 256;
-            Uint8 g = (s->currentCostume * 80) % 256;
-            Uint8 b = (s->currentCostume * 110) % 256;
-            float brightFactor = s->brightnessEffect / 100.0f;
+            ShapeBatch_flush(app->renderer, &batch);
+            Uint8 r = (ss.costume * 50) % 256;
+            Uint8 g = (ss.costume * 80) % 256;
+            Uint8 b = (ss.costume * 110) % 256;
+            float brightFactor = ss.brightnessEffect / 100.0f;
             r = (Uint8)(r * brightFactor);
             g = (Uint8)(g * brightFactor);
             b = (Uint8)(b * brightFactor);
-            SDL_SetRenderDrawColor(app->renderer, r, g, b, 255);
+            SDL_SetRenderDrawBlendMode(app->renderer, SDL_BLENDMODE_BLEND);
+            SDL_SetRenderDrawColor(app->renderer, r, g, b, alpha);
             SDL_RenderFillRect(app->renderer, &destRect);
-            SDL_SetRenderDrawColor(app->renderer, 0, 0, 0, 255);
+            SDL_SetRenderDrawColor(app->renderer, 0, 0, 0, alpha);
             SDL_RenderDrawRect(app->renderer, &destRect);
+            SDL_SetRenderDrawBlendMode(app->renderer, SDL_BLENDMODE_NONE);
         }
+    }
+    ShapeBatch_flush(app->renderer, &batch);
+
+    // حباب‌ها روی همه‌ی اسپرایت‌ها
+    for (const SpriteSnapshot& ss : snap->sprites) {
+        Sprite* s = ss.sprite;
+        float drawX = ss.prevX + (ss.x - ss.prevX) * app->renderAlpha;
+        float drawY = ss.prevY + (ss.y - ss.prevY) * app->renderAlpha;
+        int screenX = (int)((STAGE_WIDTH/2 + drawX) * q);
+        int screenY = (int)((STAGE_HEIGHT/2 - drawY) * q);
+        int spriteH = (int)(50 * ss.size / 100.0f) * q;
+        if (spriteH <= 0) continue;
+
+        if (!app->speechFont) continue;
+        if (ss.bubbleText.empty() || (ss.bubbleUntil != 0 && now >= ss.bubbleUntil)) continue;
+        // حباب بالای اسپرایت است؛ اگر پایینش بالاتر از صحنه باشد ساختنش لازم نیست
+        int bubbleBottom = screenY - spriteH/2 - 5 * q;
+        if (bubbleBottom <= 0) continue;
+        SDL_Texture* bubble = Sprite_bubble(s, ss.bubbleText, ss.think, app->renderer, app->speechFont);
+        if (!bubble) continue;
+        SDL_Rect bubbleRect = {screenX - s->bubbleW * q / 2, bubbleBottom - s->bubbleH * q, s->bubbleW * q, s->bubbleH * q};
+        if (SDL_HasIntersection(&bubbleRect, &stage)) SDL_RenderCopy(app->renderer, bubble, NULL, &bubbleRect);
+    }
 
-        if (app->speechFont) {
-            if (!s->sayText.empty() && (s->sayUntil == 0 || now < s->sayUntil)) {
-                int textW, textH;
-                TTF_SizeText(app->speechFont, s->sayText.c_str(), &textW, &textH);
-                int bubbleW = textW + 20;
-                int bubbleH = textH + 10;
-                int bubbleX = screenX - bubbleW/2;
-                int bubbleY = screenY - spriteH/2 - bubbleH - 5;
-                SDL_Rect bubbleRect = {bubbleX, bubbleY, bubbleW, bubbleH};
-                SDL_SetRenderDrawColor(app->renderer, 255, 255, 255, 255);
-                SDL_RenderFillRect(app->renderer, &bubbleRect);
-                SDL_SetRenderDrawColor(app->renderer, 0, 0, 0, 255);
-                SDL_RenderDrawRect(app->renderer, &bubbleRect);
-                SDL_Surface* surf = TTF_RenderText_Blended(app->speechFont, s->sayText.c_str(), {0,0,0,255});
-                if (surf) {
-                    SDL_Texture* tex = SDL_CreateTextureFromSurface(app->renderer, surf);
-                    SDL_Rect textRect = {bubbleX + 10, bubbleY + 5, surf->w, surf->h};
-                    SDL_RenderCopy(app->renderer, tex, NULL, &textRect);
-                    SDL_DestroyTexture(tex);
-                    SDL_FreeSurface(surf);
-                }
-            }
-            if (!s->thinkText.empty() && (s->thinkUntil == 0 || now < s->thinkUntil)) {
-                int textW, textH;
-                TTF_SizeText(app->speechFont, s->thinkText.c_str(), &textW, &textH);
-                int bubbleW = textW + 20;
-                int bubbleH = textH + 10;
-                int bubbleX = screenX - bubbleW/2;
-                int bubbleY = screenY - spriteH/2 - bubbleH - 5;
-                SDL_Rect bubbleRect = {bubbleX, bubbleY, bubbleW, bubbleH};
-                SDL_SetRenderDrawColor(app->renderer, 220, 220, 220, 255);
-                SDL_RenderFillRect(app->renderer, &bubbleRect);
-                SDL_SetRenderDrawColor(app->renderer, 0, 0, 0, 255);
-                SDL_RenderDrawRect(app->renderer, &bubbleRect);
-                SDL_Surface* surf = TTF_RenderText_Blended(app->speechFont, s->thinkText.c_str(), {0,0,0,255});
-                if (surf) {
-                    SDL_Texture* tex = SDL_CreateTextureFromSurface(app->renderer, surf);
-                    SDL_Rect textRect = {bubbleX + 10, bubbleY + 5, surf->w, surf->h};
-                    SDL_RenderCopy(app->renderer, tex, NULL, &textRect);
-                    SDL_DestroyTexture(tex);
-                    SDL_FreeSurface(surf);
-                }
+    SDL_SetRenderTarget(app->renderer, prevTarget);
+    SDL_RenderSetClipRect(app->renderer, clipped ? &prevClip : NULL);
+    SDL_Rect view = stageViewRect(app->sceneRect);
+    SDL_RenderCopy(app->renderer, app->stageTarget, NULL, &view);
+}
+
+// متن حباب روی فاصله‌ها شکسته می‌شود؛ کلمه‌ی بلندتر از عرض بین کاراکترها
+void wrapText(GlyphAtlas* atlas, const string& text, int maxWidth, vector<string>& lines) {
+    lines.clear();
+    string line;
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t end = text.find(' ', pos);
+        if (end == string::npos) end = text.size();
+        string word = text.substr(pos, end - pos);
+        string candidate = line.empty() ? word : line + " " + word;
+        if (line.empty() || GlyphAtlas_measure(atlas, candidate.c_str()) <= maxWidth) {
+            line = candidate;
+        } else {
+            lines.push_back(line);
+            line = word;
+        }
+        while (GlyphAtlas_measure(atlas, line.c_str()) > maxWidth) {
+            size_t keep = 0;
+            while (keep < line.size()) {
+                size_t next = keep + 1;
+                while (next < line.size() && ((unsigned char)line[next] & 0xC0) == 0x80) next++;
+                if (keep > 0 && GlyphAtlas_measure(atlas, line.substr(0, next).c_str()) > maxWidth) break;
+                keep = next;
             }
+            if (keep >= line.size()) break;
+            lines.push_back(line.substr(0, keep));
+            line = line.substr(keep);
         }
+        pos = end + 1;
     }
+    if (!line.empty() || lines.empty()) lines.push_back(line);
+}
 
-    SpriteManagerUI_render(app->spriteManagerUI);
-    PenToolUI_render(app->penToolUI);
-    BackdropManagerUI_render(app->backdropManagerUI);
-    SoundManagerUI_render(app->soundManagerUI);
-    BlockPaletteUI_render(app->blockPalette);
-    CodeAreaUI_render(app->codeArea);
-
-    SDL_SetRenderDrawColor(app->renderer, 0, 0, 0, 255);
-    SDL_RenderDrawLine(app->renderer, paletteWidth, startY, paletteWidth, winH - bottomHeight);
-    SDL_RenderDrawLine(app->renderer, paletteWidth + codeWidth, startY, paletteWidth + codeWidth, winH - bottomHeight);
-    SDL_RenderDrawLine(app->renderer, 0, winH - bottomHeight, winW, winH - bottomHeight);
-    SDL_RenderDrawLine(app->renderer, paletteWidth + codeWidth, startY + sceneHeight, winW, startY + sceneHeight);
-    SDL_RenderDrawLine(app->renderer, paletteWidth + codeWidth, startY + sceneHeight + backdropPanelHeight, winW, startY + sceneHeight + backdropPanelHeight);
-    SDL_RenderDrawLine(app->renderer, winW - penPanelWidth, winH - bottomHeight, winW - penPanelWidth, winH);
+// حباب (زمینه، قاب و متن) یک بار در بافت رسم می‌شود و تا تغییر متن دوباره ساخته نمی‌شود
+SDL_Texture* Sprite_bubble(Sprite* sprite, const string& text, bool think, SDL_Renderer* renderer, TTF_Font* font) {
+    if (sprite->bubble && sprite->bubbleThink == think && sprite->bubbleText == text) return sprite->bubble;
+    if (sprite->bubble) {
+        SDL_DestroyTexture(sprite->bubble);
+        sprite->bubble = nullptr;
+    }
+    sprite->bubbleText = text;
+    sprite->bubbleThink = think;
+    if (text.empty() || !font) return nullptr;
+
+    GlyphAtlas* atlas = GlyphAtlas_forFont(renderer, font);
+    vector<string> lines;
+    wrapText(atlas, text, BUBBLE_MAX_TEXT_WIDTH, lines);
+    int textW = 0;
+    for (const string& line : lines) textW = max(textW, GlyphAtlas_measure(atlas, line.c_str()));
+    int lineH = TTF_FontHeight(font);
+    sprite->bubbleW = textW + 20;
+    sprite->bubbleH = (int)lines.size() * lineH + 10;
+    sprite->bubble = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, sprite->bubbleW, sprite->bubbleH);
+    if (!sprite->bubble) return nullptr;
+
+    GlyphAtlas_flush(atlas);
+    SDL_Texture* prevTarget = SDL_GetRenderTarget(renderer);
+    SDL_Rect prevClip;
+    SDL_RenderGetClipRect(renderer, &prevClip);
+    bool clipped = SDL_RenderIsClipEnabled(renderer);
+
+    SDL_SetRenderTarget(renderer, sprite->bubble);
+    Uint8 bg = think ? 220 : 255;
+    SDL_SetRenderDrawColor(renderer, bg, bg, bg, 255);
+    SDL_RenderClear(renderer);
+    SDL_Rect border = {0, 0, sprite->bubbleW, sprite->bubbleH};
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderDrawRect(renderer, &border);
+    for (size_t i = 0; i < lines.size(); i++) {
+        GlyphAtlas_addText(atlas, lines[i].c_str(), 10, 5 + (int)i * lineH, {0,0,0,255});
+    }
+    GlyphAtlas_flush(atlas);
 
-    SDL_RenderPresent(app->renderer);
+    SDL_SetRenderTarget(renderer, prevTarget);
+    SDL_RenderSetClipRect(renderer, clipped ? &prevClip : NULL);
+    return sprite->bubble;
 }
 // ExecutionEngine function
 void ExecutionEngine_step(ExecutionEngine* eng, Uint32 currentTime) {
     int stepsThisFrame = 0;
-    int winW, winH;
-    SDL_GetWindowSize(gWindow, &winW, &winH);
-    SDL_Renderer* renderer = SDL_GetRenderer(gWindow);
-    int paletteWidth = 200;
-    int codeWidth = 400;
-    int sceneWidth = winW - paletteWidth - codeWidth;
-    int bottomHeight = 128;
-    int rightPanelHeight = winH - 40 - bottomHeight;
-    int backdropPanelHeight = 150;
-    int soundPanelHeight = 150;
-    int sceneHeight = rightPanelHeight - backdropPanelHeight - soundPanelHeight;
-    if (sceneHeight < 200) sceneHeight = 200;
-    SDL_Rect stageRect = {paletteWidth + codeWidth, 40, sceneWidth, sceneHeight};
+    CollisionMask_collectRetired();
+    SDL_AtomicSet(&eng->project->stageColorsValid, 0);
+    SpriteGrid_sync(eng->project);
 
-    for (int i = 0; i < (int)eng->contexts.size(); i++) {
-        ExecutionContext* ctx = eng->contexts[i];
+    if (eng->parallel && !eng->stepMode) {
+        ExecutionEngine_stepParallel(eng, currentTime);
+        return;
+    }
 
-        if (ctx->waitingForAnswer) {
-            if (gApp && gApp->answerReady) {
-                eng->project->answer = gApp->pendingAnswer;
-                gApp->answerReady = false;
-                ctx->waitingForAnswer = false;
-                ctx->pc++;
-            }
+    for (int i = 0; i < (int)eng->contexts.size(); i++) {
+        int result = ExecutionEngine_stepContext(eng, eng->contexts[i], currentTime);
+        if (result == CONTEXT_FINISHED) {
+            ExecutionEngine_removeContext(eng, i);
+            i--;
             continue;
         }
+        if (result == CONTEXT_STOP_ALL) {
+            eng->contexts.clear();
+            return;
+        }
+        if (result != CONTEXT_STEPPED) continue;
+
+        stepsThisFrame++;
+        if (stepsThisFrame > MAX_STEPS_PER_FRAME) {
+            setError(gApp, "⚠️ حلقه بی‌نهایت تشخیص داده شد! اجرا متوقف شد.");
+            eng->contexts.clear();
+            return;
+        }
+    }
 
-        if (ctx->waitUntil > currentTime) continue;
+    if (eng->stepMode) {
+        eng->stepMode = false;
+        return;
+    }
+}
 
-        if (ctx->waitingForSoundChannel != -1) {
-            if (!Mix_Playing(ctx->waitingForSoundChannel)) {
-                ctx->pc++;
-                ctx->waitingForSoundChannel = -1;
-            }
-            continue;
+int ExecutionEngine_stepContext(ExecutionEngine* eng, ExecutionContext* ctx, Uint32 currentTime) {
+    if (ctx->waitingForAnswer) {
+        if (!ctx->group && gApp && gApp->answerReady) {
+            eng->project->answer = gApp->pendingAnswer;
+            gApp->answerReady = false;
+            ctx->waitingForAnswer = false;
+            ctx->pc++;
         }
+        return CONTEXT_IDLE;
+    }
 
-        if (ctx->pc < 0) continue;
-        Sprite* sprite = eng->project->sprites[ctx->spriteId];
-        if (ctx->scriptId >= (int)sprite->scripts.size()) {
-            ExecutionEngine_removeContext(eng, i);
-            i--;
-            continue;
+    if (ctx->waitUntil > currentTime) return CONTEXT_IDLE;
+
+    if (ctx->waitingForSoundChannel != -1) {
+        if (!Mix_Playing(ctx->waitingForSoundChannel)) {
+            ctx->pc++;
+            ctx->waitingForSoundChannel = -1;
         }
-        Script* script = sprite->scripts[ctx->scriptId];
-        if (ctx->pc >= (int)script->blocks.size()) {
-            ExecutionEngine_removeContext(eng, i);
-            i--;
-            continue;
+        return CONTEXT_IDLE;
+    }
+
+    if (ctx->pc < 0) return CONTEXT_IDLE;
+    Sprite* sprite = eng->project->sprites[ctx->spriteId];
+    if (ctx->scriptId >= (int)sprite->scripts.size()) return CONTEXT_FINISHED;
+    Script* script = sprite->scripts[ctx->scriptId];
+    if (ctx->pc >= (int)script->blocks.size()) return CONTEXT_FINISHED;
+    Block* block = script->blocks[ctx->pc];
+
+    switch (block->type) {
+        case BLOCK_MOVE: {
+            float steps = block->numParam1;
+            float rad = sprite->direction * (float)M_PI / 180.0f;
+            float newX = sprite->x + steps * cosf(rad);
+            float newY = sprite->y + steps * sinf(rad);
+            if (newX > 240) newX = 240;
+            if (newX < -240) newX = -240;
+            if (newY > 180) newY = 180;
+            if (newY < -180) newY = -180;
+
+            if (sprite->penDown) {
+                ExecutionEngine_penLine(eng, ctx, sprite, sprite->x, sprite->y, newX, newY);
+            }
+            sprite->x = newX;
+            sprite->y = newY;
+            Project_spriteMoved(eng->project, ctx, ctx->spriteId);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_TURN:
+            sprite->direction += block->numParam1;
+            ctx->pc++;
+            break;
+        case BLOCK_GOTO:
+            sprite->x = block->numParam1;
+            if (sprite->x > 240) sprite->x = 240;
+            if (sprite->x < -240) sprite->x = -240;
+            sprite->y = block->numParam2;
+            if (sprite->y > 180) sprite->y = 180;
+            if (sprite->y < -180) sprite->y = -180;
+            // پرش است، نه حرکت: درون‌یابی رسم نباید آن را در طول تیک بکشد
+            sprite->prevX = sprite->x;
+            sprite->prevY = sprite->y;
+            Project_spriteMoved(eng->project, ctx, ctx->spriteId);
+            ctx->pc++;
+            break;
+        case BLOCK_CHANGE_X: {
+            float oldX = sprite->x;
+            sprite->x += block->numParam1;
+            if (sprite->x > 240) sprite->x = 240;
+            if (sprite->x < -240) sprite->x = -240;
+            if (sprite->penDown) {
+                ExecutionEngine_penLine(eng, ctx, sprite, oldX, sprite->y, sprite->x, sprite->y);
+            }
+            Project_spriteMoved(eng->project, ctx, ctx->spriteId);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_CHANGE_Y: {
+            float oldY = sprite->y;
+            sprite->y += block->numParam1;
+            if (sprite->y > 180) sprite->y = 180;
+            if (sprite->y < -180) sprite->y = -180;
+            if (sprite->penDown) {
+                ExecutionEngine_penLine(eng, ctx, sprite, sprite->x, oldY, sprite->x, sprite->y);
+            }
+            Project_spriteMoved(eng->project, ctx, ctx->spriteId);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_SET_DIRECTION:
+            sprite->direction = block->numParam1;
+            ctx->pc++;
+            break;
+        case BLOCK_GO_TO_RANDOM: {
+            float newX = ExecutionContext_random(ctx) * 480 - 240;
+            float newY = ExecutionContext_random(ctx) * 360 - 180;
+            if (sprite->penDown) {
+                ExecutionEngine_penLine(eng, ctx, sprite, sprite->x, sprite->y, newX, newY);
+            }
+            sprite->x = newX;
+            sprite->y = newY;
+            sprite->prevX = newX;
+            sprite->prevY = newY;
+            Project_spriteMoved(eng->project, ctx, ctx->spriteId);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_GO_TO_MOUSE: {
+            float newX = eng->project->input.mouseX, newY = eng->project->input.mouseY;
+            if (newX < -240) newX = -240;
+            if (newX > 240) newX = 240;
+            if (newY < -180) newY = -180;
+            if (newY > 180) newY = 180;
+            if (sprite->penDown) {
+                ExecutionEngine_penLine(eng, ctx, sprite, sprite->x, sprite->y, newX, newY);
+            }
+            sprite->x = newX;
+            sprite->y = newY;
+            sprite->prevX = newX;
+            sprite->prevY = newY;
+            Project_spriteMoved(eng->project, ctx, ctx->spriteId);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_IF_ON_EDGE_BOUNCE: {
+            bool bounced = false;
+            if (sprite->x >= 240) {
+                sprite->x = 240;
+                sprite->direction = 180 - sprite->direction;
+                bounced = true;
+            } else if (sprite->x <= -240) {
+                sprite->x = -240;
+                sprite->direction = 180 - sprite->direction;
+                bounced = true;
+            }
+            if (sprite->y >= 180) {
+                sprite->y = 180;
+                sprite->direction = -sprite->direction;
+                bounced = true;
+            } else if (sprite->y <= -180) {
+                sprite->y = -180;
+                sprite->direction = -sprite->direction;
+                bounced = true;
+            }
+            while (sprite->direction < 0) sprite->direction += 360;
+            while (sprite->direction >= 360) sprite->direction -= 360;
+            if (bounced) Project_spriteMoved(eng->project, ctx, ctx->spriteId);
+            ctx->pc++;
+            break;
         }
-        Block* block = script->blocks[ctx->pc];
-
-        switch (block->type) {
-            case BLOCK_MOVE: {
-                float steps = block->numParam1;
-                float rad = sprite->direction * (float)M_PI / 180.0f;
-                float newX = sprite->x + steps * cosf(rad);
-                float newY = sprite->y + steps * sinf(rad);
-                if (newX > 240) newX = 240;
-                if (newX < -240) newX = -240;
-                if (newY > 180) newY = 180;
-                if (newY < -180) newY = -180;
-
-                if (sprite->penDown) {
-                    int x1 = stageRect.x + stageRect.w/2 + (int)sprite->x;
-                    int y1 = stageRect.y + stageRect.h/2 - (int)sprite->y;
-                    int x2 = stageRect.x + stageRect.w/2 + (int)newX;
-                    int y2 = stageRect.y + stageRect.h/2 - (int)newY;
-                    SDL_Color color = hslToRgb(sprite->penHue, sprite->penSaturation, sprite->penBrightness);
-                    drawLineOnCanvas(renderer, sprite->penCanvas, x1, y1, x2, y2, color, sprite->penSize);
+        case BLOCK_SAY: {
+            if (!block->strParam.empty()) {
+                sprite->sayText = block->strParam;
+                sprite->thinkText.clear();
+                if (block->numParam1 > 0) {
+                    sprite->sayUntil = currentTime + (Uint32)(block->numParam1 * 1000);
+                } else {
+                    sprite->sayUntil = 0;
                 }
-                sprite->x = newX;
-                sprite->y = newY;
-                ctx->pc++;
-                break;
+            } else {
+                sprite->sayText.clear();
             }
-            case BLOCK_TURN:
-                sprite->direction += block->numParam1;
-                ctx->pc++;
-                break;
-            case BLOCK_GOTO:
-                sprite->x = block->numParam1;
-                if (sprite->x > 240) sprite->x = 240;
-                if (sprite->x < -240) sprite->x = -240;
-                sprite->y = block->numParam2;
-                if (sprite->y > 180) sprite->y = 180;
-                if (sprite->y < -180) sprite->y = -180;
-                ctx->pc++;
-                break;
-            case BLOCK_CHANGE_X: {
-                float oldX = sprite->x;
-                sprite->x += block->numParam1;
-                if (sprite->x > 240) sprite->x = 240;
-                if (sprite->x < -240) sprite->x = -240;
-                if (sprite->penDown) {
-                    int x1 = stageRect.x + stageRect.w/2 + (int)oldX;
-                    int y1 = stageRect.y + stageRect.h/2 - (int)sprite->y;
-                    int x2 = stageRect.x + stageRect.w/2 + (int)sprite->x;
-                    int y2 = stageRect.y + stageRect.h/2 - (int)sprite->y;
-                    SDL_Color color = hslToRgb(sprite->penHue, sprite->penSaturation, sprite->penBrightness);
-                    drawLineOnCanvas(renderer, sprite->penCanvas, x1, y1, x2, y2, color, sprite->penSize);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_THINK: {
+            if (!block->strParam.empty()) {
+                sprite->thinkText = block->strParam;
+                sprite->sayText.clear();
+                if (block->numParam1 > 0) {
+                    sprite->thinkUntil = currentTime + (Uint32)(block->numParam1 * 1000);
+                } else {
+                    sprite->thinkUntil = 0;
                 }
-                ctx->pc++;
-                break;
+            } else {
+                sprite->thinkText.clear();
             }
-            case BLOCK_CHANGE_Y: {
-                float oldY = sprite->y;
-                sprite->y += block->numParam1;
-                if (sprite->y > 180) sprite->y = 180;
-                if (sprite->y < -180) sprite->y = -180;
-                if (sprite->penDown) {
-                    int x1 = stageRect.x + stageRect.w/2 + (int)sprite->x;
-                    int y1 = stageRect.y + stageRect.h/2 - (int)oldY;
-                    int x2 = stageRect.x + stageRect.w/2 + (int)sprite->x;
-                    int y2 = stageRect.y + stageRect.h/2 - (int)sprite->y;
-                    SDL_Color color = hslToRgb(sprite->penHue, sprite->penSaturation, sprite->penBrightness);
-                    drawLineOnCanvas(renderer, sprite->penCanvas, x1, y1, x2, y2, color, sprite->penSize);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_SWITCH_COSTUME:
+            if (!block->strParam.empty()) {
+                for (size_t j = 0; j < sprite->costumes.size(); j++) {
+                    if (sprite->costumes[j]->name == block->strParam) {
+                        sprite->currentCostume = j;
+                        break;
+                    }
                 }
-                ctx->pc++;
-                break;
+            } else {
+                sprite->currentCostume = (int)block->numParam1;
             }
-            case BLOCK_SET_DIRECTION:
-                sprite->direction = block->numParam1;
-                ctx->pc++;
-                break;
-            case BLOCK_GO_TO_RANDOM: {
-                float newX = (rand() / (float)RAND_MAX) * 480 - 240;
-                float newY = (rand() / (float)RAND_MAX) * 360 - 180;
-                if (sprite->penDown) {
-                    int x1 = stageRect.x + stageRect.w/2 + (int)sprite->x;
-                    int y1 = stageRect.y + stageRect.h/2 - (int)sprite->y;
-                    int x2 = stageRect.x + stageRect.w/2 + (int)newX;
-                    int y2 = stageRect.y + stageRect.h/2 - (int)newY;
-                    SDL_Color color = hslToRgb(sprite->penHue, sprite->penSaturation, sprite->penBrightness);
-                    drawLineOnCanvas(renderer, sprite->penCanvas, x1, y1, x2, y2, color, sprite->penSize);
+            ctx->pc++;
+            break;
+        case BLOCK_NEXT_COSTUME:
+            if (!sprite->costumes.empty()) {
+                sprite->currentCostume = (sprite->currentCostume + 1) % sprite->costumes.size();
+            }
+            ctx->pc++;
+            break;
+        case BLOCK_SWITCH_BACKDROP:
+            if (!block->strParam.empty()) {
+                for (size_t j = 0; j < eng->project->backdrops.size(); j++) {
+                    if (eng->project->backdrops[j]->name == block->strParam) {
+                        DeferredOp op;
+                        op.type = DEFER_SET_BACKDROP;
+                        op.num = (float)j;
+                        ExecutionEngine_submit(eng, ctx, op);
+                        break;
+                    }
                 }
-                sprite->x = newX;
-                sprite->y = newY;
-                ctx->pc++;
-                break;
             }
-            case BLOCK_GO_TO_MOUSE: {
-                int mouseX, mouseY;
-                SDL_GetMouseState(&mouseX, &mouseY);
-                float newX = mouseX - (stageRect.x + stageRect.w/2);
-                float newY = (stageRect.y + stageRect.h/2) - mouseY;
-                if (newX < -240) newX = -240;
-                if (newX > 240) newX = 240;
-                if (newY < -180) newY = -180;
-                if (newY > 180) newY = 180;
-                if (sprite->penDown) {
-                    int x1 = stageRect.x + stageRect.w/2 + (int)sprite->x;
-                    int y1 = stageRect.y + stageRect.h/2 - (int)sprite->y;
-                    int x2 = stageRect.x + stageRect.w/2 + (int)newX;
-                    int y2 = stageRect.y + stageRect.h/2 - (int)newY;
-                    SDL_Color color = hslToRgb(sprite->penHue, sprite->penSaturation, sprite->penBrightness);
-                    drawLineOnCanvas(renderer, sprite->penCanvas, x1, y1, x2, y2, color, sprite->penSize);
-                }
-                sprite->x = newX;
-                sprite->y = newY;
+            ctx->pc++;
+            break;
+        case BLOCK_NEXT_BACKDROP: {
+            DeferredOp op;
+            op.type = DEFER_NEXT_BACKDROP;
+            ExecutionEngine_submit(eng, ctx, op);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_CHANGE_SIZE:
+            sprite->size += block->numParam1;
+            Project_spriteMoved(eng->project, ctx, ctx->spriteId);
+            ctx->pc++;
+            break;
+        case BLOCK_SET_SIZE:
+            sprite->size = block->numParam1;
+            Project_spriteMoved(eng->project, ctx, ctx->spriteId);
+            ctx->pc++;
+            break;
+        case BLOCK_CHANGE_COLOR:
+            sprite->colorEffect += block->numParam1;
+            if (sprite->colorEffect < 0) sprite->colorEffect = 0;
+            if (sprite->colorEffect > 200) sprite->colorEffect = 200;
+            ctx->pc++;
+            break;
+        case BLOCK_SET_COLOR:
+            sprite->colorEffect = block->numParam1;
+            if (sprite->colorEffect < 0) sprite->colorEffect = 0;
+            if (sprite->colorEffect > 200) sprite->colorEffect = 200;
+            ctx->pc++;
+            break;
+        case BLOCK_CLEAR_EFFECTS:
+            sprite->colorEffect = 0;
+            sprite->brightnessEffect = 100;
+            sprite->saturationEffect = 100;
+            sprite->ghostEffect = 0;
+            ctx->pc++;
+            break;
+        case BLOCK_SHOW:
+            sprite->visible = 1;
+            ctx->pc++;
+            break;
+        case BLOCK_HIDE:
+            sprite->visible = 0;
+            ctx->pc++;
+            break;
+        case BLOCK_GO_TO_LAYER: {
+            DeferredOp op;
+            op.type = DEFER_GO_TO_LAYER;
+            op.sprite = sprite;
+            op.name = block->strParam;
+            ExecutionEngine_submit(eng, ctx, op);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_CHANGE_LAYER: {
+            DeferredOp op;
+            op.type = DEFER_CHANGE_LAYER;
+            op.sprite = sprite;
+            op.num = block->numParam1;
+            ExecutionEngine_submit(eng, ctx, op);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_CHANGE_BRIGHTNESS:
+            sprite->brightnessEffect += block->numParam1;
+            if (sprite->brightnessEffect < 0) sprite->brightnessEffect = 0;
+            if (sprite->brightnessEffect > 100) sprite->brightnessEffect = 100;
+            ctx->pc++;
+            break;
+        case BLOCK_SET_BRIGHTNESS:
+            sprite->brightnessEffect = block->numParam1;
+            if (sprite->brightnessEffect < 0) sprite->brightnessEffect = 0;
+            if (sprite->brightnessEffect > 100) sprite->brightnessEffect = 100;
+            ctx->pc++;
+            break;
+        case BLOCK_CHANGE_SATURATION:
+            sprite->saturationEffect += block->numParam1;
+            if (sprite->saturationEffect < 0) sprite->saturationEffect = 0;
+            if (sprite->saturationEffect > 100) sprite->saturationEffect = 100;
+            ctx->pc++;
+            break;
+        case BLOCK_SET_SATURATION:
+            sprite->saturationEffect = block->numParam1;
+            if (sprite->saturationEffect < 0) sprite->saturationEffect = 0;
+            if (sprite->saturationEffect > 100) sprite->saturationEffect = 100;
+            ctx->pc++;
+            break;
+        case BLOCK_CHANGE_GHOST:
+            sprite->ghostEffect += block->numParam1;
+            if (sprite->ghostEffect < 0) sprite->ghostEffect = 0;
+            if (sprite->ghostEffect > 100) sprite->ghostEffect = 100;
+            ctx->pc++;
+            break;
+        case BLOCK_SET_GHOST:
+            sprite->ghostEffect = block->numParam1;
+            if (sprite->ghostEffect < 0) sprite->ghostEffect = 0;
+            if (sprite->ghostEffect > 100) sprite->ghostEffect = 100;
+            ctx->pc++;
+            break;
+        case BLOCK_PLAY_SOUND: {
+            DeferredOp op;
+            op.type = DEFER_PLAY_SOUND;
+            op.name = block->strParam;
+            ExecutionEngine_submit(eng, ctx, op);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_PLAY_SOUND_UNTIL_DONE: {
+            // pc بعد از پخش در applyOp جلو می‌رود
+            DeferredOp op;
+            op.type = DEFER_PLAY_SOUND_UNTIL_DONE;
+            op.name = block->strParam;
+            ExecutionEngine_submit(eng, ctx, op);
+            break;
+        }
+        case BLOCK_STOP_ALL_SOUNDS: {
+            DeferredOp op;
+            op.type = DEFER_STOP_ALL_SOUNDS;
+            ExecutionEngine_submit(eng, ctx, op);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_CHANGE_VOLUME: {
+            DeferredOp op;
+            op.type = DEFER_CHANGE_VOLUME;
+            op.name = block->strParam;
+            op.num = block->numParam1;
+            ExecutionEngine_submit(eng, ctx, op);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_SET_VOLUME: {
+            DeferredOp op;
+            op.type = DEFER_SET_VOLUME;
+            op.name = block->strParam;
+            op.num = block->numParam1;
+            ExecutionEngine_submit(eng, ctx, op);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_WAIT:
+            ctx->waitUntil = currentTime + (Uint32)(block->numParam1 * 1000);
+            break;
+        case BLOCK_REPEAT: {
+            LoopInfo loop;
+            loop.start = ctx->pc + 1;
+            loop.end = block->bodyEnd;
+            loop.count = (int)block->numParam1;
+            ctx->loopStack.push_back(loop);
+            ctx->pc = loop.start;
+            break;
+        }
+        case BLOCK_FOREVER: {
+            LoopInfo loop;
+            loop.start = ctx->pc + 1;
+            loop.end = block->bodyEnd;
+            loop.count = -1;
+            ctx->loopStack.push_back(loop);
+            ctx->pc = loop.start;
+            break;
+        }
+        case BLOCK_IF: {
+            float cond = 0;
+            if (!block->children.empty()) {
+                Value condVal = evaluateBlock(block->children[0], ctx, eng->project);
+                cond = value_to_number(condVal);
+            } else {
+                cond = block->numParam1; // برای سازگاری با عقب
+            }
+            if (cond != 0) {
                 ctx->pc++;
-                break;
+            } else {
+                ctx->pc = block->bodyEnd;
             }
-            case BLOCK_IF_ON_EDGE_BOUNCE: {
-                bool bounced = false;
-                if (sprite->x >= 240) {
-                    sprite->x = 240;
-                    sprite->direction = 180 - sprite->direction;
-                    bounced = true;
-                } else if (sprite->x <= -240) {
-                    sprite->x = -240;
-                    sprite->direction = 180 - sprite->direction;
-                    bounced = true;
-                }
-                if (sprite->y >= 180) {
-                    sprite->y = 180;
-                    sprite->direction = -sprite->direction;
-                    bounced = true;
-                } else if (sprite->y <= -180) {
-                    sprite->y = -180;
-                    sprite->direction = -sprite->direction;
-                    bounced = true;
-                }
-                while (sprite->direction < 0) sprite->direction += 360;
-                while (sprite->direction >= 360) sprite->direction -= 360;
-                ctx->pc++;
-                break;
+            break;
+        }
+        case BLOCK_IF_ELSE: {
+            float cond = 0;
+            if (!block->children.empty()) {
+                Value condVal = evaluateBlock(block->children[0], ctx, eng->project);
+                cond = value_to_number(condVal);
+            } else {
+                cond = block->numParam1;
             }
-            case BLOCK_SAY: {
-                if (!block->strParam.empty()) {
-                    sprite->sayText = block->strParam;
-                    sprite->thinkText.clear();
-                    if (block->numParam1 > 0) {
-                        sprite->sayUntil = currentTime + (Uint32)(block->numParam1 * 1000);
-                    } else {
-                        sprite->sayUntil = 0;
-                    }
-                } else {
-                    sprite->sayText.clear();
-                }
+            IfInfo info;
+            info.elseStart = block->elseStart;
+            info.endifPos = block->bodyEnd;
+            info.trueBranch = (cond != 0);
+            ctx->ifStack.push_back(info);
+            if (cond != 0) {
                 ctx->pc++;
-                break;
+            } else {
+                ctx->pc = block->elseStart;
             }
-            case BLOCK_THINK: {
-                if (!block->strParam.empty()) {
-                    sprite->thinkText = block->strParam;
-                    sprite->sayText.clear();
-                    if (block->numParam1 > 0) {
-                        sprite->thinkUntil = currentTime + (Uint32)(block->numParam1 * 1000);
-                    } else {
-                        sprite->thinkUntil = 0;
-                    }
-                } else {
-                    sprite->thinkText.clear();
-                }
-                ctx->pc++;
-                break;
+            break;
+        }
+        case BLOCK_WAIT_UNTIL: {
+            float cond = 0;
+            if (!block->children.empty()) {
+                Value condVal = evaluateBlock(block->children[0], ctx, eng->project);
+                cond = value_to_number(condVal);
             }
-            case BLOCK_SWITCH_COSTUME:
-                if (!block->strParam.empty()) {
-                    for (size_t j = 0; j < sprite->costumes.size(); j++) {
-                        if (sprite->costumes[j]->name == block->strParam) {
-                            sprite->currentCostume = j;
-                            break;
-                        }
-                    }
-                } else {
-                    sprite->currentCostume = (int)block->numParam1;
-                }
-                ctx->pc++;
-                break;
-            case BLOCK_NEXT_COSTUME:
-                if (!sprite->costumes.empty()) {
-                    sprite->currentCostume = (sprite->currentCostume + 1) % sprite->costumes.size();
-                }
-                ctx->pc++;
-                break;
-            case BLOCK_SWITCH_BACKDROP:
-                if (!block->strParam.empty()) {
-                    for (size_t j = 0; j < eng->project->backdrops.size(); j++) {
-                        if (eng->project->backdrops[j]->name == block->strParam) {
-                            eng->project->currentBackdrop = j;
-                            break;
-                        }
-                    }
-                }
-                ctx->pc++;
-                break;
-            case BLOCK_NEXT_BACKDROP:
-                if (!eng->project->backdrops.empty()) {
-                    eng->project->currentBackdrop = (eng->project->currentBackdrop + 1) % eng->project->backdrops.size();
-                }
-                ctx->pc++;
-                break;
-            case BLOCK_CHANGE_SIZE:
-                sprite->size += block->numParam1;
-                ctx->pc++;
-                break;
-            case BLOCK_SET_SIZE:
-                sprite->size = block->numParam1;
-                ctx->pc++;
-                break;
-            case BLOCK_CHANGE_COLOR:
-                sprite->colorEffect += block->numParam1;
-                if (sprite->colorEffect < 0) sprite->colorEffect = 0;
-                if (sprite->colorEffect > 200) sprite->colorEffect = 200;
-                ctx->pc++;
-                break;
-            case BLOCK_SET_COLOR:
-                sprite->colorEffect = block->numParam1;
-                if (sprite->colorEffect < 0) sprite->colorEffect = 0;
-                if (sprite->colorEffect > 200) sprite->colorEffect = 200;
-                ctx->pc++;
-                break;
-            case BLOCK_CLEAR_EFFECTS:
-                sprite->colorEffect = 0;
-                sprite->brightnessEffect = 100;
-                sprite->saturationEffect = 100;
-                ctx->pc++;
-                break;
-            case BLOCK_SHOW:
-                sprite->visible = 1;
-                ctx->pc++;
-                break;
-            case BLOCK_HIDE:
-                sprite->visible = 0;
-                ctx->pc++;
-                break;
-            case BLOCK_GO_TO_LAYER:
-                if (block->strParam == "front") {
-                    sprite->layer = 1000;
-                } else if (block->strParam == "end") {
-                    sprite->layer = -1000;
-                }
-                ctx->pc++;
-                break;
-            case BLOCK_CHANGE_LAYER:
-                sprite->layer += (int)block->numParam1;
-                ctx->pc++;
-                break;
-            case BLOCK_CHANGE_BRIGHTNESS:
-                sprite->brightnessEffect += block->numParam1;
-                if (sprite->brightnessEffect < 0) sprite->brightnessEffect = 0;
-                if (sprite->brightnessEffect > 100) sprite->brightnessEffect = 100;
-                ctx->pc++;
-                break;
-            case BLOCK_SET_BRIGHTNESS:
-                sprite->brightnessEffect = block->numParam1;
-                if (sprite->brightnessEffect < 0) sprite->brightnessEffect = 0;
-                if (sprite->brightnessEffect > 100) sprite->brightnessEffect = 100;
-                ctx->pc++;
-                break;
-            case BLOCK_CHANGE_SATURATION:
-                sprite->saturationEffect += block->numParam1;
-                if (sprite->saturationEffect < 0) sprite->saturationEffect = 0;
-                if (sprite->saturationEffect > 100) sprite->saturationEffect = 100;
-                ctx->pc++;
-                break;
-            case BLOCK_SET_SATURATION:
-                sprite->saturationEffect = block->numParam1;
-                if (sprite->saturationEffect < 0) sprite->saturationEffect = 0;
-                if (sprite->saturationEffect > 100) sprite->saturationEffect = 100;
-                ctx->pc++;
-                break;
-            case BLOCK_PLAY_SOUND: {
-                const char* soundName = block->strParam.c_str();
-                if (soundName) {
-                    int idx = findSoundByName(eng->project, soundName);
-                    if (idx >= 0) {
-                        Sound* snd = eng->project->sounds[idx];
-                        if (snd->chunk && !snd->muted) {
-                            int volume = (int)(snd->volume * MIX_MAX_VOLUME / 100.0f);
-                            Mix_VolumeChunk(snd->chunk, volume);
-                            Mix_PlayChannel(-1, snd->chunk, 0);
-                        }
-                    }
-                }
+            if (cond != 0) {
                 ctx->pc++;
-                break;
             }
-            case BLOCK_PLAY_SOUND_UNTIL_DONE: {
-                const char* soundName = block->strParam.c_str();
-                if (soundName) {
-                    int idx = findSoundByName(eng->project, soundName);
-                    if (idx >= 0) {
-                        Sound* snd = eng->project->sounds[idx];
-                        if (snd->chunk && !snd->muted) {
-                            int volume = (int)(snd->volume * MIX_MAX_VOLUME / 100.0f);
-                            Mix_VolumeChunk(snd->chunk, volume);
-                            int channel = Mix_PlayChannel(-1, snd->chunk, 0);
-                            if (channel >= 0) {
-                                ctx->waitingForSoundChannel = channel;
-                                break;
-                            }
-                        }
-                    }
-                }
-                ctx->pc++;
-                break;
+            break;
+        }
+        case BLOCK_REPEAT_UNTIL: {
+            float cond = 0;
+            if (!block->children.empty()) {
+                Value condVal = evaluateBlock(block->children[0], ctx, eng->project);
+                cond = value_to_number(condVal);
             }
-            case BLOCK_STOP_ALL_SOUNDS:
-                Mix_HaltChannel(-1);
-                ctx->pc++;
-                break;
-            case BLOCK_CHANGE_VOLUME: {
-                const char* soundName = block->strParam.c_str();
-                if (soundName) {
-                    int idx = findSoundByName(eng->project, soundName);
-                    if (idx >= 0) {
-                        Sound* snd = eng->project->sounds[idx];
-                        snd->volume += block->numParam1;
-                        if (snd->volume < 0) snd->volume = 0;
-                        if (snd->volume > 100) snd->volume = 100;
-                    }
+            if (cond != 0) {
+                if (!ctx->loopStack.empty() && ctx->loopStack.back().start == ctx->pc) {
+                    ctx->loopStack.pop_back();
                 }
-                ctx->pc++;
-                break;
-            }
-            case BLOCK_SET_VOLUME: {
-                const char* soundName = block->strParam.c_str();
-                if (soundName) {
-                    int idx = findSoundByName(eng->project, soundName);
-                    if (idx >= 0) {
-                        Sound* snd = eng->project->sounds[idx];
-                        snd->volume = block->numParam1;
-                        if (snd->volume < 0) snd->volume = 0;
-                        if (snd->volume > 100) snd->volume = 100;
+                ctx->pc = block->bodyEnd;
+            } else {
+                bool alreadyInLoop = false;
+                for (const auto& l : ctx->loopStack) {
+                    if (l.start == ctx->pc) {
+                        alreadyInLoop = true;
+                        break;
                     }
                 }
-                ctx->pc++;
-                break;
+                if (!alreadyInLoop) {
+                    LoopInfo loop;
+                    loop.start = ctx->pc;
+                    loop.end = block->bodyEnd;
+                    loop.count = -1;
+                    ctx->loopStack.push_back(loop);
+                }
+                ctx->pc = ctx->pc + 1;
             }
-            case BLOCK_WAIT:
-                ctx->waitUntil = currentTime + (Uint32)(block->numParam1 * 1000);
-                break;
-            case BLOCK_REPEAT: {
-                LoopInfo loop;
-                loop.start = ctx->pc + 1;
-                loop.end = block->bodyEnd;
-                loop.count = (int)block->numParam1;
-                ctx->loopStack.push_back(loop);
-                ctx->pc = loop.start;
-                break;
+            break;
+        }
+        case BLOCK_STOP_ALL:
+            return CONTEXT_STOP_ALL;
+        case BLOCK_BROADCAST: {
+            DeferredOp op;
+            op.type = DEFER_BROADCAST;
+            op.name = block->strParam;
+            ExecutionEngine_submit(eng, ctx, op);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_BROADCAST_AND_WAIT: {
+            ctx->childrenLeft = 0;
+            ctx->waitingForChildren = true;
+            DeferredOp op;
+            op.type = DEFER_BROADCAST_AND_WAIT;
+            op.name = block->strParam;
+            ExecutionEngine_submit(eng, ctx, op);
+            break;
+        }
+        case BLOCK_SET_VARIABLE: {
+            if (!block->strParam.empty() && !block->children.empty()) {
+                Value val = evaluateBlock(block->children[0], ctx, eng->project);
+                ExecutionContext_setVariable(eng, ctx, block->strParam, val);
             }
-            case BLOCK_FOREVER: {
-                LoopInfo loop;
-                loop.start = ctx->pc + 1;
-                loop.end = block->bodyEnd;
-                loop.count = -1;
-                ctx->loopStack.push_back(loop);
-                ctx->pc = loop.start;
-                break;
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_CHANGE_VARIABLE: {
+            if (!block->strParam.empty() && !block->children.empty()) {
+                Value deltaVal = evaluateBlock(block->children[0], ctx, eng->project);
+                float delta = value_to_number(deltaVal);
+                ExecutionContext_changeVariable(eng, ctx, block->strParam, delta);
             }
-            case BLOCK_IF: {
-                float cond = 0;
-                if (!block->children.empty()) {
-                    Value condVal = evaluateBlock(block->children[0], ctx, eng->project);
-                    cond = value_to_number(condVal);
-                } else {
-                    cond = block->numParam1; // برای سازگاری با عقب
-                }
-                if (cond != 0) {
-                    ctx->pc++;
-                } else {
-                    ctx->pc = block->bodyEnd;
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_VARIABLE_GET:
+            ctx->pc++;
+            break;
+        case BLOCK_NUMBER:
+        case BLOCK_STRING:
+        case BLOCK_ADD:
+        case BLOCK_SUBTRACT:
+        case BLOCK_MULTIPLY:
+        case BLOCK_DIVIDE:
+        case BLOCK_RANDOM:
+        case BLOCK_LT:
+        case BLOCK_GT:
+        case BLOCK_EQUALS:
+        case BLOCK_AND:
+        case BLOCK_OR:
+        case BLOCK_NOT:
+        case BLOCK_JOIN:
+        case BLOCK_LETTER_OF:
+        case BLOCK_LENGTH:
+        case BLOCK_MOD:
+        case BLOCK_ROUND:
+        case BLOCK_ABS:
+        case BLOCK_SQRT:
+        case BLOCK_SIN:
+        case BLOCK_COS:
+        case BLOCK_TAN:
+        case BLOCK_ASIN:
+        case BLOCK_ACOS:
+        case BLOCK_ATAN:
+        case BLOCK_LN:
+        case BLOCK_LOG:
+        case BLOCK_POW:
+        case BLOCK_TOUCHING_EDGE:
+        case BLOCK_MOUSE_X:
+        case BLOCK_MOUSE_Y:
+        case BLOCK_KEY_PRESSED:
+        case BLOCK_COSTUME_NUMBER:
+        case BLOCK_COSTUME_NAME:
+        case BLOCK_BACKDROP_NUMBER:
+        case BLOCK_BACKDROP_NAME:
+        case BLOCK_SIZE:
+        case BLOCK_TOUCHING_MOUSEPOINTER:
+        case BLOCK_TOUCHING_SPRITE:
+        case BLOCK_TOUCHING_COLOR:
+        case BLOCK_COLOR_TOUCHING_COLOR:
+        case BLOCK_DISTANCE_TO:
+        case BLOCK_ANSWER:
+        case BLOCK_MOUSE_DOWN:
+        case BLOCK_TIMER:
+            ctx->pc++;
+            break;
+        case BLOCK_ASK_AND_WAIT: {
+            DeferredOp op;
+            op.type = DEFER_ASK;
+            ExecutionEngine_submit(eng, ctx, op);
+            ctx->waitingForAnswer = true;
+            break;
+        }
+        case BLOCK_SET_DRAG_MODE:
+            if (block->strParam == "draggable") {
+                sprite->draggable = true;
+            } else if (block->strParam == "not draggable") {
+                sprite->draggable = false;
+            }
+            ctx->pc++;
+            break;
+        case BLOCK_RESET_TIMER: {
+            DeferredOp op;
+            op.type = DEFER_RESET_TIMER;
+            ExecutionEngine_submit(eng, ctx, op);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_PEN_DOWN:
+            sprite->penDown = true;
+            ctx->pc++;
+            break;
+        case BLOCK_PEN_UP:
+            sprite->penDown = false;
+            ctx->pc++;
+            break;
+        case BLOCK_SET_PEN_COLOR:
+            sprite->penHue = block->numParam1;
+            if (sprite->penHue < 0) sprite->penHue = 0;
+            if (sprite->penHue > 200) sprite->penHue = 200;
+            ctx->pc++;
+            break;
+        case BLOCK_CHANGE_PEN_COLOR:
+            sprite->penHue += block->numParam1;
+            while (sprite->penHue < 0) sprite->penHue += 200;
+            while (sprite->penHue > 200) sprite->penHue -= 200;
+            ctx->pc++;
+            break;
+        case BLOCK_SET_PEN_BRIGHTNESS:
+            sprite->penBrightness = block->numParam1;
+            if (sprite->penBrightness < 0) sprite->penBrightness = 0;
+            if (sprite->penBrightness > 100) sprite->penBrightness = 100;
+            ctx->pc++;
+            break;
+        case BLOCK_CHANGE_PEN_BRIGHTNESS:
+            sprite->penBrightness += block->numParam1;
+            if (sprite->penBrightness < 0) sprite->penBrightness = 0;
+            if (sprite->penBrightness > 100) sprite->penBrightness = 100;
+            ctx->pc++;
+            break;
+        case BLOCK_SET_PEN_SATURATION:
+            sprite->penSaturation = block->numParam1;
+            if (sprite->penSaturation < 0) sprite->penSaturation = 0;
+            if (sprite->penSaturation > 100) sprite->penSaturation = 100;
+            ctx->pc++;
+            break;
+        case BLOCK_CHANGE_PEN_SATURATION:
+            sprite->penSaturation += block->numParam1;
+            if (sprite->penSaturation < 0) sprite->penSaturation = 0;
+            if (sprite->penSaturation > 100) sprite->penSaturation = 100;
+            ctx->pc++;
+            break;
+        case BLOCK_SET_PEN_SIZE:
+            sprite->penSize = (int)block->numParam1;
+            if (sprite->penSize < 1) sprite->penSize = 1;
+            ctx->pc++;
+            break;
+        case BLOCK_CHANGE_PEN_SIZE:
+            sprite->penSize += (int)block->numParam1;
+            if (sprite->penSize < 1) sprite->penSize = 1;
+            ctx->pc++;
+            break;
+        case BLOCK_ERASE_ALL: {
+            DeferredOp op;
+            op.type = DEFER_PEN_ERASE;
+            op.sprite = sprite;
+            ExecutionEngine_submit(eng, ctx, op);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_STAMP: {
+            if (!sprite->costumes.empty() && sprite->currentCostume < (int)sprite->costumes.size()) {
+                Costume* costume = sprite->costumes[sprite->currentCostume];
+                if (costume->texture) {
+                    int layerX, layerY;
+                    Project_stageToPen(eng->project, sprite->x, sprite->y, &layerX, &layerY);
+                    int stampW = (int)(50 * sprite->size / 100.0f) * eng->project->penScale;
+                    int stampH = (int)(50 * sprite->size / 100.0f) * eng->project->penScale;
+                    DeferredOp op;
+                    op.type = DEFER_PEN_STAMP;
+                    op.sprite = sprite;
+                    op.texture = costume->texture;
+                    op.surface = costume->surface;
+                    op.x1 = layerX - stampW/2;
+                    op.y1 = layerY - stampH/2;
+                    op.x2 = stampW;
+                    op.y2 = stampH;
+                    ExecutionEngine_submit(eng, ctx, op);
                 }
-                break;
             }
-            case BLOCK_IF_ELSE: {
-                float cond = 0;
-                if (!block->children.empty()) {
-                    Value condVal = evaluateBlock(block->children[0], ctx, eng->project);
-                    cond = value_to_number(condVal);
+            ctx->pc++;
+            break;
+        }
+        case BLOCK_ELSE:
+            if (!ctx->ifStack.empty()) {
+                IfInfo* top = &ctx->ifStack.back();
+                if (top->trueBranch) {
+                    ctx->pc = top->endifPos;
+                    ctx->ifStack.pop_back();
                 } else {
-                    cond = block->numParam1;
-                }
-                IfInfo info;
-                info.elseStart = block->elseStart;
-                info.endifPos = block->bodyEnd;
-                info.trueBranch = (cond != 0);
-                ctx->ifStack.push_back(info);
-                if (cond != 0) {
                     ctx->pc++;
-                } else {
-                    ctx->pc = block->elseStart;
                 }
-                break;
+            } else {
+                ctx->pc++;
             }
-            case BLOCK_WAIT_UNTIL: {
-                float cond = 0;
-                if (!block->children.empty()) {
-                    Value condVal = evaluateBlock(block->children[0], ctx, eng->project);
-                    cond = value_to_number(condVal);
-                }
-                if (cond != 0) {
-                    ctx->pc++;
-                }
-                break;
+            break;
+        case BLOCK_ENDIF:
+            if (!ctx->ifStack.empty()) {
+                ctx->ifStack.pop_back();
             }
-            case BLOCK_REPEAT_UNTIL: {
-                float cond = 0;
-                if (!block->children.empty()) {
-                    Value condVal = evaluateBlock(block->children[0], ctx, eng->project);
-                    cond = value_to_number(condVal);
-                }
-                if (cond != 0) {
-                    if (!ctx->loopStack.empty() && ctx->loopStack.back().start == ctx->pc) {
-                        ctx->loopStack.pop_back();
-                    }
-                    ctx->pc = block->bodyEnd;
+            ctx->pc++;
+            break;
+        case BLOCK_ENDLOOP:
+            ctx->pc++;
+            break;
+        default:
+            ctx->pc++;
+            break;
+    }
+
+    if (block->type != BLOCK_WAIT && block->type != BLOCK_WAIT_UNTIL && block->type != BLOCK_ASK_AND_WAIT) {
+        ExecutionContext_unwindLoops(ctx);
+    }
+    return CONTEXT_STEPPED;
+}
+
+void ExecutionContext_unwindLoops(ExecutionContext* ctx) {
+    while (!ctx->loopStack.empty()) {
+        LoopInfo* top = &ctx->loopStack.back();
+        if (ctx->pc == top->end) {
+            if (top->count == -1) {
+                ctx->pc = top->start;
+                break;
+            } else if (top->count > 0) {
+                top->count--;
+                if (top->count > 0) {
+                    ctx->pc = top->start;
+                    break;
                 } else {
-                    bool alreadyInLoop = false;
-                    for (const auto& l : ctx->loopStack) {
-                        if (l.start == ctx->pc) {
-                            alreadyInLoop = true;
-                            break;
-                        }
-                    }
-                    if (!alreadyInLoop) {
-                        LoopInfo loop;
-                        loop.start = ctx->pc;
-                        loop.end = block->bodyEnd;
-                        loop.count = -1;
-                        ctx->loopStack.push_back(loop);
-                    }
-                    ctx->pc = ctx->pc + 1;
+                    ctx->loopStack.pop_back();
                 }
-                break;
+            } else {
+                ctx->loopStack.pop_back();
             }
-            case BLOCK_STOP_ALL:
-                eng->contexts.clear();
-                return;
-            case BLOCK_BROADCAST:
-            {
-                const char* msg = block->strParam.c_str();
-                if (msg) {
-                    for (size_t s = 0; s < eng->project->sprites.size(); s++) {
-                        Sprite* targetSprite = eng->project->sprites[s];
-                        for (size_t t = 0; t < targetSprite->scripts.size(); t++) {
-                            Script* targetScript = targetSprite->scripts[t];
-                            if (!targetScript->blocks.empty() && targetScript->blocks[0]->type == BLOCK_WHEN_I_RECEIVE) {
-                                if (targetScript->blocks[0]->strParam == msg) {
-                                    ExecutionEngine_addContext(eng, s, t);
-                                }
-                            }
-                        }
-                    }
-                }
-                ctx->pc++;
-                break;
+        } else {
+            break;
+        }
+    }
+}
+
+void ExecutionEngine_submit(ExecutionEngine* eng, ExecutionContext* ctx, DeferredOp& op) {
+    op.ctx = ctx;
+    if (ctx->group) {
+        ctx->group->ops.push_back(op);
+        return;
+    }
+    ExecutionEngine_applyOp(eng, &op, false);
+}
+
+void ExecutionEngine_applyOp(ExecutionEngine* eng, DeferredOp* op, bool deferred) {
+    Project* proj = eng->project;
+    ExecutionContext* ctx = op->ctx;
+    SDL_Renderer* renderer = gApp ? gApp->renderer : NULL;
+    switch (op->type) {
+        case DEFER_SET_VARIABLE:
+            setVariable(proj, op->name, op->value);
+            break;
+        case DEFER_CHANGE_VARIABLE:
+            setVariable(proj, op->name, make_number(value_to_number(getVariable(proj, op->name)) + op->num));
+            break;
+        case DEFER_SET_BACKDROP:
+            proj->currentBackdrop = (int)op->num;
+            break;
+        case DEFER_NEXT_BACKDROP:
+            if (!proj->backdrops.empty()) {
+                proj->currentBackdrop = (proj->currentBackdrop + 1) % proj->backdrops.size();
             }
-            case BLOCK_BROADCAST_AND_WAIT:
-            {
-                const char* msg = block->strParam.c_str();
-                if (msg) {
-                    ctx->childrenLeft = 0;
-                    ctx->waitingForChildren = true;
-                    for (size_t s = 0; s < eng->project->sprites.size(); s++) {
-                        Sprite* targetSprite = eng->project->sprites[s];
-                        for (size_t t = 0; t < targetSprite->scripts.size(); t++) {
-                            Script* targetScript = targetSprite->scripts[t];
-                            if (!targetScript->blocks.empty() && targetScript->blocks[0]->type == BLOCK_WHEN_I_RECEIVE) {
-                                if (targetScript->blocks[0]->strParam == msg) {
-                                    ExecutionEngine_addChildContext(eng, s, t, ctx);
-                                }
+            break;
+        case DEFER_BROADCAST:
+        case DEFER_BROADCAST_AND_WAIT:
+            for (size_t s = 0; s < proj->sprites.size(); s++) {
+                Sprite* targetSprite = proj->sprites[s];
+                for (size_t t = 0; t < targetSprite->scripts.size(); t++) {
+                    Script* targetScript = targetSprite->scripts[t];
+                    if (!targetScript->blocks.empty() && targetScript->blocks[0]->type == BLOCK_WHEN_I_RECEIVE) {
+                        if (targetScript->blocks[0]->strParam == op->name) {
+                            if (op->type == DEFER_BROADCAST_AND_WAIT) {
+                                ExecutionEngine_addChildContext(eng, s, t, ctx);
+                            } else {
+                                ExecutionEngine_addContext(eng, s, t);
                             }
                         }
                     }
                 }
-                if (ctx->childrenLeft == 0) {
-                    ctx->pc++;
-                    ctx->waitingForChildren = false;
-                }
-                break;
-            }
-            case BLOCK_SET_VARIABLE: {
-                if (!block->strParam.empty() && !block->children.empty()) {
-                    Value val = evaluateBlock(block->children[0], ctx, eng->project);
-                    setVariable(eng->project, block->strParam, val);
-                }
-                ctx->pc++;
-                break;
-            }
-            case BLOCK_CHANGE_VARIABLE: {
-                if (!block->strParam.empty() && !block->children.empty()) {
-                    Value deltaVal = evaluateBlock(block->children[0], ctx, eng->project);
-                    float delta = value_to_number(deltaVal);
-                    Value cur = getVariable(eng->project, block->strParam);
-                    float curNum = value_to_number(cur);
-                    curNum += delta;
-                    Value newVal = make_number(curNum);
-                    setVariable(eng->project, block->strParam, newVal);
-                }
-                ctx->pc++;
-                break;
             }
-            case BLOCK_VARIABLE_GET:
-                ctx->pc++;
-                break;
-            case BLOCK_NUMBER:
-            case BLOCK_STRING:
-            case BLOCK_ADD:
-            case BLOCK_SUBTRACT:
-            case BLOCK_MULTIPLY:
-            case BLOCK_DIVIDE:
-            case BLOCK_RANDOM:
-            case BLOCK_LT:
-            case BLOCK_GT:
-            case BLOCK_EQUALS:
-            case BLOCK_AND:
-            case BLOCK_OR:
-            case BLOCK_NOT:
-            case BLOCK_JOIN:
-            case BLOCK_LETTER_OF:
-            case BLOCK_LENGTH:
-            case BLOCK_MOD:
-            case BLOCK_ROUND:
-            case BLOCK_ABS:
-            case BLOCK_SQRT:
-            case BLOCK_SIN:
-            case BLOCK_COS:
-            case BLOCK_TAN:
-            case BLOCK_ASIN:
-            case BLOCK_ACOS:
-            case BLOCK_ATAN:
-            case BLOCK_LN:
-            case BLOCK_LOG:
-            case BLOCK_POW:
-            case BLOCK_TOUCHING_EDGE:
-            case BLOCK_MOUSE_X:
-            case BLOCK_MOUSE_Y:
-            case BLOCK_KEY_PRESSED:
-            case BLOCK_COSTUME_NUMBER:
-            case BLOCK_COSTUME_NAME:
-            case BLOCK_BACKDROP_NUMBER:
-            case BLOCK_BACKDROP_NAME:
-            case BLOCK_SIZE:
-            case BLOCK_TOUCHING_MOUSEPOINTER:
-            case BLOCK_TOUCHING_SPRITE:
-            case BLOCK_TOUCHING_COLOR:
-            case BLOCK_COLOR_TOUCHING_COLOR:
-            case BLOCK_DISTANCE_TO:
-            case BLOCK_ANSWER:
-            case BLOCK_MOUSE_DOWN:
-            case BLOCK_TIMER:
-                ctx->pc++;
-                break;
-            case BLOCK_ASK_AND_WAIT:
-                SDL_StartTextInput();
-                ctx->waitingForAnswer = true;
-                break;
-            case BLOCK_SET_DRAG_MODE:
-                if (block->strParam == "draggable") {
-                    sprite->draggable = true;
-                } else if (block->strParam == "not draggable") {
-                    sprite->draggable = false;
-                }
-                ctx->pc++;
-                break;
-            case BLOCK_RESET_TIMER:
-                eng->project->timerStart = SDL_GetTicks();
-                ctx->pc++;
-                break;
-            case BLOCK_PEN_DOWN:
-                sprite->penDown = true;
-                ctx->pc++;
-                break;
-            case BLOCK_PEN_UP:
-                sprite->penDown = false;
-                ctx->pc++;
-                break;
-            case BLOCK_SET_PEN_COLOR:
-                sprite->penHue = block->numParam1;
-                if (sprite->penHue < 0) sprite->penHue = 0;
-                if (sprite->penHue > 200) sprite->penHue = 200;
-                ctx->pc++;
-                break;
-            case BLOCK_CHANGE_PEN_COLOR:
-                sprite->penHue += block->numParam1;
-                while (sprite->penHue < 0) sprite->penHue += 200;
-                while (sprite->penHue > 200) sprite->penHue -= 200;
-                ctx->pc++;
-                break;
-            case BLOCK_SET_PEN_BRIGHTNESS:
-                sprite->penBrightness = block->numParam1;
-                if (sprite->penBrightness < 0) sprite->penBrightness = 0;
-                if (sprite->penBrightness > 100) sprite->penBrightness = 100;
-                ctx->pc++;
-                break;
-            case BLOCK_CHANGE_PEN_BRIGHTNESS:
-                sprite->penBrightness += block->numParam1;
-                if (sprite->penBrightness < 0) sprite->penBrightness = 0;
-                if (sprite->penBrightness > 100) sprite->penBrightness = 100;
-                ctx->pc++;
-                break;
-            case BLOCK_SET_PEN_SATURATION:
-                sprite->penSaturation = block->numParam1;
-                if (sprite->penSaturation < 0) sprite->penSaturation = 0;
-                if (sprite->penSaturation > 100) sprite->penSaturation = 100;
-                ctx->pc++;
-                break;
-            case BLOCK_CHANGE_PEN_SATURATION:
-                sprite->penSaturation += block->numParam1;
-                if (sprite->penSaturation < 0) sprite->penSaturation = 0;
-                if (sprite->penSaturation > 100) sprite->penSaturation = 100;
-                ctx->pc++;
-                break;
-            case BLOCK_SET_PEN_SIZE:
-                sprite->penSize = (int)block->numParam1;
-                if (sprite->penSize < 1) sprite->penSize = 1;
-                ctx->pc++;
-                break;
-            case BLOCK_CHANGE_PEN_SIZE:
-                sprite->penSize += (int)block->numParam1;
-                if (sprite->penSize < 1) sprite->penSize = 1;
-                ctx->pc++;
-                break;
-            case BLOCK_ERASE_ALL: {
-                SDL_SetRenderTarget(renderer, sprite->penCanvas);
-                SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-                SDL_RenderClear(renderer);
-                SDL_SetRenderTarget(renderer, NULL);
+            if (op->type == DEFER_BROADCAST_AND_WAIT && ctx->childrenLeft == 0) {
                 ctx->pc++;
-                break;
+                ctx->waitingForChildren = false;
+                if (deferred) ExecutionContext_unwindLoops(ctx);
             }
-            case BLOCK_STAMP: {
-                if (!sprite->costumes.empty() && sprite->currentCostume < (int)sprite->costumes.size()) {
-                    Costume* costume = sprite->costumes[sprite->currentCostume];
-                    if (costume->texture) {
-                        int screenX = stageRect.x + stageRect.w/2 + (int)sprite->x;
-                        int screenY = stageRect.y + stageRect.h/2 - (int)sprite->y;
-                        int stampW = (int)(50 * sprite->size / 100.0f);
-                        int stampH = (int)(50 * sprite->size / 100.0f);
-                        SDL_Rect destRect = {screenX - stampW/2, screenY - stampH/2, stampW, stampH};
-                        SDL_SetRenderTarget(renderer, sprite->penCanvas);
-                        SDL_RenderCopy(renderer, costume->texture, NULL, &destRect);
-                        SDL_SetRenderTarget(renderer, NULL);
-                    }
+            break;
+        case DEFER_PLAY_SOUND:
+        case DEFER_PLAY_SOUND_UNTIL_DONE: {
+            int channel = -1;
+            int idx = findSoundByName(proj, op->name.c_str());
+            if (idx >= 0) {
+                Sound* snd = proj->sounds[idx];
+                if (snd->chunk && !snd->muted) {
+                    int volume = (int)(snd->volume * MIX_MAX_VOLUME / 100.0f);
+                    Mix_VolumeChunk(snd->chunk, volume);
+                    channel = Mix_PlayChannel(-1, snd->chunk, 0);
                 }
-                ctx->pc++;
-                break;
-            }
-            case BLOCK_ELSE:
-                if (!ctx->ifStack.empty()) {
-                    IfInfo* top = &ctx->ifStack.back();
-                    if (top->trueBranch) {
-                        ctx->pc = top->endifPos;
-                        ctx->ifStack.pop_back();
-                    } else {
-                        ctx->pc++;
-                    }
+            }
+            if (op->type == DEFER_PLAY_SOUND_UNTIL_DONE) {
+                if (channel >= 0) {
+                    ctx->waitingForSoundChannel = channel;
                 } else {
                     ctx->pc++;
+                    if (deferred) ExecutionContext_unwindLoops(ctx);
                 }
+            }
+            break;
+        }
+        case DEFER_STOP_ALL_SOUNDS:
+            Mix_HaltChannel(-1);
+            break;
+        case DEFER_CHANGE_VOLUME:
+        case DEFER_SET_VOLUME: {
+            int idx = findSoundByName(proj, op->name.c_str());
+            if (idx >= 0) {
+                Sound* snd = proj->sounds[idx];
+                if (op->type == DEFER_CHANGE_VOLUME) snd->volume += op->num;
+                else snd->volume = op->num;
+                if (snd->volume < 0) snd->volume = 0;
+                if (snd->volume > 100) snd->volume = 100;
+            }
+            break;
+        }
+        case DEFER_RESET_TIMER:
+            proj->timerStart = SDL_GetTicks();
+            break;
+        case DEFER_ASK:
+            if (ExecutionEngine_deferToMain(eng, op)) break;
+            SDL_StartTextInput();
+            break;
+        case DEFER_PEN_LINE:
+            // خط، پاک کردن و مهر روی لایه‌ی GPU همه به ترتیب تیک در رشته‌ی اصلی اجرا می‌شوند
+            if (!proj->penRaster && ExecutionEngine_deferToMain(eng, op)) break;
+            Project_queuePenLine(proj, op->x1, op->y1, op->x2, op->y2, op->color, op->size);
+            break;
+        case DEFER_PEN_STAMP: {
+            SDL_Rect destRect = {op->x1, op->y1, op->x2, op->y2};
+            if (proj->penRaster) {
+                PenRaster_stamp(proj->penRaster, op->surface, destRect);
                 break;
-            case BLOCK_ENDIF:
-                if (!ctx->ifStack.empty()) {
-                    ctx->ifStack.pop_back();
-                }
-                ctx->pc++;
-                break;
-            case BLOCK_ENDLOOP:
-                ctx->pc++;
-                break;
-            default:
-                ctx->pc++;
+            }
+            if (ExecutionEngine_deferToMain(eng, op)) break;
+            Project_flushPen(proj, renderer);
+            SDL_SetRenderTarget(renderer, proj->penLayer);
+            SDL_RenderCopy(renderer, op->texture, NULL, &destRect);
+            SDL_SetRenderTarget(renderer, NULL);
+            proj->penMirrorDirty = true;
+            break;
+        }
+        case DEFER_PEN_ERASE:
+            if (proj->penRaster) {
+                PenRaster_clear(proj->penRaster);
                 break;
+            }
+            if (ExecutionEngine_deferToMain(eng, op)) break;
+            proj->penStrokes.vertices.clear();
+            proj->penStrokes.indices.clear();
+            SDL_SetRenderTarget(renderer, proj->penLayer);
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+            SDL_RenderClear(renderer);
+            SDL_SetRenderTarget(renderer, NULL);
+            proj->penMirrorDirty = true;
+            break;
+        case DEFER_GO_TO_LAYER:
+            if (op->name == "front") {
+                Project_setLayer(proj, op->sprite, (int)proj->drawOrder.size() - 1);
+            } else if (op->name == "end") {
+                Project_setLayer(proj, op->sprite, 0);
+            }
+            break;
+        case DEFER_CHANGE_LAYER:
+            Project_setLayer(proj, op->sprite, op->sprite->layer + (int)op->num);
+            break;
+    }
+}
+
+// رندرر فقط در رشته‌ی اصلی قابل استفاده است؛ بقیه‌ی رشته‌ها کار را برای دور بعدی رسم صف می‌کنند
+bool ExecutionEngine_deferToMain(ExecutionEngine* eng, DeferredOp* op) {
+    if (SDL_ThreadID() == gMainThread) return false;
+    eng->mainOps.push_back(*op);
+    return true;
+}
+
+void ExecutionEngine_applyMainOps(ExecutionEngine* eng) {
+    vector<DeferredOp> ops;
+    ops.swap(eng->mainOps);
+    for (DeferredOp& op : ops) ExecutionEngine_applyOp(eng, &op, false);
+}
+
+// مهر و لایه‌ی صف‌شده‌ی اسپرایتی که حذف می‌شود به خودش و بافت‌های آزادشده‌اش اشاره می‌کنند؛
+// خط‌ها و پاک کردن فقط مختصات دارند و می‌مانند
+void ExecutionEngine_forgetSprite(ExecutionEngine* eng, Sprite* sprite) {
+    if (!eng) return;
+    eng->mainOps.erase(remove_if(eng->mainOps.begin(), eng->mainOps.end(), [sprite](const DeferredOp& op) {
+        return op.sprite == sprite && (op.type == DEFER_PEN_STAMP || op.type == DEFER_GO_TO_LAYER || op.type == DEFER_CHANGE_LAYER);
+    }), eng->mainOps.end());
+}
+
+// مختصات صحنه (x ±240، y ±180) به پیکسل لایه‌ی قلم
+void ExecutionEngine_penLine(ExecutionEngine* eng, ExecutionContext* ctx, Sprite* sprite, float fromX, float fromY, float toX, float toY) {
+    DeferredOp op;
+    op.type = DEFER_PEN_LINE;
+    op.sprite = sprite;
+    Project_stageToPen(eng->project, fromX, fromY, &op.x1, &op.y1);
+    Project_stageToPen(eng->project, toX, toY, &op.x2, &op.y2);
+    op.color = hslToRgb(sprite->penHue, sprite->penSaturation, sprite->penBrightness);
+    op.size = sprite->penSize * eng->project->penScale;
+    ExecutionEngine_submit(eng, ctx, op);
+}
+
+Value ExecutionContext_getVariable(ExecutionContext* ctx, Project* proj, const string& name) {
+    if (ctx && ctx->group) {
+        for (const Variable& v : ctx->group->localVariables) {
+            if (v.name == name) return v.value;
         }
+    }
+    return getVariable(proj, name);
+}
 
-        stepsThisFrame++;
-        if (stepsThisFrame > MAX_STEPS_PER_FRAME) {
-            setError(gApp, "⚠️ حلقه بی‌نهایت تشخیص داده شد! اجرا متوقف شد.");
-            eng->contexts.clear();
+// گروه مقدار خودش را فوراً می‌بیند، ولی در ادغام فقط تغییر جمع می‌شود تا تغییر همه‌ی اسپرایت‌ها بماند
+void ExecutionContext_changeVariable(ExecutionEngine* eng, ExecutionContext* ctx, const string& name, float delta) {
+    if (ctx->group) {
+        Value cur = ExecutionContext_getVariable(ctx, eng->project, name);
+        ExecutionContext_setLocal(ctx, name, make_number(value_to_number(cur) + delta));
+    }
+    DeferredOp op;
+    op.type = DEFER_CHANGE_VARIABLE;
+    op.name = name;
+    op.num = delta;
+    ExecutionEngine_submit(eng, ctx, op);
+}
+
+void ExecutionContext_setVariable(ExecutionEngine* eng, ExecutionContext* ctx, const string& name, const Value& val) {
+    if (ctx->group) ExecutionContext_setLocal(ctx, name, val);
+    DeferredOp op;
+    op.type = DEFER_SET_VARIABLE;
+    op.name = name;
+    op.value = val;
+    ExecutionEngine_submit(eng, ctx, op);
+}
+
+void ExecutionContext_setLocal(ExecutionContext* ctx, const string& name, const Value& val) {
+    for (Variable& v : ctx->group->localVariables) {
+        if (v.name == name) {
+            v.value = val;
             return;
         }
+    }
+    Variable v;
+    v.name = name;
+    v.value = val;
+    ctx->group->localVariables.push_back(v);
+}
 
-        if (block->type != BLOCK_WAIT && block->type != BLOCK_WAIT_UNTIL && block->type != BLOCK_ASK_AND_WAIT) {
-            while (!ctx->loopStack.empty()) {
-                LoopInfo* top = &ctx->loopStack.back();
-                if (ctx->pc == top->end) {
-                    if (top->count == -1) {
-                        ctx->pc = top->start;
-                        break;
-                    } else if (top->count > 0) {
-                        top->count--;
-                        if (top->count > 0) {
-                            ctx->pc = top->start;
-                            break;
-                        } else {
-                            ctx->loopStack.pop_back();
-                        }
-                    } else {
-                        ctx->loopStack.pop_back();
-                    }
-                } else {
-                    break;
-                }
-            }
+// عددی در [0, 1]؛ در تیک موازی از مولد xorshift گروه
+float ExecutionContext_random(ExecutionContext* ctx) {
+    if (!ctx || !ctx->group) return rand() / (float)RAND_MAX;
+    Uint32 x = ctx->group->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    ctx->group->rng = x;
+    return (x >> 8) / (float)0xFFFFFF;
+}
+
+SpritePose ExecutionContext_spritePose(ExecutionContext* ctx, Project* proj, int spriteIndex) {
+    if (ctx && ctx->group && spriteIndex < (int)ctx->group->poses->size()) {
+        return (*ctx->group->poses)[spriteIndex];
+    }
+    return Sprite_pose(proj->sprites[spriteIndex]);
+}
+
+SpritePose Sprite_pose(Sprite* sprite) {
+    SpritePose pose = {sprite->x, sprite->y, sprite->size, sprite->visible,
+                       sprite->currentCostume, sprite->ghostEffect, sprite->brightnessEffect};
+    return pose;
+}
+
+void ExecutionEngine_runGroup(ExecutionEngine* eng, SpriteTickGroup* group, Uint32 currentTime) {
+    for (ExecutionContext* ctx : group->contexts) {
+        int result = ExecutionEngine_stepContext(eng, ctx, currentTime);
+        if (result == CONTEXT_FINISHED) {
+            ctx->finished = true;
+        } else if (result == CONTEXT_STOP_ALL) {
+            group->stopAll = true;
+            return;
+        } else if (result == CONTEXT_STEPPED) {
+            group->steps++;
         }
     }
+}
 
-    if (eng->stepMode) {
-        eng->stepMode = false;
+void ExecutionEngine_stepParallel(ExecutionEngine* eng, Uint32 currentTime) {
+    Project* proj = eng->project;
+    if (!eng->pool) ExecutionEngine_setParallel(eng, true);
+
+    // پاسخ ask باید روی نخ اصلی مصرف شود
+    for (ExecutionContext* ctx : eng->contexts) {
+        if (ctx->waitingForAnswer && gApp && gApp->answerReady) {
+            proj->answer = gApp->pendingAnswer;
+            gApp->answerReady = false;
+            ctx->waitingForAnswer = false;
+            ctx->pc++;
+            break;
+        }
+    }
+
+    int spriteCount = (int)proj->sprites.size();
+    while ((int)eng->groups.size() < spriteCount) {
+        SpriteTickGroup* group = new SpriteTickGroup;
+        group->spriteId = (int)eng->groups.size();
+        group->poses = &eng->poses;
+        eng->groups.push_back(group);
+    }
+    eng->poses.resize(spriteCount);
+    // بذر هر تیک در همین رشته گرفته می‌شود و با شماره‌ی اسپرایت پخش می‌شود
+    Uint32 tickSeed = (Uint32)rand();
+    for (int i = 0; i < spriteCount; i++) {
+        Sprite* s = proj->sprites[i];
+        eng->poses[i] = Sprite_pose(s);
+        SpriteTickGroup* group = eng->groups[i];
+        Uint32 h = tickSeed ^ ((Uint32)i * 0x9E3779B9u);
+        h ^= h >> 16; h *= 0x85EBCA6Bu; h ^= h >> 13; h *= 0xC2B2AE35u; h ^= h >> 16;
+        group->rng = h ? h : 1;
+        group->contexts.clear();
+        group->ops.clear();
+        group->localVariables.clear();
+        group->steps = 0;
+        group->stopAll = false;
+    }
+    for (ExecutionContext* ctx : eng->contexts) {
+        if (ctx->spriteId < 0 || ctx->spriteId >= spriteCount) continue;
+        ctx->group = eng->groups[ctx->spriteId];
+        ctx->group->contexts.push_back(ctx);
+    }
+    eng->activeGroups.clear();
+    for (int i = 0; i < spriteCount; i++) {
+        if (!eng->groups[i]->contexts.empty()) eng->activeGroups.push_back(eng->groups[i]);
+    }
+
+    WorkerPool_run(eng->pool, eng, currentTime);
+
+    // ادغام به ترتیب شماره اسپرایت تا نتیجه هر بار یکسان باشد
+    int stepsThisFrame = 0;
+    bool stopAll = false;
+    for (SpriteTickGroup* group : eng->activeGroups) {
+        for (ExecutionContext* ctx : group->contexts) ctx->group = NULL;
+        Sprite* s = proj->sprites[group->spriteId];
+        const SpritePose& pose = eng->poses[group->spriteId];
+        if (s->x != pose.x || s->y != pose.y || s->size != pose.size) Project_spriteMoved(proj, NULL, group->spriteId);
+    }
+    for (SpriteTickGroup* group : eng->activeGroups) {
+        for (size_t j = 0; j < group->ops.size(); j++) {
+            ExecutionEngine_applyOp(eng, &group->ops[j], true);
+        }
+        stepsThisFrame += group->steps;
+        if (group->stopAll) {
+            stopAll = true;
+            break;
+        }
+    }
+    if (stopAll) {
+        eng->contexts.clear();
         return;
     }
+    for (int i = 0; i < (int)eng->contexts.size(); i++) {
+        if (eng->contexts[i]->finished) {
+            ExecutionEngine_removeContext(eng, i);
+            i--;
+        }
+    }
+    if (stepsThisFrame > MAX_STEPS_PER_FRAME) {
+        setError(gApp, "⚠️ حلقه بی‌نهایت تشخیص داده شد! اجرا متوقف شد.");
+        eng->contexts.clear();
+    }
+}
+
+void ExecutionEngine_setParallel(ExecutionEngine* eng, bool enabled) {
+    eng->parallel = enabled;
+    if (enabled && !eng->pool) {
+        int threadCount = SDL_GetCPUCount() - 1;
+        if (threadCount < 1) threadCount = 1;
+        eng->pool = WorkerPool_create(threadCount);
+    }
+}
+
+void WorkerPool_runQueues(WorkerPool* pool, int self) {
+    int queueCount = (int)pool->queues.size();
+    for (int k = 0; k < queueCount; k++) {
+        // اول صف خودش، بعد دزدیدن کار از صف بقیه
+        WorkerQueue* q = &pool->queues[(self + k) % queueCount];
+        while (true) {
+            int idx = SDL_AtomicAdd(&q->next, 1);
+            if (idx >= q->end) break;
+            ExecutionEngine_runGroup(pool->engine, pool->engine->activeGroups[idx], pool->currentTime);
+        }
+    }
+}
+
+int WorkerPool_threadMain(void* data) {
+    WorkerThread* worker = (WorkerThread*)data;
+    WorkerPool* pool = worker->pool;
+    int seen = 0;
+    while (true) {
+        SDL_LockMutex(pool->lock);
+        while (!pool->quit && pool->generation == seen) SDL_CondWait(pool->wake, pool->lock);
+        if (pool->quit) {
+            SDL_UnlockMutex(pool->lock);
+            break;
+        }
+        seen = pool->generation;
+        SDL_UnlockMutex(pool->lock);
+
+        WorkerPool_runQueues(pool, worker->index);
+
+        SDL_LockMutex(pool->lock);
+        pool->pending--;
+        if (pool->pending == 0) SDL_CondSignal(pool->done);
+        SDL_UnlockMutex(pool->lock);
+    }
+    return 0;
+}
+
+WorkerPool* WorkerPool_create(int threadCount) {
+    WorkerPool* pool = new WorkerPool;
+    pool->lock = SDL_CreateMutex();
+    pool->wake = SDL_CreateCond();
+    pool->done = SDL_CreateCond();
+    pool->generation = 0;
+    pool->pending = 0;
+    pool->quit = false;
+    pool->engine = NULL;
+    pool->currentTime = 0;
+    pool->queues.resize(threadCount + 1);
+    for (int i = 0; i < threadCount; i++) {
+        WorkerThread* worker = new WorkerThread;
+        worker->pool = pool;
+        worker->index = i;
+        worker->thread = SDL_CreateThread(WorkerPool_threadMain, "sprite-worker", worker);
+        if (!worker->thread) {
+            printf("Failed to create worker thread: %s\n", SDL_GetError());
+            delete worker;
+            continue;
+        }
+        pool->threads.push_back(worker);
+    }
+    return pool;
+}
+
+void WorkerPool_destroy(WorkerPool* pool) {
+    SDL_LockMutex(pool->lock);
+    pool->quit = true;
+    SDL_CondBroadcast(pool->wake);
+    SDL_UnlockMutex(pool->lock);
+    for (WorkerThread* worker : pool->threads) {
+        SDL_WaitThread(worker->thread, NULL);
+        delete worker;
+    }
+    SDL_DestroyCond(pool->done);
+    SDL_DestroyCond(pool->wake);
+    SDL_DestroyMutex(pool->lock);
+    delete pool;
+}
+
+void WorkerPool_run(WorkerPool* pool, ExecutionEngine* eng, Uint32 currentTime) {
+    int groupCount = (int)eng->activeGroups.size();
+    int queueCount = (int)pool->queues.size();
+    int per = (groupCount + queueCount - 1) / queueCount;
+    for (int q = 0; q < queueCount; q++) {
+        int begin = q * per;
+        int end = begin + per;
+        if (begin > groupCount) begin = groupCount;
+        if (end > groupCount) end = groupCount;
+        SDL_AtomicSet(&pool->queues[q].next, begin);
+        pool->queues[q].end = end;
+    }
+    pool->engine = eng;
+    pool->currentTime = currentTime;
+
+    SDL_LockMutex(pool->lock);
+    pool->generation++;
+    pool->pending = (int)pool->threads.size();
+    SDL_CondBroadcast(pool->wake);
+    SDL_UnlockMutex(pool->lock);
+
+    // نخ اصلی هم آخرین صف را اجرا می‌کند
+    WorkerPool_runQueues(pool, queueCount - 1);
+
+    SDL_LockMutex(pool->lock);
+    while (pool->pending > 0) SDL_CondWait(pool->done, pool->lock);
+    SDL_UnlockMutex(pool->lock);
+}
+
+// زمان تا بیدار شدن اولین اسکریپت؛ 0 یعنی همین حالا قابل اجراست و -1 یعنی هیچ
+int ExecutionEngine_nextWake(ExecutionEngine* eng, Uint32 now) {
+    int wake = -1;
+    for (ExecutionContext* ctx : eng->contexts) {
+        if (ctx->waitingForAnswer) continue;
+        if (ctx->waitingForSoundChannel != -1) return 0;
+        if (ctx->waitUntil <= now) return 0;
+        int left = (int)(ctx->waitUntil - now);
+        if (wake < 0 || left < wake) wake = left;
+    }
+    return wake;
 }
 
 void ExecutionEngine_run(ExecutionEngine* eng) {
@@ -2545,59 +5740,51 @@ void ExecutionEngine_startKeyScripts(ExecutionEngine* eng, SDL_Keycode key) {
     }
 }
 
-int ExecutionEngine_startSpriteClickScripts(ExecutionEngine* eng, int mouseX, int mouseY, SDL_Rect stageRect) {
-    int topSprite = -1;
-    int topLayer = -1000000;
-    for (size_t i = 0; i < eng->project->sprites.size(); i++) {
-        Sprite* s = eng->project->sprites[i];
+// جلوترین اسپرایت دیده‌شده زیر نقطه‌ی صحنه، یا -1
+int Project_spriteAt(Project* proj, float stageX, float stageY) {
+    // فقط اسپرایت‌های خانه‌ی زیر نقطه؛ از بین آن‌ها بالاترین لایه
+    SDL_Rect probe = {(int)floorf(STAGE_WIDTH/2 + stageX), (int)floorf(STAGE_HEIGHT/2 - stageY), 1, 1};
+    vector<int> near;
+    SpriteGrid_query(proj, probe, near);
+    int best = -1;
+    for (int i : near) {
+        Sprite* s = proj->sprites[i];
         if (!s->visible) continue;
-        int screenX = stageRect.x + stageRect.w/2 + (int)s->x;
-        int screenY = stageRect.y + stageRect.h/2 - (int)s->y;
-        int spriteW = (int)(50 * s->size / 100.0f);
-        int spriteH = (int)(50 * s->size / 100.0f);
-        SDL_Rect rect = {screenX - spriteW/2, screenY - spriteH/2, spriteW, spriteH};
-        if (mouseX >= rect.x && mouseX <= rect.x + rect.w &&
-            mouseY >= rect.y && mouseY <= rect.y + rect.h) {
-            if (s->layer > topLayer) {
-                topLayer = s->layer;
-                topSprite = i;
-            }
-        }
+        if (best >= 0 && s->layer < proj->sprites[best]->layer) continue;
+        float half = (int)(50 * s->size / 100.0f) / 2.0f;
+        if (fabsf(stageX - s->x) <= half && fabsf(stageY - s->y) <= half) best = i;
     }
-    if (topSprite >= 0) {
-        Sprite* sprite = eng->project->sprites[topSprite];
-        for (size_t j = 0; j < sprite->scripts.size(); j++) {
-            Script* script = sprite->scripts[j];
-            if (!script->blocks.empty() && script->blocks[0]->type == BLOCK_WHEN_SPRITE_CLICKED) {
-                ExecutionEngine_addContext(eng, topSprite, j);
-            }
+    return best;
+}
+
+void ExecutionEngine_startSpriteClickScripts(ExecutionEngine* eng, int spriteIndex) {
+    Sprite* sprite = eng->project->sprites[spriteIndex];
+    for (size_t j = 0; j < sprite->scripts.size(); j++) {
+        Script* script = sprite->scripts[j];
+        if (!script->blocks.empty() && script->blocks[0]->type == BLOCK_WHEN_SPRITE_CLICKED) {
+            ExecutionEngine_addContext(eng, spriteIndex, j);
         }
     }
-    return topSprite;
 }
 
 bool findBlockAt(CodeAreaUI* ui, int mouseX, int mouseY, int* outScriptIndex, int* outBlockIndex) {
     if (ui->selectedSpriteIndex < 0 || ui->selectedSpriteIndex >= (int)ui->project->sprites.size())
         return false;
     Sprite* sprite = ui->project->sprites[ui->selectedSpriteIndex];
-    int scriptSpacing = 10;
-    int scriptWidth = 180;
-    int blockHeight = 40;
-    int blockGap = 2;
-
-    for (size_t i = 0; i < sprite->scripts.size(); i++) {
-        int scriptX = ui->rect.x + 10 + i * (scriptWidth + scriptSpacing) - ui->scrollX;
-        if (mouseX < scriptX || mouseX > scriptX + scriptWidth - 10) continue;
-        for (size_t j = 0; j < sprite->scripts[i]->blocks.size(); j++) {
-            int blockY = ui->rect.y + 10 - ui->scrollY + j * (blockHeight + blockGap);
-            if (mouseY >= blockY && mouseY <= blockY + blockHeight) {
-                *outScriptIndex = i;
-                *outBlockIndex = j;
-                return true;
-            }
-        }
-    }
-    return false;
+    int scriptStride = CODE_SCRIPT_WIDTH + CODE_SCRIPT_SPACING;
+    int blockStride = CODE_BLOCK_HEIGHT + CODE_BLOCK_GAP;
+
+    // هندسه ثابت است، پس اندیس مستقیم از مختصات به دست می‌آید
+    int relX = mouseX - (ui->rect.x + CODE_MARGIN - ui->scrollX);
+    int relY = mouseY - (ui->rect.y + CODE_MARGIN - ui->scrollY);
+    if (relX < 0 || relY < 0) return false;
+    int i = relX / scriptStride;
+    int j = relY / blockStride;
+    if (relX % scriptStride > CODE_SCRIPT_WIDTH - 10 || relY % blockStride > CODE_BLOCK_HEIGHT) return false;
+    if (i >= (int)sprite->scripts.size() || j >= (int)sprite->scripts[i]->blocks.size()) return false;
+    *outScriptIndex = i;
+    *outBlockIndex = j;
+    return true;
 }
 // SpriteManagerUI functions
 // ============================================================================
@@ -2647,7 +5834,10 @@ void SpriteManagerUI_render(SpriteManagerUI* ui) {
         }
         SDL_Rect iconRect = {x, y, iconSize, iconSize};
         if (!s->costumes.empty() && s->currentCostume < (int)s->costumes.size() && s->costumes[s->currentCostume]->texture) {
-            SDL_RenderCopy(ui->renderer, s->costumes[s->currentCostume]->texture, NULL, &iconRect);
+            Costume* costume = s->costumes[s->currentCostume];
+            const MipLevel* level = MipChain_level(costume->mips, ui->renderer, iconSize, iconSize);
+            if (level) SDL_RenderCopy(ui->renderer, level->page, &level->rect, &iconRect);
+            else SDL_RenderCopy(ui->renderer, costume->texture, NULL, &iconRect);
         } else {
             Uint8 r = (s->currentCostume * 50) % 256;
             Uint8 g = (s->currentCostume * 80) % 256;
@@ -2681,14 +5871,11 @@ void SpriteManagerUI_render(SpriteManagerUI* ui) {
                 nameBuffer = s->name;
             }
 
-            SDL_Surface* surf = TTF_RenderText_Blended(ui->font, nameBuffer.c_str(), textColor);
-            if (surf) {
-                SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-                textRect.w = surf->w;
-                textRect.h = surf->h;
-                SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-                SDL_DestroyTexture(tex);
-                SDL_FreeSurface(surf);
+            CachedText* label = TextCache_get(gTextCache, ui->font, nameBuffer.c_str(), textColor);
+            if (label) {
+                textRect.w = label->w;
+                textRect.h = label->h;
+                SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
             }
         }
 
@@ -2708,14 +5895,7 @@ void SpriteManagerUI_render(SpriteManagerUI* ui) {
 
             char labelX[32];
             snprintf(labelX, sizeof(labelX), "x: %.1f", s->x);
-            SDL_Surface* surfX = TTF_RenderText_Blended(ui->font, labelX, {0,0,0,255});
-            if (surfX) {
-                SDL_Texture* texX = SDL_CreateTextureFromSurface(ui->renderer, surfX);
-                SDL_Rect textRectX = {editX + 5, editY + 5, surfX->w, surfX->h};
-                SDL_RenderCopy(ui->renderer, texX, NULL, &textRectX);
-                SDL_DestroyTexture(texX);
-                SDL_FreeSurface(surfX);
-            }
+            drawGlyphText(ui->renderer, ui->font, labelX, editX + 5, editY + 5, {0,0,0,255});
             SDL_Rect btnXPlus = {editX + editW - btnW - 5, editY + 5, btnW, btnH};
             SDL_Rect btnXMinus = {editX + editW - 2*btnW - 10, editY + 5, btnW, btnH};
             SDL_SetRenderDrawColor(ui->renderer, 200, 200, 200, 255);
@@ -2725,18 +5905,10 @@ void SpriteManagerUI_render(SpriteManagerUI* ui) {
             SDL_RenderDrawRect(ui->renderer, &btnXPlus);
             SDL_RenderDrawRect(ui->renderer, &btnXMinus);
 
-            SDL_Surface* plusSurf = TTF_RenderText_Blended(ui->font, "+", {0,0,0,255});
-            SDL_Surface* minusSurf = TTF_RenderText_Blended(ui->font, "-", {0,0,0,255});
-            SDL_Texture* plusTex = nullptr;
-            SDL_Texture* minusTex = nullptr;
-            if (plusSurf) {
-                plusTex = SDL_CreateTextureFromSurface(ui->renderer, plusSurf);
-                SDL_FreeSurface(plusSurf);
-            }
-            if (minusSurf) {
-                minusTex = SDL_CreateTextureFromSurface(ui->renderer, minusSurf);
-                SDL_FreeSurface(minusSurf);
-            }
+            CachedText* plusLabel = TextCache_get(gTextCache, ui->font, "+", {0,0,0,255});
+            CachedText* minusLabel = TextCache_get(gTextCache, ui->font, "-", {0,0,0,255});
+            SDL_Texture* plusTex = plusLabel ? plusLabel->texture : nullptr;
+            SDL_Texture* minusTex = minusLabel ? minusLabel->texture : nullptr;
 
             if (plusTex && minusTex) {
                 SDL_Rect textRectPlus = {btnXPlus.x + (btnW - 8)/2, btnXPlus.y + (btnH - 8)/2, 8, 8};
@@ -2746,14 +5918,7 @@ void SpriteManagerUI_render(SpriteManagerUI* ui) {
 
                 char labelY[32];
                 snprintf(labelY, sizeof(labelY), "y: %.1f", s->y);
-                SDL_Surface* surfY = TTF_RenderText_Blended(ui->font, labelY, {0,0,0,255});
-                if (surfY) {
-                    SDL_Texture* texY = SDL_CreateTextureFromSurface(ui->renderer, surfY);
-                    SDL_Rect textRectY = {editX + 5, editY + 5 + lineHeight, surfY->w, surfY->h};
-                    SDL_RenderCopy(ui->renderer, texY, NULL, &textRectY);
-                    SDL_DestroyTexture(texY);
-                    SDL_FreeSurface(surfY);
-                }
+                drawGlyphText(ui->renderer, ui->font, labelY, editX + 5, editY + 5 + lineHeight, {0,0,0,255});
                 SDL_Rect btnYPlus = {editX + editW - btnW - 5, editY + 5 + lineHeight, btnW, btnH};
                 SDL_Rect btnYMinus = {editX + editW - 2*btnW - 10, editY + 5 + lineHeight, btnW, btnH};
                 SDL_SetRenderDrawColor(ui->renderer, 200, 200, 200, 255);
@@ -2771,14 +5936,7 @@ void SpriteManagerUI_render(SpriteManagerUI* ui) {
 
                 char labelDir[32];
                 snprintf(labelDir, sizeof(labelDir), "dir: %.0f", s->direction);
-                SDL_Surface* surfDir = TTF_RenderText_Blended(ui->font, labelDir, {0,0,0,255});
-                if (surfDir) {
-                    SDL_Texture* texDir = SDL_CreateTextureFromSurface(ui->renderer, surfDir);
-                    SDL_Rect textRectDir = {editX + 5, editY + 5 + 2*lineHeight, surfDir->w, surfDir->h};
-                    SDL_RenderCopy(ui->renderer, texDir, NULL, &textRectDir);
-                    SDL_DestroyTexture(texDir);
-                    SDL_FreeSurface(surfDir);
-                }
+                drawGlyphText(ui->renderer, ui->font, labelDir, editX + 5, editY + 5 + 2*lineHeight, {0,0,0,255});
                 SDL_Rect btnDirPlus = {editX + editW - btnW - 5, editY + 5 + 2*lineHeight, btnW, btnH};
                 SDL_Rect btnDirMinus = {editX + editW - 2*btnW - 10, editY + 5 + 2*lineHeight, btnW, btnH};
                 SDL_SetRenderDrawColor(ui->renderer, 200, 200, 200, 255);
@@ -2796,14 +5954,7 @@ void SpriteManagerUI_render(SpriteManagerUI* ui) {
 
                 char labelSize[32];
                 snprintf(labelSize, sizeof(labelSize), "size: %.0f%%", s->size);
-                SDL_Surface* surfSize = TTF_RenderText_Blended(ui->font, labelSize, {0,0,0,255});
-                if (surfSize) {
-                    SDL_Texture* texSize = SDL_CreateTextureFromSurface(ui->renderer, surfSize);
-                    SDL_Rect textRectSize = {editX + 5, editY + 5 + 3*lineHeight, surfSize->w, surfSize->h};
-                    SDL_RenderCopy(ui->renderer, texSize, NULL, &textRectSize);
-                    SDL_DestroyTexture(texSize);
-                    SDL_FreeSurface(surfSize);
-                }
+                drawGlyphText(ui->renderer, ui->font, labelSize, editX + 5, editY + 5 + 3*lineHeight, {0,0,0,255});
                 SDL_Rect btnSizePlus = {editX + editW - btnW - 5, editY + 5 + 3*lineHeight, btnW, btnH};
                 SDL_Rect btnSizeMinus = {editX + editW - 2*btnW - 10, editY + 5 + 3*lineHeight, btnW, btnH};
                 SDL_SetRenderDrawColor(ui->renderer, 200, 200, 200, 255);
@@ -2825,13 +5976,10 @@ void SpriteManagerUI_render(SpriteManagerUI* ui) {
             SDL_RenderFillRect(ui->renderer, &btnShow);
             SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
             SDL_RenderDrawRect(ui->renderer, &btnShow);
-            SDL_Surface* showSurf = TTF_RenderText_Blended(ui->font, s->visible ? "Hide" : "Show", {0,0,0,255});
-            if (showSurf) {
-                SDL_Texture* showTex = SDL_CreateTextureFromSurface(ui->renderer, showSurf);
-                SDL_Rect textRect = {btnShow.x + (60 - showSurf->w)/2, btnShow.y + (btnH - showSurf->h)/2, showSurf->w, showSurf->h};
-                SDL_RenderCopy(ui->renderer, showTex, NULL, &textRect);
-                SDL_DestroyTexture(showTex);
-                SDL_FreeSurface(showSurf);
+            CachedText* showLabel = TextCache_get(gTextCache, ui->font, s->visible ? "Hide" : "Show", {0,0,0,255});
+            if (showLabel) {
+                SDL_Rect textRect = {btnShow.x + (60 - showLabel->w)/2, btnShow.y + (btnH - showLabel->h)/2, showLabel->w, showLabel->h};
+                SDL_RenderCopy(ui->renderer, showLabel->texture, NULL, &textRect);
             }
 
             SDL_Rect btnDelete = {editX + 70, editY + 5 + 4*lineHeight, 50, btnH};
@@ -2839,17 +5987,12 @@ void SpriteManagerUI_render(SpriteManagerUI* ui) {
             SDL_RenderFillRect(ui->renderer, &btnDelete);
             SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
             SDL_RenderDrawRect(ui->renderer, &btnDelete);
-            SDL_Surface* delSurf = TTF_RenderText_Blended(ui->font, "Del", {0,0,0,255});
-            if (delSurf) {
-                SDL_Texture* delTex = SDL_CreateTextureFromSurface(ui->renderer, delSurf);
-                SDL_Rect textRect = {btnDelete.x + (50 - delSurf->w)/2, btnDelete.y + (btnH - delSurf->h)/2, delSurf->w, delSurf->h};
-                SDL_RenderCopy(ui->renderer, delTex, NULL, &textRect);
-                SDL_DestroyTexture(delTex);
-                SDL_FreeSurface(delSurf);
+            CachedText* delLabel = TextCache_get(gTextCache, ui->font, "Del", {0,0,0,255});
+            if (delLabel) {
+                SDL_Rect textRect = {btnDelete.x + (50 - delLabel->w)/2, btnDelete.y + (btnH - delLabel->h)/2, delLabel->w, delLabel->h};
+                SDL_RenderCopy(ui->renderer, delLabel->texture, NULL, &textRect);
             }
 
-            if (plusTex) SDL_DestroyTexture(plusTex);
-            if (minusTex) SDL_DestroyTexture(minusTex);
         }
     }
 }
@@ -2900,11 +6043,15 @@ void SpriteManagerUI_handleEvent(SpriteManagerUI* ui, SDL_Event* e) {
                     if (x >= btnXPlus.x && x <= btnXPlus.x + btnXPlus.w && y >= btnXPlus.y && y <= btnXPlus.y + btnXPlus.h) {
                         s->x += 10;
                         if (s->x > 240) s->x = 240;
+                        Project_spriteMoved(ui->project, NULL, ui->selectedSpriteIndex);
+                        ui->project->edited = true;
                         return;
                     }
                     if (x >= btnXMinus.x && x <= btnXMinus.x + btnXMinus.w && y >= btnXMinus.y && y <= btnXMinus.y + btnXMinus.h) {
                         s->x -= 10;
                         if (s->x < -240) s->x = -240;
+                        Project_spriteMoved(ui->project, NULL, ui->selectedSpriteIndex);
+                        ui->project->edited = true;
                         return;
                     }
 
@@ -2913,11 +6060,15 @@ void SpriteManagerUI_handleEvent(SpriteManagerUI* ui, SDL_Event* e) {
                     if (x >= btnYPlus.x && x <= btnYPlus.x + btnYPlus.w && y >= btnYPlus.y && y <= btnYPlus.y + btnYPlus.h) {
                         s->y += 10;
                         if (s->y > 180) s->y = 180;
+                        Project_spriteMoved(ui->project, NULL, ui->selectedSpriteIndex);
+                        ui->project->edited = true;
                         return;
                     }
                     if (x >= btnYMinus.x && x <= btnYMinus.x + btnYMinus.w && y >= btnYMinus.y && y <= btnYMinus.y + btnYMinus.h) {
                         s->y -= 10;
                         if (s->y < -180) s->y = -180;
+                        Project_spriteMoved(ui->project, NULL, ui->selectedSpriteIndex);
+                        ui->project->edited = true;
                         return;
                     }
 
@@ -2926,11 +6077,13 @@ void SpriteManagerUI_handleEvent(SpriteManagerUI* ui, SDL_Event* e) {
                     if (x >= btnDirPlus.x && x <= btnDirPlus.x + btnDirPlus.w && y >= btnDirPlus.y && y <= btnDirPlus.y + btnDirPlus.h) {
                         s->direction += 15;
                         if (s->direction >= 360) s->direction -= 360;
+                        ui->project->edited = true;
                         return;
                     }
                     if (x >= btnDirMinus.x && x <= btnDirMinus.x + btnDirMinus.w && y >= btnDirMinus.y && y <= btnDirMinus.y + btnDirMinus.h) {
                         s->direction -= 15;
                         if (s->direction < 0) s->direction += 360;
+                        ui->project->edited = true;
                         return;
                     }
 
@@ -2939,17 +6092,22 @@ void SpriteManagerUI_handleEvent(SpriteManagerUI* ui, SDL_Event* e) {
                     if (x >= btnSizePlus.x && x <= btnSizePlus.x + btnSizePlus.w && y >= btnSizePlus.y && y <= btnSizePlus.y + btnSizePlus.h) {
                         s->size += 10;
                         if (s->size > 200) s->size = 200;
+                        Project_spriteMoved(ui->project, NULL, ui->selectedSpriteIndex);
+                        ui->project->edited = true;
                         return;
                     }
                     if (x >= btnSizeMinus.x && x <= btnSizeMinus.x + btnSizeMinus.w && y >= btnSizeMinus.y && y <= btnSizeMinus.y + btnSizeMinus.h) {
                         s->size -= 10;
                         if (s->size < 10) s->size = 10;
+                        Project_spriteMoved(ui->project, NULL, ui->selectedSpriteIndex);
+                        ui->project->edited = true;
                         return;
                     }
 
                     SDL_Rect btnShow = {editX + 5, editY + 5 + 4*lineHeight, 60, btnH};
                     if (x >= btnShow.x && x <= btnShow.x + btnShow.w && y >= btnShow.y && y <= btnShow.y + btnShow.h) {
                         s->visible = !s->visible;
+                        ui->project->edited = true;
                         return;
                     }
 
@@ -2957,8 +6115,14 @@ void SpriteManagerUI_handleEvent(SpriteManagerUI* ui, SDL_Event* e) {
                     if (x >= btnDelete.x && x <= btnDelete.x + btnDelete.w && y >= btnDelete.y && y <= btnDelete.y + btnDelete.h) {
                         if (ui->selectedSpriteIndex >= 0) {
                             Sprite* s = ui->project->sprites[ui->selectedSpriteIndex];
+                            if (gApp) ExecutionEngine_forgetSprite(gApp->engine, s);
                             for (Costume* c : s->costumes) {
                                 if (c->texture) SDL_DestroyTexture(c->texture);
+                                if (c->surface) SDL_FreeSurface(c->surface);
+                                CostumeAtlas_release(gCostumeAtlas, c->atlasPage);
+                                EffectCache_forget(gEffectCache, c);
+                                MipChain_destroy(c->mips);
+                                Costume_freeMasks(c);
                                 delete c;
                             }
                             for (Script* scr : s->scripts) {
@@ -2967,9 +6131,10 @@ void SpriteManagerUI_handleEvent(SpriteManagerUI* ui, SDL_Event* e) {
                                 }
                                 delete scr;
                             }
-                            if (s->penCanvas) SDL_DestroyTexture(s->penCanvas);
+                            if (s->bubble) SDL_DestroyTexture(s->bubble);
+                            Project_removeSprite(ui->project, s);
                             delete s;
-                            ui->project->sprites.erase(ui->project->sprites.begin() + ui->selectedSpriteIndex);
+                            ui->project->edited = true;
                             if (ui->selectedSpriteIndex >= (int)ui->project->sprites.size()) {
                                 ui->selectedSpriteIndex = ui->project->sprites.size() - 1;
                             }
@@ -2992,6 +6157,8 @@ void SpriteManagerUI_handleEvent(SpriteManagerUI* ui, SDL_Event* e) {
             if (ui->editingName >= 0 && ui->editingName < (int)ui->project->sprites.size()) {
                 Sprite* s = ui->project->sprites[ui->editingName];
                 s->name = ui->nameEditBuffer;
+                ui->project->grid.stale = true;
+                ui->project->edited = true;
             }
             ui->editingName = -1;
             SDL_StopTextInput();
@@ -3073,7 +6240,9 @@ void BackdropManagerUI_render(BackdropManagerUI* ui) {
         SDL_Rect thumbRect = {ui->rect.x + 10, y, 100, 60};
         Backdrop* b = ui->project->backdrops[i];
         if (b->texture) {
-            SDL_RenderCopy(ui->renderer, b->texture, NULL, &thumbRect);
+            const MipLevel* level = MipChain_level(b->mips, ui->renderer, thumbRect.w, thumbRect.h);
+            if (level) SDL_RenderCopy(ui->renderer, level->page, &level->rect, &thumbRect);
+            else SDL_RenderCopy(ui->renderer, b->texture, NULL, &thumbRect);
         } else {
             SDL_SetRenderDrawColor(ui->renderer, 180, 180, 180, 255);
             SDL_RenderFillRect(ui->renderer, &thumbRect);
@@ -3085,13 +6254,10 @@ void BackdropManagerUI_render(BackdropManagerUI* ui) {
             SDL_RenderDrawRect(ui->renderer, &thumbRect);
         }
         if (ui->font) {
-            SDL_Surface* surf = TTF_RenderText_Blended(ui->font, b->name.c_str(), {0,0,0,255});
-            if (surf) {
-                SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-                SDL_Rect textRect = {ui->rect.x + 115, y + 20, surf->w, surf->h};
-                SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-                SDL_DestroyTexture(tex);
-                SDL_FreeSurface(surf);
+            CachedText* label = TextCache_get(gTextCache, ui->font, b->name.c_str(), {0,0,0,255});
+            if (label) {
+                SDL_Rect textRect = {ui->rect.x + 115, y + 20, label->w, label->h};
+                SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
             }
         }
     }
@@ -3110,6 +6276,7 @@ void BackdropManagerUI_handleEvent(BackdropManagerUI* ui, SDL_Event* e) {
                 if (y >= thumbY && y <= thumbY + 60) {
                     ui->selectedBackdropIndex = index;
                     ui->project->currentBackdrop = index;
+                    ui->project->edited = true;
                 }
             }
         }
@@ -3138,14 +6305,20 @@ void BackdropManagerUI_uploadBackdrop(BackdropManagerUI* ui, const char* filepat
 
     char* fullPath = findFontFile(filepath);
     Backdrop* b = ui->project->backdrops[ui->selectedBackdropIndex];
-    SDL_Texture* tex = loadTexture(ui->renderer, fullPath);
+    SDL_Surface* surf = IMG_Load(fullPath);
+    SDL_Texture* tex = surf ? SDL_CreateTextureFromSurface(ui->renderer, surf) : NULL;
     if (tex) {
         if (b->texture) SDL_DestroyTexture(b->texture);
+        if (b->surface) SDL_FreeSurface(b->surface);
+        MipChain_destroy(b->mips);
         b->texture = tex;
+        b->surface = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_ARGB8888, 0);
+        b->mips = MipChain_create(surf);
         printf("Backdrop successfully loaded from %s\n", fullPath);
     } else {
         printf("Error loading image from path: %s\n", fullPath);
     }
+    if (surf) SDL_FreeSurface(surf);
     free(fullPath);
 }
 // SoundManagerUI functions
@@ -3187,13 +6360,10 @@ void SoundManagerUI_render(SoundManagerUI* ui) {
     SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
     SDL_RenderDrawRect(ui->renderer, &libBtn);
     if (ui->font) {
-        SDL_Surface* surf = TTF_RenderText_Blended(ui->font, "📁 Library", {255,255,255,255});
-        if (surf) {
-            SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-            SDL_Rect textRect = {libBtn.x + (btnW - surf->w)/2, libBtn.y + (btnH - surf->h)/2, surf->w, surf->h};
-            SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-            SDL_DestroyTexture(tex);
-            SDL_FreeSurface(surf);
+        CachedText* label = TextCache_get(gTextCache, ui->font, "📁 Library", {255,255,255,255});
+        if (label) {
+            SDL_Rect textRect = {libBtn.x + (btnW - label->w)/2, libBtn.y + (btnH - label->h)/2, label->w, label->h};
+            SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
         }
     }
 
@@ -3202,13 +6372,10 @@ void SoundManagerUI_render(SoundManagerUI* ui) {
     SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
     SDL_RenderDrawRect(ui->renderer, &randBtn);
     if (ui->font) {
-        SDL_Surface* surf = TTF_RenderText_Blended(ui->font, "🎲 Random", {255,255,255,255});
-        if (surf) {
-            SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-            SDL_Rect textRect = {randBtn.x + (btnW - surf->w)/2, randBtn.y + (btnH - surf->h)/2, surf->w, surf->h};
-            SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-            SDL_DestroyTexture(tex);
-            SDL_FreeSurface(surf);
+        CachedText* label = TextCache_get(gTextCache, ui->font, "🎲 Random", {255,255,255,255});
+        if (label) {
+            SDL_Rect textRect = {randBtn.x + (btnW - label->w)/2, randBtn.y + (btnH - label->h)/2, label->w, label->h};
+            SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
         }
     }
 
@@ -3232,25 +6399,19 @@ void SoundManagerUI_render(SoundManagerUI* ui) {
         }
 
         if (ui->font) {
-            SDL_Surface* surf = TTF_RenderText_Blended(ui->font, ui->project->sounds[i]->name.c_str(), {0,0,0,255});
-            if (surf) {
-                SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-                SDL_Rect textRect = {itemRect.x + 5, itemRect.y + 5, surf->w, surf->h};
-                SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-                SDL_DestroyTexture(tex);
-                SDL_FreeSurface(surf);
+            CachedText* label = TextCache_get(gTextCache, ui->font, ui->project->sounds[i]->name.c_str(), {0,0,0,255});
+            if (label) {
+                SDL_Rect textRect = {itemRect.x + 5, itemRect.y + 5, label->w, label->h};
+                SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
             }
 
             char status[50];
             snprintf(status, sizeof(status), "Vol: %.0f%% %s", ui->project->sounds[i]->volume,
                      ui->project->sounds[i]->muted ? "(Muted)" : "");
-            SDL_Surface* surf2 = TTF_RenderText_Blended(ui->font, status, {0,0,0,255});
-            if (surf2) {
-                SDL_Texture* tex2 = SDL_CreateTextureFromSurface(ui->renderer, surf2);
-                SDL_Rect textRect2 = {itemRect.x + 5, itemRect.y + 25, surf2->w, surf2->h};
-                SDL_RenderCopy(ui->renderer, tex2, NULL, &textRect2);
-                SDL_DestroyTexture(tex2);
-                SDL_FreeSurface(surf2);
+            CachedText* label2 = TextCache_get(gTextCache, ui->font, status, {0,0,0,255});
+            if (label2) {
+                SDL_Rect textRect2 = {itemRect.x + 5, itemRect.y + 25, label2->w, label2->h};
+                SDL_RenderCopy(ui->renderer, label2->texture, NULL, &textRect2);
             }
 
             int btnW = 25;
@@ -3263,13 +6424,10 @@ void SoundManagerUI_render(SoundManagerUI* ui) {
             SDL_RenderFillRect(ui->renderer, &btnPlus);
             SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
             SDL_RenderDrawRect(ui->renderer, &btnPlus);
-            SDL_Surface* plusSurf = TTF_RenderText_Blended(ui->font, "+", {0,0,0,255});
-            if (plusSurf) {
-                SDL_Texture* plusTex = SDL_CreateTextureFromSurface(ui->renderer, plusSurf);
-                SDL_Rect textRect = {btnPlus.x + (btnW - plusSurf->w)/2, btnPlus.y + (btnH - plusSurf->h)/2, plusSurf->w, plusSurf->h};
-                SDL_RenderCopy(ui->renderer, plusTex, NULL, &textRect);
-                SDL_DestroyTexture(plusTex);
-                SDL_FreeSurface(plusSurf);
+            CachedText* plusLabel = TextCache_get(gTextCache, ui->font, "+", {0,0,0,255});
+            if (plusLabel) {
+                SDL_Rect textRect = {btnPlus.x + (btnW - plusLabel->w)/2, btnPlus.y + (btnH - plusLabel->h)/2, plusLabel->w, plusLabel->h};
+                SDL_RenderCopy(ui->renderer, plusLabel->texture, NULL, &textRect);
             }
 
             SDL_Rect btnMinus = {btnX + btnW + 5, btnY, btnW, btnH};
@@ -3277,13 +6435,10 @@ void SoundManagerUI_render(SoundManagerUI* ui) {
             SDL_RenderFillRect(ui->renderer, &btnMinus);
             SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
             SDL_RenderDrawRect(ui->renderer, &btnMinus);
-            SDL_Surface* minusSurf = TTF_RenderText_Blended(ui->font, "-", {0,0,0,255});
-            if (minusSurf) {
-                SDL_Texture* minusTex = SDL_CreateTextureFromSurface(ui->renderer, minusSurf);
-                SDL_Rect textRect = {btnMinus.x + (btnW - minusSurf->w)/2, btnMinus.y + (btnH - minusSurf->h)/2, minusSurf->w, minusSurf->h};
-                SDL_RenderCopy(ui->renderer, minusTex, NULL, &textRect);
-                SDL_DestroyTexture(minusTex);
-                SDL_FreeSurface(minusSurf);
+            CachedText* minusLabel = TextCache_get(gTextCache, ui->font, "-", {0,0,0,255});
+            if (minusLabel) {
+                SDL_Rect textRect = {btnMinus.x + (btnW - minusLabel->w)/2, btnMinus.y + (btnH - minusLabel->h)/2, minusLabel->w, minusLabel->h};
+                SDL_RenderCopy(ui->renderer, minusLabel->texture, NULL, &textRect);
             }
 
             SDL_Rect btnMute = {btnX, btnY, btnW, btnH};
@@ -3292,13 +6447,10 @@ void SoundManagerUI_render(SoundManagerUI* ui) {
             SDL_RenderFillRect(ui->renderer, &btnMute);
             SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
             SDL_RenderDrawRect(ui->renderer, &btnMute);
-            SDL_Surface* muteSurf = TTF_RenderText_Blended(ui->font, "M", {0,0,0,255});
-            if (muteSurf) {
-                SDL_Texture* muteTex = SDL_CreateTextureFromSurface(ui->renderer, muteSurf);
-                SDL_Rect textRect = {btnMute.x + (btnW - muteSurf->w)/2, btnMute.y + (btnH - muteSurf->h)/2, muteSurf->w, muteSurf->h};
-                SDL_RenderCopy(ui->renderer, muteTex, NULL, &textRect);
-                SDL_DestroyTexture(muteTex);
-                SDL_FreeSurface(muteSurf);
+            CachedText* muteLabel = TextCache_get(gTextCache, ui->font, "M", {0,0,0,255});
+            if (muteLabel) {
+                SDL_Rect textRect = {btnMute.x + (btnW - muteLabel->w)/2, btnMute.y + (btnH - muteLabel->h)/2, muteLabel->w, muteLabel->h};
+                SDL_RenderCopy(ui->renderer, muteLabel->texture, NULL, &textRect);
             }
         }
     }
@@ -3319,6 +6471,7 @@ void SoundManagerUI_handleEvent(SoundManagerUI* ui, SDL_Event* e) {
             if (x >= libBtn.x && x <= libBtn.x + libBtn.w && y >= libBtn.y && y <= libBtn.y + libBtn.h) {
                 Project_addSoundFromFile(ui->project, "Pop", "pop.wav");
                 ui->selectedSoundIndex = ui->project->sounds.size() - 1;
+                ui->project->edited = true;
                 return;
             }
             if (x >= randBtn.x && x <= randBtn.x + randBtn.w && y >= randBtn.y && y <= randBtn.y + randBtn.h) {
@@ -3329,6 +6482,7 @@ void SoundManagerUI_handleEvent(SoundManagerUI* ui, SDL_Event* e) {
                     Project_addSoundFromFile(ui->project, "Meow", "meow.wav");
                 }
                 ui->selectedSoundIndex = ui->project->sounds.size() - 1;
+                ui->project->edited = true;
                 return;
             }
 
@@ -3451,13 +6605,10 @@ void PenToolUI_render(PenToolUI* ui) {
     int spacing = 25;
 
     if (ui->font) {
-        SDL_Surface* surf = TTF_RenderText_Blended(ui->font, "Pen Tool", {0,0,0,255});
-        if (surf) {
-            SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-            SDL_Rect textRect = {x, y, surf->w, surf->h};
-            SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-            SDL_DestroyTexture(tex);
-            SDL_FreeSurface(surf);
+        CachedText* label = TextCache_get(gTextCache, ui->font, "Pen Tool", {0,0,0,255});
+        if (label) {
+            SDL_Rect textRect = {x, y, label->w, label->h};
+            SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
         }
         y += 20;
     }
@@ -3469,13 +6620,10 @@ void PenToolUI_render(PenToolUI* ui) {
     SDL_RenderDrawRect(ui->renderer, &toggleBtn);
     if (ui->font) {
         const char* label = ui->active ? "On" : "Off";
-        SDL_Surface* surf = TTF_RenderText_Blended(ui->font, label, {0,0,0,255});
-        if (surf) {
-            SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-            SDL_Rect textRect = {toggleBtn.x + (60 - surf->w)/2, toggleBtn.y + (20 - surf->h)/2, surf->w, surf->h};
-            SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-            SDL_DestroyTexture(tex);
-            SDL_FreeSurface(surf);
+        CachedText* toggleLabel = TextCache_get(gTextCache, ui->font, label, {0,0,0,255});
+        if (toggleLabel) {
+            SDL_Rect textRect = {toggleBtn.x + (60 - toggleLabel->w)/2, toggleBtn.y + (20 - toggleLabel->h)/2, toggleLabel->w, toggleLabel->h};
+            SDL_RenderCopy(ui->renderer, toggleLabel->texture, NULL, &textRect);
         }
     }
     y += 25;
@@ -3495,13 +6643,10 @@ void PenToolUI_render(PenToolUI* ui) {
     SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
     SDL_RenderDrawLine(ui->renderer, handleX, y, handleX, y + sliderH);
     if (ui->font) {
-        SDL_Surface* surf = TTF_RenderText_Blended(ui->font, "Hue", {0,0,0,255});
-        if (surf) {
-            SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-            SDL_Rect textRect = {x + sliderW + 5, y, surf->w, surf->h};
-            SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-            SDL_DestroyTexture(tex);
-            SDL_FreeSurface(surf);
+        CachedText* label = TextCache_get(gTextCache, ui->font, "Hue", {0,0,0,255});
+        if (label) {
+            SDL_Rect textRect = {x + sliderW + 5, y, label->w, label->h};
+            SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
         }
     }
     y += 15;
@@ -3513,13 +6658,10 @@ void PenToolUI_render(PenToolUI* ui) {
     SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
     SDL_RenderDrawLine(ui->renderer, handleX, y, handleX, y + sliderH);
     if (ui->font) {
-        SDL_Surface* surf = TTF_RenderText_Blended(ui->font, "Sat", {0,0,0,255});
-        if (surf) {
-            SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-            SDL_Rect textRect = {x + sliderW + 5, y, surf->w, surf->h};
-            SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-            SDL_DestroyTexture(tex);
-            SDL_FreeSurface(surf);
+        CachedText* label = TextCache_get(gTextCache, ui->font, "Sat", {0,0,0,255});
+        if (label) {
+            SDL_Rect textRect = {x + sliderW + 5, y, label->w, label->h};
+            SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
         }
     }
     y += 15;
@@ -3531,13 +6673,10 @@ void PenToolUI_render(PenToolUI* ui) {
     SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
     SDL_RenderDrawLine(ui->renderer, handleX, y, handleX, y + sliderH);
     if (ui->font) {
-        SDL_Surface* surf = TTF_RenderText_Blended(ui->font, "Bright", {0,0,0,255});
-        if (surf) {
-            SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-            SDL_Rect textRect = {x + sliderW + 5, y, surf->w, surf->h};
-            SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-            SDL_DestroyTexture(tex);
-            SDL_FreeSurface(surf);
+        CachedText* label = TextCache_get(gTextCache, ui->font, "Bright", {0,0,0,255});
+        if (label) {
+            SDL_Rect textRect = {x + sliderW + 5, y, label->w, label->h};
+            SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
         }
     }
     y += 15;
@@ -3549,13 +6688,10 @@ void PenToolUI_render(PenToolUI* ui) {
     SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
     SDL_RenderDrawLine(ui->renderer, handleX, y, handleX, y + sliderH);
     if (ui->font) {
-        SDL_Surface* surf = TTF_RenderText_Blended(ui->font, "Size", {0,0,0,255});
-        if (surf) {
-            SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-            SDL_Rect textRect = {x + sliderW + 5, y, surf->w, surf->h};
-            SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-            SDL_DestroyTexture(tex);
-            SDL_FreeSurface(surf);
+        CachedText* label = TextCache_get(gTextCache, ui->font, "Size", {0,0,0,255});
+        if (label) {
+            SDL_Rect textRect = {x + sliderW + 5, y, label->w, label->h};
+            SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
         }
     }
 }
@@ -3611,30 +6747,20 @@ void PenToolUI_handleEvent(PenToolUI* ui, SDL_Event* e, Application* app) {
         }
     } else if (e->type == SDL_MOUSEMOTION && ui->drawing && ui->active) {
         int x = e->motion.x, y = e->motion.y;
-        int winW, winH;
-        SDL_GetWindowSize(app->window, &winW, &winH);
-        int startY = 70;
-        int paletteWidth = 200, codeWidth = 400;
-        int sceneWidth = winW - paletteWidth - codeWidth;
-        int bottomHeight = 128;
-        int rightPanelHeight = winH - startY - bottomHeight;
-        int backdropPanelHeight = 150, soundPanelHeight = 150;
-        int sceneHeight = rightPanelHeight - backdropPanelHeight - soundPanelHeight;
-        if (sceneHeight < 200) sceneHeight = 200;
-        SDL_Rect sceneRect = {paletteWidth + codeWidth, startY, sceneWidth, sceneHeight};
-
-        if (x >= sceneRect.x && x <= sceneRect.x + sceneRect.w &&
-            y >= sceneRect.y && y <= sceneRect.y + sceneRect.h) {
-            Sprite* s = app->currentProject->sprites[app->spriteManagerUI->selectedSpriteIndex];
-            int stageX1 = ui->lastMouseX - (sceneRect.x + sceneRect.w/2);
-            int stageY1 = (sceneRect.y + sceneRect.h/2) - ui->lastMouseY;
-            int stageX2 = x - (sceneRect.x + sceneRect.w/2);
-            int stageY2 = (sceneRect.y + sceneRect.h/2) - y;
+        SDL_Rect sceneRect = stageRectForWindow(app->window);
+        SDL_Rect view = stageViewRect(sceneRect);
+        SDL_Point p = {x, y};
+
+        if (SDL_PointInRect(&p, &view)) {
+            Project* proj = app->currentProject;
+            float stageX1, stageY1, stageX2, stageY2;
+            screenToStage(sceneRect, ui->lastMouseX, ui->lastMouseY, &stageX1, &stageY1);
+            screenToStage(sceneRect, x, y, &stageX2, &stageY2);
+            int x1, y1, x2, y2;
+            Project_stageToPen(proj, stageX1, stageY1, &x1, &y1);
+            Project_stageToPen(proj, stageX2, stageY2, &x2, &y2);
             SDL_Color color = hslToRgb(ui->hue, ui->saturation, ui->brightness);
-            drawLineOnCanvas(app->renderer, s->penCanvas,
-                             stageX1 + sceneRect.w/2, stageY1 + sceneRect.h/2,
-                             stageX2 + sceneRect.w/2, stageY2 + sceneRect.h/2,
-                             color, ui->penSize);
+            Project_queuePenLine(proj, x1, y1, x2, y2, color, ui->penSize * proj->penScale);
             ui->lastMouseX = x;
             ui->lastMouseY = y;
         }
@@ -3685,6 +6811,7 @@ int looks_blocks[] = {
         BLOCK_SHOW, BLOCK_HIDE, BLOCK_GO_TO_LAYER, BLOCK_CHANGE_LAYER,
         BLOCK_CHANGE_BRIGHTNESS, BLOCK_SET_BRIGHTNESS,
         BLOCK_CHANGE_SATURATION, BLOCK_SET_SATURATION,
+        BLOCK_CHANGE_GHOST, BLOCK_SET_GHOST,
         BLOCK_COSTUME_NUMBER, BLOCK_COSTUME_NAME,
         BLOCK_BACKDROP_NUMBER, BLOCK_BACKDROP_NAME,
         BLOCK_SIZE
@@ -3794,15 +6921,12 @@ void BlockPaletteUI_render(BlockPaletteUI* ui) {
         SDL_RenderDrawRect(ui->renderer, &catRect);
 
         if (ui->font) {
-            SDL_Surface* surf = TTF_RenderText_Blended(ui->font, categories[i], {0,0,0,255});
-            if (surf) {
-                SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-                int textX = catRect.x + (catRect.w - surf->w) / 2;
-                int textY = catRect.y + (catRect.h - surf->h) / 2;
-                SDL_Rect textRect = {textX, textY, surf->w, surf->h};
-                SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-                SDL_DestroyTexture(tex);
-                SDL_FreeSurface(surf);
+            CachedText* label = TextCache_get(gTextCache, ui->font, categories[i], {0,0,0,255});
+            if (label) {
+                int textX = catRect.x + (catRect.w - label->w) / 2;
+                int textY = catRect.y + (catRect.h - label->h) / 2;
+                SDL_Rect textRect = {textX, textY, label->w, label->h};
+                SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
             }
         }
     }
@@ -3826,6 +6950,18 @@ void BlockPaletteUI_render(BlockPaletteUI* ui) {
     int blockHeight = 30;
     int blockGap = 2;
 
+    // همه‌ی پس‌زمینه‌ها با یک فراخوانی رسم می‌شوند، بعد حاشیه و متن
+    ShapeBatch shapes;
+    for (int i = 0; i < num_blocks; i++) {
+        int y = blockStartY + i * (blockHeight + blockGap);
+        if (y + blockHeight > ui->rect.y + ui->rect.h || y < ui->rect.y) {
+            continue;
+        }
+        SDL_Rect blockRect = {ui->rect.x + 10, y, 180, blockHeight};
+        ShapeBatch_addRoundedRect(&shapes, blockRect, 8, get_block_color((BlockType)current_blocks[i]));
+    }
+    ShapeBatch_flush(ui->renderer, &shapes);
+
     for (int i = 0; i < num_blocks; i++) {
         int y = blockStartY + i * (blockHeight + blockGap);
         if (y + blockHeight > ui->rect.y + ui->rect.h || y < ui->rect.y) {
@@ -3833,24 +6969,21 @@ void BlockPaletteUI_render(BlockPaletteUI* ui) {
         }
         int blockType = current_blocks[i];
         SDL_Rect blockRect = {ui->rect.x + 10, y, 180, blockHeight};
-        SDL_Color color = get_block_color((BlockType)blockType);
-        DrawRoundedRect(ui->renderer, blockRect, 8, color);
         SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
         SDL_RenderDrawRect(ui->renderer, &blockRect);
 
         if (ui->font) {
             const char* text = block_type_names[blockType];
-            SDL_Surface* surf = TTF_RenderText_Blended(ui->font, text, {0,0,0,255});
-            if (surf) {
-                SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-                SDL_Rect textRect = {blockRect.x + 5, blockRect.y + (blockHeight - surf->h)/2, surf->w, surf->h};
-                SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-                SDL_DestroyTexture(tex);
-                SDL_FreeSurface(surf);
+            CachedText* label = TextCache_get(gTextCache, ui->font, text, {0,0,0,255});
+            if (label) {
+                SDL_Rect textRect = {blockRect.x + 5, blockRect.y + (blockHeight - label->h)/2, label->w, label->h};
+                SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
             }
         }
     }
+}
 
+void BlockPaletteUI_renderDragPreview(BlockPaletteUI* ui) {
     if (ui->dragging && ui->dragBlockType >= 0) {
         int blockWidth = 180;
         int blockHeight = 30;
@@ -3869,18 +7002,15 @@ void BlockPaletteUI_render(BlockPaletteUI* ui) {
         SDL_RenderDrawRect(ui->renderer, &previewRect);
         if (ui->font) {
             const char* text = block_type_names[ui->dragBlockType];
-            SDL_Surface* surf = TTF_RenderText_Blended(ui->font, text, {0,0,0,255});
-            if (surf) {
-                SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
+            CachedText* label = TextCache_get(gTextCache, ui->font, text, {0,0,0,255});
+            if (label) {
                 SDL_Rect textRect = {
                         previewRect.x + 5,
-                        previewRect.y + (blockHeight - surf->h)/2,
-                        surf->w,
-                        surf->h
+                        previewRect.y + (blockHeight - label->h)/2,
+                        label->w,
+                        label->h
                 };
-                SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-                SDL_DestroyTexture(tex);
-                SDL_FreeSurface(surf);
+                SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
             }
         }
     }
@@ -3971,6 +7101,7 @@ void BlockPaletteUI_handleEvent(BlockPaletteUI* ui, SDL_Event* e) {
             } else {
                 CodeAreaUI_addBlockAt(ui->codeArea, ui->dragBlockType, x, y);
             }
+            ui->codeArea->project->edited = true;
         }
         ui->dragging = 0;
         ui->dragBlockType = -1;
@@ -4034,6 +7165,8 @@ void getBlockDisplayText(Block* block, Sprite* sprite, char* buffer, size_t bufs
         case BLOCK_SET_BRIGHTNESS:
         case BLOCK_CHANGE_SATURATION:
         case BLOCK_SET_SATURATION:
+        case BLOCK_CHANGE_GHOST:
+        case BLOCK_SET_GHOST:
             snprintf(buffer, bufsize, "%s %.1f", name, block->numParam1);
             break;
         case BLOCK_GOTO:
@@ -4066,6 +7199,13 @@ void getBlockDisplayText(Block* block, Sprite* sprite, char* buffer, size_t bufs
         case BLOCK_IF_ELSE:
             snprintf(buffer, bufsize, "%s (%.1f)", name, block->numParam1);
             break;
+        case BLOCK_TOUCHING_COLOR:
+            snprintf(buffer, bufsize, "touching color #%06x?", (int)block->numParam1 & 0xFFFFFF);
+            break;
+        case BLOCK_COLOR_TOUCHING_COLOR:
+            snprintf(buffer, bufsize, "color #%06x is touching #%06x?",
+                     (int)block->numParam1 & 0xFFFFFF, (int)block->numParam2 & 0xFFFFFF);
+            break;
         default:
             snprintf(buffer, bufsize, "%s", name);
             break;
@@ -4100,61 +7240,162 @@ void CodeAreaUI_destroy(CodeAreaUI* ui) {
     delete ui;
 }
 
+BlockTileAtlas* BlockTileAtlas_create(SDL_Renderer* renderer, int tileW, int tileH) {
+    BlockTileAtlas* atlas = new BlockTileAtlas;
+    atlas->renderer = renderer;
+    atlas->page = NULL;
+    atlas->tileW = tileW;
+    atlas->tileH = tileH;
+    atlas->columns = BLOCK_TILE_ATLAS_SIZE / tileW;
+    int slots = atlas->columns * (BLOCK_TILE_ATLAS_SIZE / tileH);
+    atlas->owners.assign(slots, nullptr);
+    atlas->where.resize(slots);
+    for (int i = 0; i < slots; i++) {
+        atlas->lru.push_back(i);
+        atlas->where[i] = prev(atlas->lru.end());
+    }
+    return atlas;
+}
+
+void BlockTileAtlas_destroy(BlockTileAtlas* atlas) {
+    if (!atlas) return;
+    for (Block* b : atlas->owners) {
+        if (b) b->tileSlot = -1;
+    }
+    if (atlas->page) SDL_DestroyTexture(atlas->page);
+    delete atlas;
+}
+
+void BlockTileAtlas_release(BlockTileAtlas* atlas, Block* block) {
+    if (!atlas || block->tileSlot < 0) return;
+    int slot = block->tileSlot;
+    atlas->owners[slot] = nullptr;
+    // خانه‌ی آزاد اولین گزینه برای بلوک بعدی است
+    atlas->lru.splice(atlas->lru.end(), atlas->lru, atlas->where[slot]);
+    block->tileSlot = -1;
+}
+
+// محتوای بافت‌های هدف با SDL_RENDER_TARGETS_RESET از دست می‌رود
+void BlockTileAtlas_invalidate(BlockTileAtlas* atlas) {
+    if (!atlas) return;
+    for (Block* b : atlas->owners) {
+        if (b) b->tileDirty = true;
+    }
+}
+
+SDL_Texture* CodeAreaUI_blockTile(CodeAreaUI* ui, Block* block, SDL_Rect* src) {
+    BlockTileAtlas* atlas = gBlockTiles;
+    if (!atlas) return nullptr;
+    if (!atlas->page) {
+        atlas->page = SDL_CreateTexture(ui->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+                                        BLOCK_TILE_ATLAS_SIZE, BLOCK_TILE_ATLAS_SIZE);
+        if (!atlas->page) return nullptr;
+    }
+    int w = atlas->tileW, h = atlas->tileH;
+    if (block->tileSlot < 0) {
+        // قدیمی‌ترین خانه از صاحب قبلی‌اش گرفته می‌شود
+        int slot = atlas->lru.back();
+        if (atlas->owners[slot]) atlas->owners[slot]->tileSlot = -1;
+        atlas->owners[slot] = block;
+        block->tileSlot = slot;
+        block->tileDirty = true;
+    }
+    int slot = block->tileSlot;
+    atlas->lru.splice(atlas->lru.begin(), atlas->lru, atlas->where[slot]);
+    *src = {(slot % atlas->columns) * w, (slot / atlas->columns) * h, w, h};
+    if (!block->tileDirty) return atlas->page;
+
+    SDL_Texture* prevTarget = SDL_GetRenderTarget(ui->renderer);
+    SDL_Rect prevClip;
+    SDL_RenderGetClipRect(ui->renderer, &prevClip);
+    bool clipped = SDL_RenderIsClipEnabled(ui->renderer);
+
+    SDL_SetRenderTarget(ui->renderer, atlas->page);
+    SDL_RenderSetClipRect(ui->renderer, src);
+    SDL_Color color = get_block_color(block->type);
+    SDL_SetRenderDrawColor(ui->renderer, color.r, color.g, color.b, 255);
+    SDL_RenderFillRect(ui->renderer, src);
+    SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
+    SDL_RenderDrawRect(ui->renderer, src);
+    if (ui->font) {
+        char blockText[256];
+        getBlockDisplayText(block, nullptr, blockText, sizeof(blockText));
+        CachedText* label = TextCache_get(gTextCache, ui->font, blockText, {0,0,0,255});
+        if (label) {
+            SDL_Rect textRect = {src->x + 5, src->y + (h - label->h)/2, label->w, label->h};
+            SDL_RenderCopy(ui->renderer, label->texture, NULL, &textRect);
+        }
+    }
+
+    SDL_SetRenderTarget(ui->renderer, prevTarget);
+    SDL_RenderSetClipRect(ui->renderer, clipped ? &prevClip : NULL);
+    block->tileDirty = false;
+    return atlas->page;
+}
+
 void CodeAreaUI_render(CodeAreaUI* ui) {
     SDL_SetRenderDrawColor(ui->renderer, 100, 100, 100, 255);
     SDL_RenderDrawRect(ui->renderer, &ui->rect);
 
     if (ui->selectedSpriteIndex >= 0 && ui->selectedSpriteIndex < (int)ui->project->sprites.size()) {
         Sprite* s = ui->project->sprites[ui->selectedSpriteIndex];
-        int scriptSpacing = 10;
-        int scriptWidth = 180;
-        int blockHeight = 40;
-        int blockGap = 2;
+        int scriptSpacing = CODE_SCRIPT_SPACING;
+        int scriptWidth = CODE_SCRIPT_WIDTH;
+        int blockHeight = CODE_BLOCK_HEIGHT;
+        int blockGap = CODE_BLOCK_GAP;
 
-        vector<int> execScripts, execPCs;
+        // (script << 32 | pc) برای همه‌ی کانتکست‌های در حال اجرای این اسپرایت
+        unordered_set<Uint64> execPCs;
         if (ui->engine) {
             for (size_t k = 0; k < ui->engine->contexts.size(); k++) {
                 ExecutionContext* ctx = ui->engine->contexts[k];
                 if (ctx->spriteId == ui->selectedSpriteIndex) {
-                    execScripts.push_back(ctx->scriptId);
-                    execPCs.push_back(ctx->pc);
+                    execPCs.insert(((Uint64)(Uint32)ctx->scriptId << 32) | (Uint32)ctx->pc);
                 }
             }
         }
 
-        for (size_t i = 0; i < s->scripts.size(); i++) {
+        SDL_SetRenderDrawBlendMode(ui->renderer, SDL_BLENDMODE_BLEND);
+        // فقط بازه‌ی قابل مشاهده پیمایش می‌شود
+        int scriptStride = scriptWidth + scriptSpacing;
+        int blockStride = blockHeight + blockGap;
+        int firstScript = max(0, (ui->scrollX - CODE_MARGIN - scriptWidth) / scriptStride);
+        int lastScript = min((int)s->scripts.size() - 1, (ui->scrollX + ui->rect.w - CODE_MARGIN) / scriptStride);
+        int firstBlock = max(0, (ui->scrollY - CODE_MARGIN - blockHeight) / blockStride);
+        int lastBlockInView = (ui->scrollY + ui->rect.h - CODE_MARGIN) / blockStride;
+        for (int i = firstScript; i <= lastScript; i++) {
             Script* script = s->scripts[i];
-            int scriptX = ui->rect.x + 10 + i * (scriptWidth + scriptSpacing) - ui->scrollX;
-            int scriptY = ui->rect.y + 10 - ui->scrollY;
+            int scriptX = ui->rect.x + CODE_MARGIN + i * scriptStride - ui->scrollX;
+            int scriptY = ui->rect.y + CODE_MARGIN - ui->scrollY;
             if (scriptX + scriptWidth > ui->rect.x && scriptX < ui->rect.x + ui->rect.w) {
-                for (size_t j = 0; j < script->blocks.size(); j++) {
+                int lastBlock = min((int)script->blocks.size() - 1, lastBlockInView);
+                for (int j = firstBlock; j <= lastBlock; j++) {
                     int blockY = scriptY + j * (blockHeight + blockGap);
                     if (blockY + blockHeight > ui->rect.y && blockY < ui->rect.y + ui->rect.h) {
                         Block* block = script->blocks[j];
-                        SDL_Color color = get_block_color(block->type);
+                        SDL_Rect blockRect = {scriptX, blockY, scriptWidth - 10, blockHeight};
+                        bool isExecuting = !execPCs.empty() && execPCs.count(((Uint64)(Uint32)i << 32) | (Uint32)j) > 0;
+                        bool isEditing = (ui->editingScript == (int)i && ui->editingBlock == (int)j);
 
-                        bool isExecuting = false;
-                        for (size_t k = 0; k < execScripts.size(); k++) {
-                            if (execScripts[k] == (int)i && execPCs[k] == (int)j) {
-                                isExecuting = true;
-                                break;
+                        if (isEditing) {
+                            SDL_Color color = get_block_color(block->type);
+                            SDL_SetRenderDrawColor(ui->renderer, color.r, color.g, color.b, 255);
+                            SDL_RenderFillRect(ui->renderer, &blockRect);
+                            SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
+                            SDL_RenderDrawRect(ui->renderer, &blockRect);
+                            if (ui->font) {
+                                drawGlyphText(ui->renderer, ui->font, ui->editBuffer.c_str(), scriptX + 5,
+                                              blockY + (blockHeight - TTF_FontHeight(ui->font))/2, {0,0,0,255});
                             }
+                        } else {
+                            SDL_Rect src;
+                            SDL_Texture* tile = CodeAreaUI_blockTile(ui, block, &src);
+                            if (tile) SDL_RenderCopy(ui->renderer, tile, &src, &blockRect);
                         }
-                        if (isExecuting) {
-                            if (color.r > 170) color.r = 255; else color.r = (Uint8)(color.r * 1.5);
-                            if (color.g > 170) color.g = 255; else color.g = (Uint8)(color.g * 1.5);
-                            if (color.b > 170) color.b = 255; else color.b = (Uint8)(color.b * 1.5);
-                        }
-
-                        bool isEditing = (ui->editingScript == (int)i && ui->editingBlock == (int)j);
-
-                        SDL_SetRenderDrawColor(ui->renderer, color.r, color.g, color.b, 255);
-                        SDL_Rect blockRect = {scriptX, blockY, scriptWidth - 10, blockHeight};
-                        SDL_RenderFillRect(ui->renderer, &blockRect);
-                        SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
-                        SDL_RenderDrawRect(ui->renderer, &blockRect);
 
                         if (isExecuting) {
+                            SDL_SetRenderDrawColor(ui->renderer, 255, 255, 255, 90);
+                            SDL_RenderFillRect(ui->renderer, &blockRect);
                             SDL_SetRenderDrawColor(ui->renderer, 255, 0, 0, 255);
                             for (int thick = 1; thick <= 2; thick++) {
                                 SDL_Rect borderRect = {scriptX - thick, blockY - thick, scriptWidth - 10 + 2*thick, blockHeight + 2*thick};
@@ -4168,28 +7409,11 @@ void CodeAreaUI_render(CodeAreaUI* ui) {
                                 SDL_RenderDrawRect(ui->renderer, &borderRect);
                             }
                         }
-
-                        char blockText[256];
-                        if (isEditing) {
-                            snprintf(blockText, sizeof(blockText), "%s", ui->editBuffer.c_str());
-                        } else {
-                            getBlockDisplayText(block, s, blockText, sizeof(blockText));
-                        }
-
-                        if (ui->font) {
-                            SDL_Surface* surf = TTF_RenderText_Blended(ui->font, blockText, {0,0,0,255});
-                            if (surf) {
-                                SDL_Texture* tex = SDL_CreateTextureFromSurface(ui->renderer, surf);
-                                SDL_Rect textRect = {scriptX + 5, blockY + (blockHeight - surf->h)/2, surf->w, surf->h};
-                                SDL_RenderCopy(ui->renderer, tex, NULL, &textRect);
-                                SDL_DestroyTexture(tex);
-                                SDL_FreeSurface(surf);
-                            }
-                        }
                     }
                 }
             }
         }
+        SDL_SetRenderDrawBlendMode(ui->renderer, SDL_BLENDMODE_NONE);
     }
 }
 
@@ -4202,23 +7426,10 @@ void CodeAreaUI_handleEvent(CodeAreaUI* ui, SDL_Event* e) {
                 return;
             }
             Sprite* sprite = ui->project->sprites[ui->selectedSpriteIndex];
-            int scriptSpacing = 10;
-            int scriptWidth = 180;
-            int blockHeight = 40;
+            int scriptSpacing = CODE_SCRIPT_SPACING;
+            int scriptWidth = CODE_SCRIPT_WIDTH;
             int hitScript = -1, hitBlock = -1;
-            for (size_t i = 0; i < sprite->scripts.size(); i++) {
-                int scriptX = ui->rect.x + 10 + i * (scriptWidth + scriptSpacing) - ui->scrollX;
-                if (x < scriptX || x > scriptX + scriptWidth - 10) continue;
-                for (size_t j = 0; j < sprite->scripts[i]->blocks.size(); j++) {
-                    int blockY = ui->rect.y + 10 - ui->scrollY + j * (blockHeight + 2);
-                    if (y >= blockY && y <= blockY + blockHeight) {
-                        hitScript = i;
-                        hitBlock = j;
-                        break;
-                    }
-                }
-                if (hitScript != -1) break;
-            }
+            findBlockAt(ui, x, y, &hitScript, &hitBlock);
             if (hitScript != -1 && hitBlock != -1) {
                 if (e->button.button == SDL_BUTTON_LEFT) {
                     Block* block = sprite->scripts[hitScript]->blocks[hitBlock];
@@ -4251,12 +7462,22 @@ void CodeAreaUI_handleEvent(CodeAreaUI* ui, SDL_Event* e) {
                     } else if (block->type == BLOCK_IF || block->type == BLOCK_IF_ELSE) {
                         paramIndex = 0;
                         printf("Editing IF/IF-ELSE condition\n");
+                    } else if (block->type == BLOCK_COLOR_TOUCHING_COLOR) {
+                        int blockScreenX = ui->rect.x + 10 + hitScript * (scriptWidth + scriptSpacing) - ui->scrollX;
+                        int blockWidth = scriptWidth - 10;
+                        paramIndex = (x > blockScreenX + blockWidth / 2) ? 1 : 0;
                     }
                     ui->editingScript = hitScript;
                     ui->editingBlock = hitBlock;
                     ui->editingParam = paramIndex;
                     if (paramIndex == 0 && (block->type == BLOCK_SAY || block->type == BLOCK_THINK)) {
                         ui->editBuffer = block->strParam;
+                    } else if (block->type == BLOCK_TOUCHING_COLOR || block->type == BLOCK_COLOR_TOUCHING_COLOR) {
+                        // رنگ‌ها به صورت #rrggbb ویرایش می‌شوند
+                        float val = (paramIndex == 0) ? block->numParam1 : block->numParam2;
+                        char buf[32];
+                        snprintf(buf, sizeof(buf), "#%06x", (int)val & 0xFFFFFF);
+                        ui->editBuffer = buf;
                     } else {
                         float val = (paramIndex == 0) ? block->numParam1 : block->numParam2;
                         char buf[32];
@@ -4279,6 +7500,7 @@ void CodeAreaUI_handleEvent(CodeAreaUI* ui, SDL_Event* e) {
                     if (hitScript < (int)sprite->scripts.size()) {
                         preprocess_script(sprite->scripts[hitScript]);
                     }
+                    ui->project->edited = true;
                 }
             } else {
                 ui->selectedScriptIndex = -1;
@@ -4304,9 +7526,18 @@ void CodeAreaUI_handleEvent(CodeAreaUI* ui, SDL_Event* e) {
                     Script* script = sprite->scripts[ui->editingScript];
                     if (ui->editingBlock < (int)script->blocks.size()) {
                         Block* block = script->blocks[ui->editingBlock];
+                        block->tileDirty = true;
+                        ui->project->edited = true;
                         if (ui->editingParam == 0 && (block->type == BLOCK_SAY || block->type == BLOCK_THINK)) {
                             block->strParam = ui->editBuffer;
                             printf("Set strParam to %s\n", ui->editBuffer.c_str());
+                        } else if (block->type == BLOCK_TOUCHING_COLOR || block->type == BLOCK_COLOR_TOUCHING_COLOR) {
+                            const char* hex = ui->editBuffer.c_str();
+                            if (*hex == '#') hex++;
+                            float newVal = (float)(strtol(hex, NULL, 16) & 0xFFFFFF);
+                            if (ui->editingParam == 0) block->numParam1 = newVal;
+                            else block->numParam2 = newVal;
+                            printf("Set color param %d to #%06x\n", ui->editingParam, (int)newVal);
                         } else {
                             float newVal = (float)atof(ui->editBuffer.c_str());
                             if (ui->editingParam == 0) {
@@ -4361,38 +7592,20 @@ void CodeAreaUI_addBlockAt(CodeAreaUI* ui, int blockType, int screenX, int scree
     int canvasX = screenX - ui->rect.x + ui->scrollX;
     int canvasY = screenY - ui->rect.y + ui->scrollY;
 
-    int scriptIndex = -1;
-    for (size_t i = 0; i < sprite->scripts.size(); i++) {
-        int scriptLeft = 10 + i * (180 + 10);
-        int scriptRight = scriptLeft + 180;
-        if (canvasX >= scriptLeft && canvasX <= scriptRight) {
-            scriptIndex = i;
-            break;
-        }
-    }
-    if (scriptIndex == -1) return;
+    int scriptStride = CODE_SCRIPT_WIDTH + CODE_SCRIPT_SPACING;
+    int blockStride = CODE_BLOCK_HEIGHT + CODE_BLOCK_GAP;
+    int relX = canvasX - CODE_MARGIN;
+    if (relX < 0 || relX % scriptStride > CODE_SCRIPT_WIDTH) return;
+    int scriptIndex = relX / scriptStride;
+    if (scriptIndex >= (int)sprite->scripts.size()) return;
 
     Script* script = sprite->scripts[scriptIndex];
 
-    int scriptTop = 10;
+    // روی یک بلوک یا فاصله‌ی بعد از آن رها شود، بعد از همان بلوک درج می‌شود
+    int scriptTop = CODE_MARGIN;
     int insertIndex = 0;
-    if (canvasY < scriptTop) {
-        insertIndex = 0;
-    } else {
-        for (size_t j = 0; j < script->blocks.size(); j++) {
-            int blockTop = scriptTop + j * (40 + 2);
-            int blockBottom = blockTop + 40;
-            if (canvasY >= blockTop && canvasY <= blockBottom) {
-                insertIndex = j + 1;
-                break;
-            } else if (canvasY < blockTop) {
-                insertIndex = j;
-                break;
-            }
-        }
-        if (insertIndex == 0 && !script->blocks.empty() && canvasY > scriptTop + (int)script->blocks.size() * (40 + 2)) {
-            insertIndex = script->blocks.size();
-        }
+    if (canvasY >= scriptTop) {
+        insertIndex = min((int)script->blocks.size(), (canvasY - scriptTop) / blockStride + 1);
     }
 
     Block* newBlock = new Block;
@@ -4464,13 +7677,120 @@ Project* Project_create() {
     Project* proj = new Project;
     proj->currentBackdrop = -1;
     proj->timerStart = SDL_GetTicks();
+    proj->penLayer = NULL;
+    proj->penScale = 1;
+    proj->penRaster = NULL;
+    SDL_AtomicSet(&proj->stageColorsValid, 0);
+    proj->penReadTarget = NULL;
+    proj->penMirrorDirty = true;
+    SDL_AtomicSet(&proj->penMirrorWanted, 0);
+    proj->grid.stale = true;
+    proj->edited = false;
+    memset(&proj->input, 0, sizeof(proj->input));
     return proj;
 }
 
+// مختصات صحنه به پیکسل لایه‌ی قلم (با ضریب کیفیت)
+void Project_stageToPen(Project* proj, float x, float y, int* outX, int* outY) {
+    *outX = (int)floorf((STAGE_WIDTH/2 + x) * proj->penScale);
+    *outY = (int)floorf((STAGE_HEIGHT/2 - y) * proj->penScale);
+}
+
+// اسپرایت تازه جلوی همه قرار می‌گیرد
+void Project_addSprite(Project* proj, Sprite* sprite) {
+    proj->sprites.push_back(sprite);
+    sprite->layer = (int)proj->drawOrder.size();
+    proj->drawOrder.push_back(sprite);
+    proj->grid.stale = true;
+}
+
+void Project_removeSprite(Project* proj, Sprite* sprite) {
+    proj->sprites.erase(remove(proj->sprites.begin(), proj->sprites.end(), sprite), proj->sprites.end());
+    proj->drawOrder.erase(remove(proj->drawOrder.begin(), proj->drawOrder.end(), sprite), proj->drawOrder.end());
+    for (size_t i = 0; i < proj->drawOrder.size(); i++) proj->drawOrder[i]->layer = (int)i;
+    proj->grid.stale = true;
+}
+
+void Project_setLayer(Project* proj, Sprite* sprite, int rank) {
+    vector<Sprite*>& order = proj->drawOrder;
+    if (order.empty()) return;
+    rank = max(0, min(rank, (int)order.size() - 1));
+    int from = sprite->layer;
+    if (from < 0 || from >= (int)order.size() || order[from] != sprite) return;
+    if (from == rank) return;
+    // فقط اسپرایت‌های بین دو جایگاه یک خانه جابه‌جا می‌شوند
+    if (from < rank) rotate(order.begin() + from, order.begin() + from + 1, order.begin() + rank + 1);
+    else rotate(order.begin() + rank, order.begin() + from, order.begin() + from + 1);
+    for (int i = min(from, rank); i <= max(from, rank); i++) order[i]->layer = i;
+}
+
+// لایه‌های ذخیره‌شده را (با حفظ ترتیب برابرها) به رتبه‌های پیوسته تبدیل می‌کند
+void Project_sortDrawOrder(Project* proj) {
+    proj->drawOrder = proj->sprites;
+    stable_sort(proj->drawOrder.begin(), proj->drawOrder.end(), [](Sprite* a, Sprite* b) { return a->layer < b->layer; });
+    for (size_t i = 0; i < proj->drawOrder.size(); i++) proj->drawOrder[i]->layer = (int)i;
+    proj->grid.stale = true;
+}
+
+// خطوط قلم تا آخر فریم جمع و یکجا روی لایه رسم می‌شوند
+void Project_queuePenLine(Project* proj, int x1, int y1, int x2, int y2, SDL_Color color, int size) {
+    if (proj->penRaster) {
+        PenRaster_line(proj->penRaster, x1 + 0.5f, y1 + 0.5f, x2 + 0.5f, y2 + 0.5f, (float)size, color);
+        return;
+    }
+    ShapeBatch_addLine(&proj->penStrokes, x1 + 0.5f, y1 + 0.5f, x2 + 0.5f, y2 + 0.5f, (float)size, color);
+}
+
+void Project_flushPen(Project* proj, SDL_Renderer* renderer) {
+    if (proj->penRaster) {
+        if (proj->penLayer && !proj->penRaster->dirty.empty()) PenRaster_upload(proj->penRaster, proj->penLayer);
+        return;
+    }
+    if (proj->penStrokes.indices.empty()) return;
+    if (!proj->penLayer) {
+        proj->penStrokes.vertices.clear();
+        proj->penStrokes.indices.clear();
+        return;
+    }
+    SDL_Texture* oldTarget = SDL_GetRenderTarget(renderer);
+    SDL_SetRenderTarget(renderer, proj->penLayer);
+    ShapeBatch_flush(renderer, &proj->penStrokes);
+    SDL_SetRenderTarget(renderer, oldTarget);
+    proj->penMirrorDirty = true;
+}
+
+// لایه‌ی قلم GPU را کوچک‌شده به اندازه‌ی صحنه می‌کشد و می‌خواند تا لمس رنگ قلم را هم ببیند
+void Project_readBackPen(Project* proj, SDL_Renderer* renderer) {
+    if (proj->penRaster || !proj->penLayer || !proj->penMirrorDirty) return;
+    if (!SDL_AtomicGet(&proj->penMirrorWanted)) return;
+    if (!proj->penReadTarget) {
+        proj->penReadTarget = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, STAGE_WIDTH, STAGE_HEIGHT);
+        if (!proj->penReadTarget) return;
+    }
+    SDL_Texture* oldTarget = SDL_GetRenderTarget(renderer);
+    SDL_SetRenderTarget(renderer, proj->penReadTarget);
+    // بدون ترکیب تا آلفای خود قلم حفظ شود
+    SDL_SetTextureBlendMode(proj->penLayer, SDL_BLENDMODE_NONE);
+    SDL_RenderCopy(renderer, proj->penLayer, NULL, NULL);
+    SDL_SetTextureBlendMode(proj->penLayer, SDL_BLENDMODE_BLEND);
+    proj->penMirror.resize((size_t)STAGE_WIDTH * STAGE_HEIGHT);
+    if (SDL_RenderReadPixels(renderer, NULL, SDL_PIXELFORMAT_ARGB8888, proj->penMirror.data(), STAGE_WIDTH * 4) != 0) {
+        proj->penMirror.clear();
+    }
+    SDL_SetRenderTarget(renderer, oldTarget);
+    proj->penMirrorDirty = false;
+    SDL_AtomicSet(&proj->stageColorsValid, 0);
+}
+
 void Project_destroy(Project* proj) {
     for (Sprite* s : proj->sprites) {
         for (Costume* c : s->costumes) {
             if (c->texture) SDL_DestroyTexture(c->texture);
+            if (c->surface) SDL_FreeSurface(c->surface);
+            CostumeAtlas_release(gCostumeAtlas, c->atlasPage);
+            EffectCache_forget(gEffectCache, c);
+            MipChain_destroy(c->mips);
+            Costume_freeMasks(c);
             delete c;
         }
         for (Script* scr : s->scripts) {
@@ -4479,11 +7799,13 @@ void Project_destroy(Project* proj) {
             }
             delete scr;
         }
-        if (s->penCanvas) SDL_DestroyTexture(s->penCanvas);
+        if (s->bubble) SDL_DestroyTexture(s->bubble);
         delete s;
     }
     for (Backdrop* b : proj->backdrops) {
         if (b->texture) SDL_DestroyTexture(b->texture);
+        if (b->surface) SDL_FreeSurface(b->surface);
+        MipChain_destroy(b->mips);
         delete b;
     }
     for (Sound* s : proj->sounds) {
@@ -4493,6 +7815,9 @@ void Project_destroy(Project* proj) {
     for (Variable* v : proj->globalVariables) {
         delete v;
     }
+    if (proj->penLayer) SDL_DestroyTexture(proj->penLayer);
+    if (proj->penReadTarget) SDL_DestroyTexture(proj->penReadTarget);
+    delete proj->penRaster;
     delete proj;
 }
 
@@ -4501,12 +7826,12 @@ bool Project_save(Project* proj, const char* filename) {
     if (!f) return false;
     for (size_t i = 0; i < proj->sprites.size(); i++) {
         Sprite* s = proj->sprites[i];
-        fprintf(f, "sprite,%s,%f,%f,%f,%f,%d,%d,%d,%d,%f,%f,%f,%d,%f,%f,%f,%d\n",
+        fprintf(f, "sprite,%s,%f,%f,%f,%f,%d,%d,%d,%d,%f,%f,%f,%d,%f,%f,%f,%d,%f\n",
                 s->name.c_str(), s->x, s->y, s->direction, s->size,
                 s->visible, s->layer, s->currentCostume,
                 s->penDown, s->penHue, s->penSaturation, s->penBrightness, s->penSize,
                 s->colorEffect, s->brightnessEffect, s->saturationEffect,
-                s->draggable);
+                s->draggable, s->ghostEffect);
         for (size_t j = 0; j < s->costumes.size(); j++) {
             fprintf(f, "costume,%s,%s\n", s->name.c_str(), s->costumes[j]->name.c_str());
         }
@@ -4564,14 +7889,18 @@ bool Project_load(Project* proj, const char* filename) {
             float brightnessEffect = atof(strtok(NULL, ","));
             float saturationEffect = atof(strtok(NULL, ","));
             int draggable = atoi(strtok(NULL, ","));
+            // فایل‌های قدیمی ستون شبح ندارند
+            char* ghostToken = strtok(NULL, ",");
+            float ghostEffect = ghostToken ? atof(ghostToken) : 0;
             Sprite* s = new Sprite;
             s->name = name;
-            s->x = x; s->y = y; s->direction = dir; s->size = size;
+            s->x = x; s->y = y; s->prevX = x; s->prevY = y; s->direction = dir; s->size = size;
             s->visible = visible; s->layer = layer; s->currentCostume = currCostume;
             s->draggable = draggable; s->penDown = penDown; s->penHue = penHue;
             s->penSaturation = penSat; s->penBrightness = penBright; s->penSize = penSize;
-            s->penCanvas = NULL; s->colorEffect = colorEffect;
+            s->colorEffect = colorEffect;
             s->brightnessEffect = brightnessEffect; s->saturationEffect = saturationEffect;
+            s->ghostEffect = ghostEffect;
             proj->sprites.push_back(s);
         } else if (strcmp(token, "costume") == 0) {
             char* spriteName = strtok(NULL, ",");
@@ -4628,6 +7957,7 @@ bool Project_load(Project* proj, const char* filename) {
         }
     }
     fclose(f);
+    Project_sortDrawOrder(proj);
     for (Sprite* s : proj->sprites) {
         for (Script* scr : s->scripts) {
             preprocess_script(scr);
@@ -4638,21 +7968,21 @@ bool Project_load(Project* proj, const char* filename) {
 
 void Project_addDefaultSprite(Project* proj, const char* name) {
     Sprite* s = new Sprite;
-    s->name = name; s->x = 0; s->y = 0; s->direction = 90; s->size = 100;
+    s->name = name; s->x = 0; s->y = 0; s->prevX = 0; s->prevY = 0; s->direction = 90; s->size = 100;
     s->visible = 1; s->layer = 0; s->currentCostume = 0; s->draggable = true;
     s->penDown = false; s->penHue = 0; s->penSaturation = 100; s->penBrightness = 100; s->penSize = 1;
-    s->penCanvas = NULL; s->colorEffect = 0; s->brightnessEffect = 100; s->saturationEffect = 100;
+    s->colorEffect = 0; s->brightnessEffect = 100; s->saturationEffect = 100; s->ghostEffect = 0;
     Sprite_addDefaultCostume(s, "costume1");
     Script* script = new Script;
     Block* block = new Block; block->type = BLOCK_WHEN_FLAG_CLICKED; block->numParam1 = 0; block->bodyEnd = -1;
     Block* showBlock = new Block; showBlock->type = BLOCK_SHOW; showBlock->numParam1 = 0; showBlock->bodyEnd = -1;
     script->blocks.push_back(block); script->blocks.push_back(showBlock);
     s->scripts.push_back(script);
-    proj->sprites.push_back(s);
+    Project_addSprite(proj, s);
 }
 
 void Project_addDefaultBackdrop(Project* proj, const char* name) {
-    Backdrop* b = new Backdrop; b->name = name; b->texture = NULL;
+    Backdrop* b = new Backdrop; b->name = name; b->texture = NULL; b->mips = NULL; b->surface = NULL;
     proj->backdrops.push_back(b);
     if (proj->currentBackdrop == -1) proj->currentBackdrop = 0;
 }
@@ -4678,24 +8008,43 @@ void Project_addSoundFromFile(Project* proj, const char* name, const char* filep
 }
 
 void Sprite_addDefaultCostume(Sprite* sprite, const char* name) {
-    Costume* c = new Costume; c->name = name; c->texture = NULL;
+    Costume* c = new Costume; c->name = name; c->texture = NULL; c->surface = NULL; c->atlasPage = NULL; c->mips = NULL; c->mask = NULL;
     sprite->costumes.push_back(c);
 }
 
 void Sprite_addCostumeFromFile(Sprite* sprite, SDL_Renderer* renderer, const char* filepath) {
-    SDL_Texture* tex = loadTexture(renderer, filepath);
-    if (!tex) return;
+    SDL_Surface* surf = IMG_Load(filepath);
+    if (!surf) {
+        printf("Unable to load image %s! SDL_image Error: %s\n", filepath, IMG_GetError());
+        return;
+    }
+    SDL_Texture* tex = SDL_CreateTextureFromSurface(renderer, surf);
+    if (!tex) {
+        printf("Unable to create texture from %s! SDL Error: %s\n", filepath, SDL_GetError());
+        SDL_FreeSurface(surf);
+        return;
+    }
+    SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
     Costume* c = new Costume; c->name = filepath; c->texture = tex;
+    // نسخه‌ی CPU برای تمبر نرم‌افزاری
+    c->surface = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_ARGB8888, 0);
+    CostumeAtlas_add(gCostumeAtlas, surf, c);
+    c->mips = MipChain_create(c->surface);
+    c->mask = CollisionMask_fromSurface(c->surface);
+    SDL_FreeSurface(surf);
     sprite->costumes.push_back(c);
 }
 
 ExecutionEngine* ExecutionEngine_create(Project* proj) {
     ExecutionEngine* eng = new ExecutionEngine; eng->project = proj; eng->stepMode = false;
+    eng->parallel = false; eng->pool = NULL;
     return eng;
 }
 
 void ExecutionEngine_destroy(ExecutionEngine* eng) {
     for (ExecutionContext* ctx : eng->contexts) delete ctx;
+    if (eng->pool) WorkerPool_destroy(eng->pool);
+    for (SpriteTickGroup* group : eng->groups) delete group;
     delete eng;
 }
 
@@ -4704,6 +8053,7 @@ void ExecutionEngine_addContext(ExecutionEngine* eng, int spriteId, int scriptId
     ctx->spriteId = spriteId; ctx->scriptId = scriptId; ctx->pc = 0; ctx->waitUntil = 0;
     ctx->repeatCount = 0; ctx->ifElseBranch = 0; ctx->waitingForSoundChannel = -1;
     ctx->waitingForAnswer = false; ctx->parent = NULL; ctx->childrenLeft = 0; ctx->waitingForChildren = false;
+    ctx->group = NULL; ctx->finished = false;
     eng->contexts.push_back(ctx);
 }
 
@@ -4735,14 +8085,30 @@ void Application_shutdown(Application* app) {
     if (app->spriteManagerUI) SpriteManagerUI_destroy(app->spriteManagerUI);
     if (app->engine) ExecutionEngine_destroy(app->engine);
     if (app->currentProject) Project_destroy(app->currentProject);
+    MipBuilder_destroy(gMipBuilder); gMipBuilder = nullptr;
+    if (app->uiLayer) SDL_DestroyTexture(app->uiLayer);
+    if (app->stageTarget) SDL_DestroyTexture(app->stageTarget);
+    TextCache_destroy(gTextCache); gTextCache = nullptr;
+    BlockTileAtlas_destroy(gBlockTiles); gBlockTiles = nullptr;
+    CostumeAtlas_destroy(gCostumeAtlas); gCostumeAtlas = nullptr;
+    EffectCache_destroy(gEffectCache); gEffectCache = nullptr;
+    for (GlyphAtlas* atlas : gGlyphAtlases) GlyphAtlas_destroy(atlas);
+    gGlyphAtlases.clear();
     if (app->renderer) SDL_DestroyRenderer(app->renderer);
     if (app->window) SDL_DestroyWindow(app->window);
+    if (app->simLock) SDL_DestroyMutex(app->simLock);
+    if (app->simWake) SDL_DestroySemaphore(app->simWake);
+    CollisionMask_collectRetired();
+    if (gMaskLock) SDL_DestroyMutex(gMaskLock);
+    if (gStageColorLock) SDL_DestroyMutex(gStageColorLock);
+    if (gErrorLock) SDL_DestroyMutex(gErrorLock);
     Mix_CloseAudio(); IMG_Quit(); TTF_Quit(); SDL_Quit();
 }
 
 void free_block(Block* b) {
     if (!b) return;
     for (Block* child : b->children) free_block(child);
+    BlockTileAtlas_release(gBlockTiles, b);
     delete b;
 }
 